@@ -0,0 +1,488 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2022      Antonio Fermiano
+//
+// This file is part of libecm.
+//
+// libecm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libecm is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// Benchmarks of the sector kernels and of whole conversions, on synthetic
+// images built with the library's own reconstruct_sector()
+//
+
+#include "common.h"
+#include "ecm.h"
+#include "sector.h"
+
+#include <math.h>
+
+#define JSON "--json"
+#define SECTORS "--sectors"
+#define DIR "--dir"
+#define FILTER "--filter"
+
+#define DEFAULT_SECTORS 10000
+#define MIN_SECONDS 0.5
+
+// Trying every byte is slow on some data, only a part of the image is scanned
+#define SCAN_BYTES 0x10000
+#define MAX_STEP_IN_BYTES (1*1024*1024)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Synthetic images
+//
+
+typedef enum _ImageKind { IMAGE_MODE1,
+                          IMAGE_XA,
+                          IMAGE_CDDA,
+                          IMAGE_GARBAGE,
+                          IMAGE_PREGAP,
+                          IMAGE_MIXED } ImageKind;
+
+static const char * const image_names[] = { "mode1", "xa", "cdda", "garbage", "pregap", "mixed" };
+
+#define IMAGE_KINDS 6
+
+typedef struct _Image {
+    uint8_t* data;
+    size_t size;
+    size_t sectors;
+} Image;
+
+//
+// Same sequence on every run, so results can be compared
+//
+static uint32_t random_state;
+
+static uint32_t next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static void fill_random(uint8_t* data, size_t size) {
+    size_t i;
+    for(i = 0; i < size; i++) {
+        data[i] = (uint8_t)(next_random() >> 24);
+    }
+}
+
+static uint8_t to_bcd(uint32_t value) {
+    return (uint8_t)(((value / 10) << 4) | (value % 10));
+}
+
+//
+// A raw sector of the given type (1, 2 or 3) at this LBA, with random data
+//
+static void make_sector(uint8_t* sector, uint32_t lba, int8_t type) {
+    const uint32_t address = lba + 150;
+    fill_random(sector + 0x010, 2352 - 0x010);
+    sector[0x00C] = to_bcd(address / (60 * 75));
+    sector[0x00D] = to_bcd((address / 75) % 60);
+    sector[0x00E] = to_bcd(address % 75);
+    if(type != 1) {
+        // XA subheader: file, channel, submode (data or form 2), coding
+        sector[0x014] = 0x00;
+        sector[0x015] = 0x00;
+        sector[0x016] = (type == 3) ? 0x20 : 0x08;
+        sector[0x017] = 0x00;
+    }
+    reconstruct_sector(sector, type);
+}
+
+//
+// Audio that isn't just noise, a couple of sines with some dither
+//
+static void make_audio(uint8_t* data, size_t size, size_t position) {
+    size_t i;
+    for(i = 0; i + 4 <= size; i += 4) {
+        const double t = (double)(position + i) / (4.0 * 44100.0);
+        const int16_t sample = (int16_t)(8000.0 * sin(2 * 3.14159265 * 440.0 * t) + 3000.0 * sin(2 * 3.14159265 * 1250.0 * t) + (int)(next_random() % 64) - 32);
+        data[i    ] = (uint8_t)sample;
+        data[i + 1] = (uint8_t)(sample >> 8);
+        data[i + 2] = (uint8_t)sample;
+        data[i + 3] = (uint8_t)(sample >> 8);
+    }
+}
+
+static int8_t make_image(Image* image, ImageKind kind, size_t sectors) {
+    size_t i;
+    size_t at = 0;
+
+    // Garbage adds up to 7 bytes per sector
+    image->data = malloc(sectors * (2352 + 8));
+    if(image->data == NULL) {
+        return 0;
+    }
+    image->sectors = sectors;
+    random_state = 0x12345678u + (uint32_t)kind;
+
+    for(i = 0; i < sectors; i++) {
+        uint8_t* sector = image->data + at;
+        ImageKind sector_kind = kind;
+        if(kind == IMAGE_MIXED) {
+            // Pregap, data track, XA, audio and some garbage, in proportion
+            static const ImageKind layout[] = { IMAGE_PREGAP, IMAGE_MODE1, IMAGE_MODE1, IMAGE_MODE1, IMAGE_XA, IMAGE_XA, IMAGE_CDDA, IMAGE_CDDA, IMAGE_CDDA, IMAGE_GARBAGE };
+            sector_kind = layout[(i * 10 / sectors) % 10];
+        }
+        switch(sector_kind) {
+        case IMAGE_MODE1:
+            make_sector(sector, (uint32_t)i, 1);
+            break;
+        case IMAGE_XA:
+            // Runs of form 1 with form 2 in between, as in video files
+            make_sector(sector, (uint32_t)i, (i % 8 < 6) ? 2 : 3);
+            break;
+        case IMAGE_CDDA:
+            make_audio(sector, 2352, at);
+            break;
+        case IMAGE_GARBAGE:
+            // Sectors that don't start where sectors should
+            fill_random(sector, i % 8);
+            at += i % 8;
+            make_sector(image->data + at, (uint32_t)i, 1);
+            if(i % 3 == 0) {
+                fill_random(image->data + at + 0x100, 16);
+            }
+            break;
+        default:
+            // Audio pregap, then the zero filled sectors that start data tracks
+            memset(sector, 0, 2352);
+            if(i >= sectors / 2) {
+                reconstruct_sector(sector, 1);
+                sector[0x00C] = to_bcd((uint32_t)(i + 150) / (60 * 75));
+                sector[0x00D] = to_bcd((uint32_t)((i + 150) / 75) % 60);
+                sector[0x00E] = to_bcd((uint32_t)(i + 150) % 75);
+                reconstruct_sector(sector, 1);
+            }
+            break;
+        }
+        at += 2352;
+    }
+    image->size = at;
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Timing and results
+//
+
+static int json;
+static int first_result = 1;
+static const char* filter;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int selected(const char* name, const char* image) {
+    char full[64];
+    snprintf(full, sizeof(full), "%s/%s", name, image);
+    return filter == NULL || strstr(full, filter) != NULL;
+}
+
+static void report(const char* name, const char* image, double bytes, double sectors, double seconds) {
+    const double mb_per_s = bytes / seconds / 1e6;
+    const double sectors_per_s = sectors / seconds;
+    if(json) {
+        printf(
+            "%s    {\"name\": \"%s\", \"image\": \"%s\", \"bytes\": %.0f, \"sectors\": %.0f, "
+            "\"seconds\": %.6f, \"mb_per_s\": %.2f, \"sectors_per_s\": %.0f}",
+            first_result ? "" : ",\n", name, image, bytes, sectors, seconds, mb_per_s, sectors_per_s
+        );
+    } else {
+        printf("%-24s %-8s %10.1f MB/s %12.0f sectors/s\n", name, image, mb_per_s, sectors_per_s);
+    }
+    first_result = 0;
+    fflush(stdout);
+}
+
+//
+// Repeat a kernel over the image until enough time went by. Sink keeps the
+// compiler from dropping the work
+//
+static volatile uint32_t sink;
+
+typedef uint32_t (*Kernel)(const Image* image, uint8_t* scratch);
+
+static void run_kernel(const char* name, const Image* image, const char* image_name, Kernel kernel, double bytes_per_pass, double sectors_per_pass) {
+    static uint8_t scratch[2352];
+    double start;
+    double elapsed;
+    int passes = 0;
+    if(!selected(name, image_name)) {
+        return;
+    }
+    start = now();
+    do {
+        sink += kernel(image, scratch);
+        passes++;
+        elapsed = now() - start;
+    } while(elapsed < MIN_SECONDS);
+    report(name, image_name, bytes_per_pass * passes, sectors_per_pass * passes, elapsed);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Kernels, over the sectors of the image where they start every 2352 bytes
+//
+
+static uint32_t bench_edc(const Image* image, uint8_t* scratch) {
+    (void)scratch;
+    return edc_compute(0, image->data, image->size);
+}
+
+static uint32_t bench_ecc_check(const Image* image, uint8_t* scratch) {
+    uint32_t valid = 0;
+    size_t at;
+    (void)scratch;
+    for(at = 0; at + 2352 <= image->size; at += 2352) {
+        const uint8_t* sector = image->data + at;
+        valid += ecc_checksector(sector + 0xC, sector + 0x10, sector + 0x81C);
+    }
+    return valid;
+}
+
+static uint32_t bench_ecc_write(const Image* image, uint8_t* scratch) {
+    size_t at;
+    for(at = 0; at + 2352 <= image->size; at += 2352) {
+        const uint8_t* sector = image->data + at;
+        ecc_writesector(sector + 0xC, sector + 0x10, scratch + 0x81C);
+    }
+    return scratch[0x81C];
+}
+
+static uint32_t bench_detect(const Image* image, uint8_t* scratch) {
+    uint32_t types = 0;
+    size_t at;
+    (void)scratch;
+    for(at = 0; at + 2352 <= image->size; at += 2352) {
+        types += detect_sector_extended(image->data + at, image->size - at);
+    }
+    return types;
+}
+
+//
+// At every byte, as the encoder does where there's no sector
+//
+static size_t scan_size(const Image* image) {
+    return image->size < SCAN_BYTES ? image->size : SCAN_BYTES;
+}
+
+static uint32_t bench_detect_scan(const Image* image, uint8_t* scratch) {
+    uint32_t types = 0;
+    size_t at;
+    (void)scratch;
+    for(at = 0; at < scan_size(image); at++) {
+        types += detect_sector_extended(image->data + at, image->size - at);
+    }
+    return types;
+}
+
+static uint32_t bench_reconstruct(const Image* image, uint8_t* scratch) {
+    size_t at;
+    for(at = 0; at + 2352 <= image->size; at += 2352) {
+        memcpy(scratch, image->data + at, 2352);
+        reconstruct_sector(scratch, 1 + (int8_t)(at / 2352 % 3));
+    }
+    return scratch[0x810];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Whole conversions, through files
+//
+
+static int8_t write_file(const char* name, const Image* image) {
+    FILE* f = fopen(name, "wb");
+    int8_t ok;
+    if(f == NULL) {
+        return 0;
+    }
+    ok = fwrite(image->data, 1, image->size, f) == image->size;
+    return (fclose(f) == 0) && ok;
+}
+
+static int8_t same_as_image(const char* name, const Image* image) {
+    FILE* f = fopen(name, "rb");
+    uint8_t* data = malloc(image->size + 1);
+    int8_t same = 0;
+    if(f != NULL && data != NULL) {
+        same = fread(data, 1, image->size + 1, f) == image->size && memcmp(data, image->data, image->size) == 0;
+    }
+    if(f != NULL) { fclose(f); }
+    free(data);
+    return same;
+}
+
+static int8_t run_conversions(const Image* image, const char* image_name, const char* dir) {
+    char bin_name[1024];
+    char ecm_name[1024];
+    char out_name[1024];
+    int extended;
+    int8_t ok = 1;
+
+    snprintf(bin_name, sizeof(bin_name), "%s/ecm_bench.bin", dir);
+    snprintf(ecm_name, sizeof(ecm_name), "%s/ecm_bench.bin.ecm", dir);
+    snprintf(out_name, sizeof(out_name), "%s/ecm_bench.out", dir);
+    if(!write_file(bin_name, image)) {
+        fprintf(stderr, "Error: can't write %s\n", bin_name);
+        return 0;
+    }
+
+    for(extended = 0; extended <= 1 && ok; extended++) {
+        const char* encode_name = extended ? "encode_extended" : "encode";
+        const char* decode_name = extended ? "decode_extended" : "decode";
+        EncodingOptions encoding_options;
+        DecodingOptions decoding_options;
+        Progress progress;
+        double start;
+
+        if(!selected(encode_name, image_name) && !selected(decode_name, image_name)) {
+            continue;
+        }
+
+        init_encoding_options(&encoding_options);
+        encoding_options.extended_format = extended;
+        remove(ecm_name);
+        start = now();
+        if(prepare_encoding_with_options(bin_name, ecm_name, MAX_STEP_IN_BYTES, &encoding_options, &progress) != SUCCESS) {
+            progress.state = FAILURE;
+        }
+        while(progress.state == IN_PROGRESS) {
+            encode(&progress);
+        }
+        if(progress.state != COMPLETED) {
+            fprintf(stderr, "Error: encoding %s failed\n", image_name);
+            ok = 0;
+            break;
+        }
+        if(selected(encode_name, image_name)) {
+            report(encode_name, image_name, (double)image->size, (double)image->sectors, now() - start);
+        }
+
+        init_decoding_options(&decoding_options);
+        remove(out_name);
+        start = now();
+        if(prepare_decoding_with_options(ecm_name, out_name, MAX_STEP_IN_BYTES, &decoding_options, &progress) != SUCCESS) {
+            progress.state = FAILURE;
+        }
+        while(progress.state == IN_PROGRESS) {
+            decode(&progress);
+        }
+        if(progress.state != COMPLETED || !same_as_image(out_name, image)) {
+            fprintf(stderr, "Error: decoding %s failed\n", image_name);
+            ok = 0;
+            break;
+        }
+        if(selected(decode_name, image_name)) {
+            report(decode_name, image_name, (double)image->size, (double)image->sectors, now() - start);
+        }
+    }
+
+    remove(bin_name);
+    remove(ecm_name);
+    remove(out_name);
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void show_usage(void) {
+    fprintf(stderr,
+        "Usage:\n"
+        "\n"
+        "    ecm_bench [options]\n"
+        "\n"
+        "Options:\n"
+        "\n"
+        "    " JSON "           Print the results as JSON\n"
+        "    " SECTORS " <n>    Sectors of each synthetic image (default %d)\n"
+        "    " DIR " <dir>      Where to write the files of the conversions (default .)\n"
+        "    " FILTER " <text>  Only run the benchmarks whose name/image contains it\n",
+        DEFAULT_SECTORS
+    );
+}
+
+int main(int argc, char **argv) {
+    size_t sectors = DEFAULT_SECTORS;
+    const char* dir = ".";
+    int kind;
+    int failed = 0;
+
+    for(int i = 1; i < argc; i++){
+        if(strcmp(JSON, argv[i]) == 0){
+            json = 1;
+        }
+        else if(strcmp(SECTORS, argv[i]) == 0 && i + 1 < argc){
+            sectors = (size_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if(strcmp(DIR, argv[i]) == 0 && i + 1 < argc){
+            dir = argv[++i];
+        }
+        else if(strcmp(FILTER, argv[i]) == 0 && i + 1 < argc){
+            filter = argv[++i];
+        }
+        else{
+            show_usage();
+            return 1;
+        }
+    }
+    if(sectors < 10){
+        show_usage();
+        return 1;
+    }
+
+    eccedc_init();
+
+    if(json) {
+        printf("{\n  \"sectors\": %lu,\n  \"results\": [\n", (unsigned long)sectors);
+    }
+
+    for(kind = 0; kind < IMAGE_KINDS && !failed; kind++) {
+        const char* name = image_names[kind];
+        Image image;
+        if(!make_image(&image, (ImageKind)kind, sectors)) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+
+        const double size = (double)image.size;
+        const double aligned_sectors = (double)(image.size / 2352);
+
+        run_kernel("edc_compute", &image, name, bench_edc, size, (double)image.sectors);
+        run_kernel("ecc_checksector", &image, name, bench_ecc_check, size, aligned_sectors);
+        run_kernel("ecc_writesector", &image, name, bench_ecc_write, size, aligned_sectors);
+        run_kernel("detect_sector", &image, name, bench_detect, size, aligned_sectors);
+        run_kernel("detect_sector_scan", &image, name, bench_detect_scan, (double)scan_size(&image), (double)scan_size(&image) / 2352);
+        run_kernel("reconstruct_sector", &image, name, bench_reconstruct, size, aligned_sectors);
+        if(!run_conversions(&image, name, dir)) {
+            failed = 1;
+        }
+
+        free(image.data);
+    }
+
+    if(json) {
+        printf("\n  ]\n}\n");
+    }
+    return failed;
+}
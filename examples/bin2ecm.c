@@ -25,8 +25,31 @@
 #include "cmdlinecommon.h"
 
 #define STDOUT "--stdout"
+#define EXTENDED "--extended"
+#define DEDUP "--dedup"
+#define DICTIONARY "--dictionary"
+#define CUE "--cue"
+#define ARCHIVE "--archive"
+#define HASH "--hash"
+#define IO_URING "--io-uring"
+#define IO_THREADS "--io-threads"
+#define BLOCK_SIZE "--block-size"
+#define DROP_CACHE "--drop-cache"
+#define DIRECT "--direct"
+#define STATS "--stats"
+#define RESUME "--resume"
+#define JOBS "-j"
+
+#define ALL_HASHES (HASH_CRC32 | HASH_MD5 | HASH_SHA1)
+
+#define DEDUP_TABLE_SIZE (512*1024)
+
+#define PROGRESS_INTERVAL_MS 100
 
 static char* tempfilename = NULL;
+static CueSheet cue_sheet;
+static Track tracks[MAX_TRACKS];
+static Stats stats;
 
 static void exit_with_error(){
     if(tempfilename) { free(tempfilename); }
@@ -41,14 +64,198 @@ static void show_usage(){
         "    bin2ecm <cdimagefile>\n"
         "    bin2ecm <cdimagefile> <ecmfile>\n"
         "    bin2ecm " STDOUT " <cdimagefile> \n"
+        "    bin2ecm " ARCHIVE " <cuefile> <archivefile>\n"
+        "    bin2ecm " JOBS " <jobs> <cdimagefile>...\n"
+        "\n"
+        "Options:\n"
+        "\n"
+        "    " EXTENDED "    Use the extended format (more compact, needs a recent ecm2bin)\n"
+        "    " DEDUP "       Store repeated sectors as references to their first copy\n"
+        "                (implies " EXTENDED ", can't be decoded to stdout)\n"
+        "    " DICTIONARY " <file>\n"
+        "                Store sector data in a dictionary shared between images\n"
+        "                (implies " EXTENDED ", decoding needs the same dictionary)\n"
+        "    " CUE " <file>  Use the track layout of the cue sheet of the image\n"
+        "    " ARCHIVE "     Encode all the files of the cue sheet in a single archive\n"
+        "    " HASH "        Show the CRC32, MD5 and SHA-1 of the image (and its tracks)\n"
+        "    " IO_URING "    Read the image in the background with io_uring (Linux)\n"
+        "    " IO_THREADS "  Read the image in the background with a thread\n"
+        "    " BLOCK_SIZE " <size>\n"
+        "                Size of the blocks the image is read in (such as 4M)\n"
+        "    " DROP_CACHE "  Don't keep the files in the page cache\n"
+        "    " DIRECT "      Bypass the page cache (with " IO_URING " or " IO_THREADS ")\n"
+        "    " STATS "       Show where the time went, as JSON on stderr\n"
+        "    " RESUME "      Go on from where an interrupted encoding to the same\n"
+        "                <ecmfile> stopped, if it did\n"
+        "    " JOBS " <jobs>     Encode each of the files to <cdimagefile>.ecm, up to <jobs>\n"
+        "                at a time\n"
     );
 }
 
+//
+// Pick the tracks of the cue sheet that are stored in the input file
+//
+static int select_tracks(const char* infilename){
+    int count = 0;
+    for(int i = 0; i < cue_sheet.track_count; i++){
+        const Track* track = &cue_sheet.tracks[i];
+        if(
+            cue_sheet.file_count == 1 ||
+            strcmp(base_name(cue_sheet.file_names[track->file]), base_name(infilename)) == 0
+        ){
+            tracks[count++] = *track;
+        }
+    }
+    return count;
+}
+
+static void show_progress(const Progress* progress, void* user_data){
+    (void)user_data;
+    fprintf(stderr,
+        "Analyze(%02d%%) Encode(%02d%%)\r", progress->analyze_percentage, progress->encoding_or_decoding_percentage
+    );
+}
+
+//
+// Run the encoder until it's done and show the report
+//
+static void run_encoding(Progress* progress, int silent){
+    do{
+        encode(progress);
+    }while(progress->state == IN_PROGRESS);
+
+    if(progress->state != SUCCESS){
+        fprintf(stderr, "ERROR: %s\n", get_failure_reason_string(progress->failure_reason));
+        exit_with_error();
+    }
+
+    //
+    // Show report
+    //
+    if(!silent){
+        fprintf(stderr, "Literal bytes........... "); fprintdec(stderr, progress->literal_bytes); printf("\n");
+        fprintf(stderr, "Mode 1 sectors.......... "); fprintdec(stderr, progress->mode_1_sectors); printf("\n");
+        fprintf(stderr, "Mode 2 form 1 sectors... "); fprintdec(stderr, progress->mode_2_form_1_sectors); printf("\n");
+        fprintf(stderr, "Mode 2 form 2 sectors... "); fprintdec(stderr, progress->mode_2_form_2_sectors); printf("\n");
+        fprintf(stderr, "Encoded ");
+        fprintdec(stderr, progress->bytes_before_processing);
+        fprintf(stderr, " bytes -> ");
+        fprintdec(stderr, progress->bytes_after_processing);
+        fprintf(stderr, " bytes\n");
+    }
+}
+
+//
+// Show the checksums that were asked for, on stderr when stdout has the output
+//
+static void show_hashes(const Progress* progress, const EncodingOptions* options, const char* name, int silent){
+    FILE* f = silent ? stderr : stdout;
+    char track_name[32];
+    for(int i = 0; i < progress->track_count; i++){
+        sprintf(track_name, "(Track %02d)", i + 1);
+        fprinthashes(f, &progress->track_hashes[i], options->track_hashes, track_name);
+    }
+    if(options->hashes){
+        fprinthashes(f, &progress->hashes, options->hashes, name);
+    }
+}
+
+//
+// Encode one file of a batch to <file>.ecm, with stats of its own
+//
+static int submit_encoding(Scheduler* scheduler, BatchFile* file, void* context){
+    EncodingOptions options = *(EncodingOptions*)context;
+    FailureReason ret;
+
+    file->output_file_name = malloc(strlen(file->input_file_name) + 5);
+    if(!file->output_file_name){
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    strcpy(file->output_file_name, file->input_file_name);
+    strcat(file->output_file_name, ".ecm");
+
+    if(file_exists(file->output_file_name)){
+        fprintf(stderr, "Error: %s exists; refusing to overwrite\n", file->output_file_name);
+        return 1;
+    }
+
+    if(options.stats) options.stats = &file->stats;
+    ret = schedule_encoding(scheduler, file->input_file_name, file->output_file_name, MAX_STEP_IN_BYTES, &options, &file->progress);
+    if(ret != SUCCESS){
+        fprintf(stderr, "ERROR: %s: %s\n", file->input_file_name, get_failure_reason_string(ret));
+        return 1;
+    }
+    return 0;
+}
+
+static void report_encoding(const BatchFile* file, void* context){
+    EncodingOptions* options = (EncodingOptions*)context;
+    show_hashes(&file->progress, options, file->input_file_name, 1);
+    if(options->stats) fprintstats(stderr, &file->stats);
+    fprintf(stderr, "Encoded %s to %s\n", file->input_file_name, file->output_file_name);
+}
+
+//
+// Encode every file of the cue sheet, which are found next to it, as a member
+// of the archive
+//
+static void encode_archive(char* cuefilename, char* archivefilename, EncodingOptions* options){
+    char path[2 * MAX_CUE_FILE_NAME];
+    const size_t directory_length = base_name(cuefilename) - cuefilename;
+    Progress progress;
+    FailureReason ret;
+
+    if(directory_length >= MAX_CUE_FILE_NAME){
+        fprintf(stderr, "Error: %s: path too long\n", cuefilename);
+        exit_with_error();
+    }
+
+    ret = create_archive(archivefilename);
+    for(int f = 0; ret == SUCCESS && f < cue_sheet.file_count; f++){
+        options->track_count = 0;
+        for(int i = 0; i < cue_sheet.track_count; i++){
+            if(cue_sheet.tracks[i].file == f){
+                tracks[options->track_count++] = cue_sheet.tracks[i];
+            }
+        }
+        options->tracks = tracks;
+
+        memcpy(path, cuefilename, directory_length);
+        strcpy(path + directory_length, cue_sheet.file_names[f]);
+
+        ret = prepare_archive_encoding(path, (char*)base_name(cue_sheet.file_names[f]), MAX_STEP_IN_BYTES, options, &progress);
+        if(ret == SUCCESS){
+            fprintf(stderr, "Encoding %s to %s...\n", path, archivefilename);
+            run_encoding(&progress, 0);
+            show_hashes(&progress, options, cue_sheet.file_names[f], 0);
+        }
+    }
+    if(ret == SUCCESS){
+        ret = close_archive();
+    }
+    if(ret != SUCCESS){
+        fprintf(stderr, "ERROR: %s\n", get_failure_reason_string(ret));
+        exit_with_error();
+    }
+
+    fprintf(stderr, "Done\n");
+}
+
 int main(int argc, char* argv[]) {
 
     char* infilename  = NULL;
     char* outfilename = NULL;
+    char* cuefilename = NULL;
     int silent = 0;
+    int archive = 0;
+    int resume = 0;
+    int jobs = 0;
+    char** batch_files = NULL;
+    int batch_count = 0;
+
+    EncodingOptions options;
+    init_encoding_options(&options);
 
     normalize_argv0(argv[0]);
 
@@ -59,6 +266,62 @@ int main(int argc, char* argv[]) {
             outfilename = STDOUT_MARKER;
             silent = 1;
         }
+        else if(strcmp(EXTENDED, current_argv) == 0){
+            options.extended_format = 1;
+        }
+        else if(strcmp(DEDUP, current_argv) == 0){
+            options.dedup_table_size = DEDUP_TABLE_SIZE;
+        }
+        else if(strcmp(DICTIONARY, current_argv) == 0 && i + 1 < argc){
+            options.dictionary_file = argv[++i];
+        }
+        else if(strcmp(CUE, current_argv) == 0 && i + 1 < argc){
+            cuefilename = argv[++i];
+        }
+        else if(strcmp(ARCHIVE, current_argv) == 0){
+            archive = 1;
+        }
+        else if(strcmp(HASH, current_argv) == 0){
+            options.hashes = ALL_HASHES;
+            options.track_hashes = ALL_HASHES;
+        }
+        else if(strcmp(IO_URING, current_argv) == 0){
+            options.io.backend = IO_BACKEND_URING;
+        }
+        else if(strcmp(IO_THREADS, current_argv) == 0){
+            options.io.backend = IO_BACKEND_THREADS;
+        }
+        else if(strcmp(BLOCK_SIZE, current_argv) == 0 && i + 1 < argc){
+            options.io.block_size = parse_size(argv[++i]);
+            options.io.stdio_buffer_size = options.io.block_size;
+            if(options.io.block_size == 0){
+                show_usage();
+                exit_with_error();
+            }
+        }
+        else if(strcmp(DROP_CACHE, current_argv) == 0){
+            options.io.drop_cache = 1;
+        }
+        else if(strcmp(DIRECT, current_argv) == 0){
+            options.io.direct = 1;
+        }
+        else if(strcmp(STATS, current_argv) == 0){
+            options.stats = &stats;
+        }
+        else if(strcmp(RESUME, current_argv) == 0){
+            resume = 1;
+        }
+        else if(strcmp(JOBS, current_argv) == 0 && i + 1 < argc && batch_files == NULL){
+            jobs = atoi(argv[++i]);
+            batch_files = malloc(argc * sizeof(char*));
+            if(jobs <= 0 || !batch_files){
+                show_usage();
+                exit_with_error();
+            }
+        }
+        else if(batch_files != NULL){
+            batch_files[batch_count++] = current_argv;
+        }
         else if(infilename == NULL){
             infilename = current_argv;
         }
@@ -71,11 +334,64 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if(batch_files != NULL){
+        if(archive || resume || cuefilename != NULL || (outfilename != NULL && strcmp(STDOUT_MARKER, outfilename) == 0)){
+            show_usage();
+            exit_with_error();
+        }
+        //
+        // Files given before the number of jobs
+        //
+        if(infilename != NULL) batch_files[batch_count++] = infilename;
+        if(outfilename != NULL) batch_files[batch_count++] = outfilename;
+        if(batch_count == 0){
+            show_usage();
+            exit_with_error();
+        }
+        const int failed = run_batch(batch_files, batch_count, jobs, submit_encoding, report_encoding, &options);
+        free(batch_files);
+        if(failed){
+            fprintf(stderr, "ERROR: %d of %d files failed\n", failed, batch_count);
+            exit_with_error();
+        }
+        return 0;
+    }
+
     if(infilename == NULL){
         show_usage();
         exit_with_error();
     }
 
+    if(!silent){
+        options.progress_callback = show_progress;
+        options.progress_interval_ms = PROGRESS_INTERVAL_MS;
+    }
+
+    if(archive){
+        if(outfilename == NULL || cuefilename != NULL || resume || strcmp(STDOUT_MARKER, outfilename) == 0){
+            show_usage();
+            exit_with_error();
+        }
+        cuefilename = infilename;
+    }
+
+    if(cuefilename != NULL){
+        const FailureReason ret = parse_cue_sheet(cuefilename, &cue_sheet);
+        if(ret != SUCCESS){
+            fprintf(stderr, "ERROR: %s\n", get_failure_reason_string(ret));
+            exit_with_error();
+        }
+    }
+
+    if(!archive && cuefilename != NULL){
+        options.tracks = tracks;
+        options.track_count = select_tracks(infilename);
+        if(options.track_count == 0){
+            fprintf(stderr, "Error: %s is not in %s\n", infilename, cuefilename);
+            exit_with_error();
+        }
+    }
+
     if(outfilename == NULL){
         //
         // Append ".ecm" to the input filename
@@ -93,17 +409,40 @@ int main(int argc, char* argv[]) {
         outfilename = tempfilename;
     }
 
-    if(strcmp(STDOUT_MARKER, outfilename) != 0){
-        FILE *file = fopen(outfilename, "rb");
-        if(file != NULL){
-            fclose(file);
-            fprintf(stderr, "Error: %s exists; refusing to overwrite\n", outfilename);
+    if(resume){
+        if(strcmp(STDOUT_MARKER, outfilename) == 0){
+            show_usage();
+            exit_with_error();
+        }
+        options.checkpoint_file = checkpoint_file_name(outfilename);
+        if(!options.checkpoint_file){
+            fprintf(stderr, "Out of memory\n");
             exit_with_error();
         }
     }
 
+    //
+    // An interrupted encoding is the only output that can be written over
+    //
+    if(
+        strcmp(STDOUT_MARKER, outfilename) != 0 &&
+        file_exists(outfilename) &&
+        !(options.checkpoint_file != NULL && file_exists(options.checkpoint_file))
+    ){
+        fprintf(stderr, "Error: %s exists; refusing to overwrite\n", outfilename);
+        exit_with_error();
+    }
+
+    if(archive){
+        encode_archive(cuefilename, outfilename, &options);
+        if(options.stats) fprintstats(stderr, options.stats);
+        return 0;
+    }
+
     Progress progress;
-    const FailureReason ret = prepare_encoding(infilename, outfilename, MAX_STEP_IN_BYTES, &progress);
+    const FailureReason ret = resume ?
+        resume_encoding(infilename, outfilename, MAX_STEP_IN_BYTES, &options, &progress) :
+        prepare_encoding_with_options(infilename, outfilename, MAX_STEP_IN_BYTES, &options, &progress);
     if(ret != SUCCESS){
         fprintf(stderr, "ERROR: %s\n", get_failure_reason_string(ret));
         exit_with_error();
@@ -111,42 +450,11 @@ int main(int argc, char* argv[]) {
 
     if(!silent) fprintf(stderr, "Encoding %s to %s...\n", infilename, outfilename);
 
-    int last_analyze_progress = -1;
-    int last_encoding_progress = - 1;
-    do{
-        encode(&progress);
-
-        if(progress.analyze_percentage != last_analyze_progress || progress.encoding_or_decoding_percentage != last_encoding_progress){
-            if(!silent){
-                fprintf(stderr,
-                    "Analyze(%02d%%) Encode(%02d%%)\r", progress.analyze_percentage, progress.encoding_or_decoding_percentage
-                );
-            }
-
-            last_analyze_progress = progress.analyze_percentage;
-            last_encoding_progress = progress.encoding_or_decoding_percentage;
-        }
-    }while(progress.state == IN_PROGRESS);
-
-    if(progress.state != SUCCESS){
-        fprintf(stderr, "ERROR: %s\n", get_failure_reason_string(progress.failure_reason));
-        exit_with_error();
-    }
+    run_encoding(&progress, silent);
+    show_hashes(&progress, &options, infilename, silent);
+    if(options.stats) fprintstats(stderr, options.stats);
 
-    //
-    // Show report
-    //
     if(!silent){
-        fprintf(stderr, "Literal bytes........... "); fprintdec(stderr, progress.literal_bytes); printf("\n");
-        fprintf(stderr, "Mode 1 sectors.......... "); fprintdec(stderr, progress.mode_1_sectors); printf("\n");
-        fprintf(stderr, "Mode 2 form 1 sectors... "); fprintdec(stderr, progress.mode_2_form_1_sectors); printf("\n");
-        fprintf(stderr, "Mode 2 form 2 sectors... "); fprintdec(stderr, progress.mode_2_form_2_sectors); printf("\n");
-        fprintf(stderr, "Encoded ");
-        fprintdec(stderr, progress.bytes_before_processing);
-        fprintf(stderr, " bytes -> ");
-        fprintdec(stderr, progress.bytes_after_processing);
-        fprintf(stderr, " bytes\n");
-
         //
         // Success
         //
@@ -179,6 +179,148 @@ void banner(void) {
     atexit(commandlinewarning);
 }
 
+//
+// One line with the selected checksums and the name of what they are of, as
+// checksum tools show them
+//
+void fprinthashes(FILE* f, const Hashes* hashes, int flags, const char* name) {
+    int i;
+    if(flags & HASH_CRC32) {
+        fprintf(f, "%08lx ", (unsigned long)hashes->crc32);
+    }
+    if(flags & HASH_MD5) {
+        for(i = 0; i < 16; i++) { fprintf(f, "%02x", hashes->md5[i]); }
+        fputc(' ', f);
+    }
+    if(flags & HASH_SHA1) {
+        for(i = 0; i < 20; i++) { fprintf(f, "%02x", hashes->sha1[i]); }
+        fputc(' ', f);
+    }
+    fprintf(f, " %s\n", name);
+}
+
+//
+// Name of the file without its directory
+//
+const char* base_name(const char* path) {
+    const char* name = path;
+    for(; *path; path++) {
+        if(*path == '/' || *path == '\\') {
+            name = path + 1;
+        }
+    }
+    return name;
+}
+
+//
+// Size given on the command line, in bytes or with a K or M suffix. Returns 0
+// if it isn't one
+//
+int parse_size(const char* s) {
+    char* end;
+    long size = strtol(s, &end, 10);
+    if(end == s || size <= 0) {
+        return 0;
+    }
+    switch(toupper((unsigned char)*end)) {
+    case 'K': size *= 1024; end++; break;
+    case 'M': size *= 1024 * 1024; end++; break;
+    }
+    if(*end != 0 || size > 0x40000000l) {
+        return 0;
+    }
+    return (int)size;
+}
+
+//
+// The checkpoint of a conversion is kept next to its output, as
+// <output>.checkpoint. Returns NULL when out of memory
+//
+char* checkpoint_file_name(const char* output_file_name) {
+    char* name = malloc(strlen(output_file_name) + 12);
+    if(name != NULL) {
+        strcpy(name, output_file_name);
+        strcat(name, ".checkpoint");
+    }
+    return name;
+}
+
+int file_exists(const char* file_name) {
+    FILE* file = fopen(file_name, "rb");
+    if(file == NULL) {
+        return 0;
+    }
+    fclose(file);
+    return 1;
+}
+
+//
+// Timings and counters of a conversion, as a JSON object
+//
+void fprintstats(FILE* f, const Stats* stats) {
+    int i;
+    fprintf(f, "{\n  \"stages\": {\n");
+    for(i = 0; i < STAGE_COUNT; i++) {
+        fprintf(f, "    \"%s\": { \"nanoseconds\": %llu, \"bytes\": %llu, \"calls\": %llu }%s\n",
+            stage_names[i],
+            (unsigned long long)stats->stages[i].nanoseconds,
+            (unsigned long long)stats->stages[i].bytes,
+            (unsigned long long)stats->stages[i].calls,
+            (i + 1 < STAGE_COUNT) ? "," : "");
+    }
+    fprintf(f, "  },\n");
+    fprintf(f, "  \"detection_attempts\": %llu,\n",
+        (unsigned long long)(stats->stages[STAGE_DETECT].calls + stats->stages[STAGE_SCAN].calls));
+    fprintf(f, "  \"literal_scan_bytes\": %llu,\n", (unsigned long long)stats->stages[STAGE_SCAN].bytes);
+    fprintf(f, "  \"records\": %llu,\n", (unsigned long long)stats->records);
+    fprintf(f, "  \"mode_1_sectors\": %llu,\n", (unsigned long long)stats->mode_1_sectors);
+    fprintf(f, "  \"mode_2_form_1_sectors\": %llu,\n", (unsigned long long)stats->mode_2_form_1_sectors);
+    fprintf(f, "  \"mode_2_form_2_sectors\": %llu\n", (unsigned long long)stats->mode_2_form_2_sectors);
+    fprintf(f, "}\n");
+}
+
+//
+// Run a batch on a scheduler of jobs threads, which starts with the smallest
+// files so that the most files are done soonest. The reports come once all of
+// them are over, in the order of the files. Returns how many failed
+//
+int run_batch(char** file_names, int count, int jobs, BatchSubmit submit, BatchReport report, void* context) {
+    BatchFile* files = calloc(count, sizeof(BatchFile));
+    SchedulerOptions scheduler_options;
+    Scheduler* scheduler;
+    int failed = 0;
+    int i;
+
+    init_scheduler_options(&scheduler_options);
+    scheduler_options.threads = jobs;
+    scheduler = files ? create_scheduler(&scheduler_options) : NULL;
+    if(!scheduler) {
+        fprintf(stderr, "Out of memory\n");
+        free(files);
+        return count;
+    }
+
+    for(i = 0; i < count; i++) {
+        files[i].input_file_name = file_names[i];
+        files[i].scheduled = submit(scheduler, &files[i], context) == 0;
+        failed += !files[i].scheduled;
+    }
+    destroy_scheduler(scheduler);
+
+    for(i = 0; i < count; i++) {
+        if(files[i].scheduled && files[i].progress.state != COMPLETED) {
+            fprintf(stderr, "ERROR: %s: %s\n", files[i].input_file_name, get_failure_reason_string(files[i].progress.failure_reason));
+            failed++;
+        } else if(files[i].scheduled) {
+            report(&files[i], context);
+        }
+        free(files[i].output_file_name);
+    }
+
+    free(files);
+    return failed;
+}
+
 void normalize_argv0(char* argv0) {
     size_t i;
     size_t start = 0;
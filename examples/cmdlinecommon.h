@@ -29,6 +29,31 @@
 
 #include "stdio.h"
 
+#include "ecm.h"
+
 void normalize_argv0(char* argv0);
 void banner(void);
 void fprintdec(FILE* f, off_t off);
+const char* base_name(const char* path);
+void fprinthashes(FILE* f, const Hashes* hashes, int flags, const char* name);
+int parse_size(const char* s);
+void fprintstats(FILE* f, const Stats* stats);
+char* checkpoint_file_name(const char* output_file_name);
+int file_exists(const char* file_name);
+
+//
+// Files converted together with -j. Submitting one picks its output file name
+// (freed by run_batch()) and schedules its conversion, it returns nonzero
+// after showing why if it can't
+//
+typedef struct _BatchFile {
+    char* input_file_name;
+    char* output_file_name;
+    Progress progress;
+    Stats stats;
+    int scheduled;
+} BatchFile;
+
+typedef int (*BatchSubmit)(Scheduler* scheduler, BatchFile* file, void* context);
+typedef void (*BatchReport)(const BatchFile* file, void* context);
+int run_batch(char** file_names, int count, int jobs, BatchSubmit submit, BatchReport report, void* context);
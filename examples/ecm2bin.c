@@ -26,8 +26,32 @@
 
 #define STDOUT "--stdout"
 #define STDIN "--stdin"
+#define DICTIONARY "--dictionary"
+#define ARCHIVE "--archive"
+#define SPLIT "--split"
+#define HASH "--hash"
+#define INFO "--info"
+#define PREALLOCATE "--preallocate"
+#define SPARSE "--sparse"
+#define IO_URING "--io-uring"
+#define IO_THREADS "--io-threads"
+#define BLOCK_SIZE "--block-size"
+#define DROP_CACHE "--drop-cache"
+#define DIRECT "--direct"
+#define STATS "--stats"
+#define RESUME "--resume"
+#define JOBS "-j"
+
+#define ALL_HASHES (HASH_CRC32 | HASH_MD5 | HASH_SHA1)
+
+#define PROGRESS_INTERVAL_MS 100
 
 static char* tempfilename = NULL;
+static CueSheet cue_sheet;
+static char track_file_names[MAX_TRACKS][MAX_CUE_FILE_NAME + 16];
+static char* track_file_name_pointers[MAX_TRACKS];
+static Stats stats;
+static int resuming = 0;
 
 static void exit_with_error(){
     if(tempfilename) { free(tempfilename); }
@@ -44,13 +68,284 @@ static void show_usage(){
         "    ecm2bin " STDIN " <cdimagefile>\n"
         "    ecm2bin " STDOUT " <ecmfile>\n"
         "    ecm2bin " STDIN " " STDOUT "\n"
+        "    ecm2bin " ARCHIVE " <archivefile> [member]\n"
+        "    ecm2bin " JOBS " <jobs> <ecmfile>...\n"
+        "    ecm2bin " INFO " <ecmfile or archivefile>\n"
+        "\n"
+        "Options:\n"
+        "\n"
+        "    " DICTIONARY " <file>\n"
+        "                Dictionary the file was encoded with\n"
+        "    " ARCHIVE "     Extract the members of an archive, or only the given one,\n"
+        "                to the current directory\n"
+        "    " SPLIT " <cuefile>\n"
+        "                Write each track of the cue sheet to its own file, named\n"
+        "                after the output file, and show their CRC32\n"
+        "    " HASH "        Show the CRC32, MD5 and SHA-1 of the image (and its tracks)\n"
+        "    " PREALLOCATE " Reserve the space of the image before writing it\n"
+        "    " SPARSE "      Leave runs of zeros as holes in the image\n"
+        "    " IO_URING "    Write the image in the background with io_uring (Linux)\n"
+        "    " IO_THREADS "  Write the image in the background with a thread\n"
+        "    " BLOCK_SIZE " <size>\n"
+        "                Size of the blocks the image is written in (such as 4M)\n"
+        "    " DROP_CACHE "  Don't keep the files in the page cache\n"
+        "    " DIRECT "      Bypass the page cache (with " IO_URING " or " IO_THREADS ")\n"
+        "    " STATS "       Show where the time went, as JSON on stderr\n"
+        "    " RESUME "      Go on from where an interrupted decoding to the same\n"
+        "                image stopped, if it did\n"
+        "    " JOBS " <jobs>     Decode each of the files next to it, up to <jobs> at a time\n"
     );
 }
 
+//
+// Files of an interrupted decoding are the only ones that can be written over
+//
+static void refuse_to_overwrite(char* outfilename){
+    if(!resuming && file_exists(outfilename)){
+        fprintf(stderr, "Error: %s exists; refusing to overwrite\n", outfilename);
+        exit_with_error();
+    }
+}
+
+static void show_progress(const Progress* progress, void* user_data){
+    (void)user_data;
+    fprintf(stderr,
+            "Decode(%02d%%)\r", progress->encoding_or_decoding_percentage
+            );
+}
+
+//
+// Name of the image of an ECM file when none is given
+//
+static char* image_file_name(const char* infilename){
+    char* name = malloc(strlen(infilename) + 7);
+    if(!name) {
+        fprintf(stderr, "Out of memory\n");
+        exit_with_error();
+    }
+
+    strcpy(name, infilename);
+
+    //
+    // Remove ".ecm" from the input filename
+    //
+    size_t l = strlen(name);
+    if(
+        (l > 4) &&
+        name[l - 4] == '.' &&
+        tolower(name[l - 3]) == 'e' &&
+        tolower(name[l - 2]) == 'c' &&
+        tolower(name[l - 1]) == 'm'
+    ) {
+        name[l - 4] = 0;
+    } else {
+        //
+        // If that fails, append ".unecm" to the input filename
+        //
+        strcat(name, ".unecm");
+    }
+    return name;
+}
+
+//
+// Run the decoder until it's done and show the report
+//
+static void run_decoding(Progress* progress, int silent){
+    do{
+        decode(progress);
+    }while(progress->state == IN_PROGRESS);
+
+    if(progress->state != SUCCESS){
+        fprintf(stderr, "ERROR: %s\n", get_failure_reason_string(progress->failure_reason));
+        exit_with_error();
+    }
+
+    if(!silent){
+        //
+        // Show report
+        //
+        fprintf(stderr, "Decoded ");
+        fprintdec(stderr, progress->bytes_before_processing);
+        fprintf(stderr, " bytes -> ");
+        fprintdec(stderr, progress->bytes_after_processing);
+        fprintf(stderr, " bytes\n");
+    }
+}
+
+//
+// Decode one file of a batch next to it, with stats of its own
+//
+static int submit_decoding(Scheduler* scheduler, BatchFile* file, void* context){
+    DecodingOptions options = *(DecodingOptions*)context;
+    FailureReason ret;
+
+    file->output_file_name = image_file_name(file->input_file_name);
+    if(file_exists(file->output_file_name)){
+        fprintf(stderr, "Error: %s exists; refusing to overwrite\n", file->output_file_name);
+        return 1;
+    }
+
+    if(options.stats) options.stats = &file->stats;
+    ret = schedule_decoding(scheduler, file->input_file_name, file->output_file_name, MAX_STEP_IN_BYTES, &options, &file->progress);
+    if(ret != SUCCESS){
+        fprintf(stderr, "ERROR: %s: %s\n", file->input_file_name, get_failure_reason_string(ret));
+        return 1;
+    }
+    return 0;
+}
+
+static void report_decoding(const BatchFile* file, void* context){
+    DecodingOptions* options = (DecodingOptions*)context;
+    if(options->hashes){
+        fprinthashes(stdout, &file->progress.hashes, options->hashes, file->output_file_name);
+    }
+    if(options->stats) fprintstats(stderr, &file->stats);
+    fprintf(stderr, "Decoded %s to %s\n", file->input_file_name, file->output_file_name);
+}
+
+static void print_info(const char* name, const EcmInfo* info){
+    printf("%s:\n", name);
+    printf("Format.................. %s\n", info->extended_format ? "extended" : "original");
+    printf("Records................. "); fprintdec(stdout, info->record_count); printf("\n");
+    printf("Literal bytes........... "); fprintdec(stdout, info->literal_bytes); printf("\n");
+    printf("Mode 1 sectors.......... "); fprintdec(stdout, info->mode_1_sectors); printf("\n");
+    printf("Mode 2 form 1 sectors... "); fprintdec(stdout, info->mode_2_form_1_sectors); printf("\n");
+    printf("Mode 2 form 2 sectors... "); fprintdec(stdout, info->mode_2_form_2_sectors); printf("\n");
+    printf("ECM size................ "); fprintdec(stdout, info->ecm_size); printf("\n");
+    printf("Decoded size............ "); fprintdec(stdout, info->original_size); printf("\n");
+    if(info->uses_dictionary) printf("Needs its dictionary to be decoded\n");
+    if(info->uses_references) printf("Can't be decoded to stdout\n");
+}
+
+//
+// Show what an ECM file, or each member of an archive, holds without decoding
+//
+static void show_info(char* infilename){
+    static ArchiveDirectory directory;
+    EcmInfo info;
+    FailureReason ret;
+
+    if(read_archive_directory(infilename, &directory) == SUCCESS){
+        for(int i = 0; i < directory.member_count; i++){
+            ret = scan_archive_member(infilename, &directory.members[i], &info);
+            if(ret != SUCCESS){
+                fprintf(stderr, "ERROR: %s\n", get_failure_reason_string(ret));
+                exit_with_error();
+            }
+            print_info(directory.members[i].name, &info);
+        }
+        return;
+    }
+
+    ret = scan_ecm_file(infilename, &info);
+    if(ret != SUCCESS){
+        fprintf(stderr, "ERROR: %s\n", get_failure_reason_string(ret));
+        exit_with_error();
+    }
+    print_info(infilename, &info);
+}
+
+static void decode_archive(char* archivefilename, char* membername, DecodingOptions* options){
+    static ArchiveDirectory directory;
+    Progress progress;
+    int found = 0;
+
+    FailureReason ret = read_archive_directory(archivefilename, &directory);
+    if(ret != SUCCESS){
+        fprintf(stderr, "ERROR: %s\n", get_failure_reason_string(ret));
+        exit_with_error();
+    }
+
+    for(int i = 0; i < directory.member_count; i++){
+        ArchiveMember* member = &directory.members[i];
+        if(membername != NULL && strcmp(membername, member->name) != 0){
+            continue;
+        }
+        found = 1;
+
+        //
+        // Never write outside of the current directory
+        //
+        char* outfilename = (char*)base_name(member->name);
+        refuse_to_overwrite(outfilename);
+
+        ret = prepare_archive_decoding(archivefilename, member, outfilename, MAX_STEP_IN_BYTES, options, &progress);
+        if(ret != SUCCESS){
+            fprintf(stderr, "ERROR: %s\n", get_failure_reason_string(ret));
+            exit_with_error();
+        }
+
+        fprintf(stderr, "Decoding %s from %s...\n", outfilename, archivefilename);
+        run_decoding(&progress, 0);
+    }
+
+    if(!found){
+        fprintf(stderr, "Error: %s is not in %s\n", membername, archivefilename);
+        exit_with_error();
+    }
+
+    fprintf(stderr, "Done\n");
+}
+
+//
+// Name the file of each track after the output file: "foo.bin" gives
+// "foo (Track 01).bin" and so on
+//
+static void split_tracks(char* cuefilename, char* outfilename, DecodingOptions* options){
+    char stem[MAX_CUE_FILE_NAME];
+
+    FailureReason ret = parse_cue_sheet(cuefilename, &cue_sheet);
+    if(ret == SUCCESS && cue_sheet.file_count != 1){
+        ret = INVALID_CUE_SHEET;
+    }
+    if(ret != SUCCESS){
+        fprintf(stderr, "ERROR: %s\n", get_failure_reason_string(ret));
+        exit_with_error();
+    }
+
+    size_t l = strlen(outfilename);
+    if(
+        (l > 4) &&
+        outfilename[l - 4] == '.' &&
+        tolower(outfilename[l - 3]) == 'b' &&
+        tolower(outfilename[l - 2]) == 'i' &&
+        tolower(outfilename[l - 1]) == 'n'
+    ) {
+        l -= 4;
+    }
+    if(l >= sizeof(stem)){
+        fprintf(stderr, "Error: %s: name too long\n", outfilename);
+        exit_with_error();
+    }
+    memcpy(stem, outfilename, l);
+    stem[l] = 0;
+
+    for(int i = 0; i < cue_sheet.track_count; i++){
+        sprintf(track_file_names[i], "%s (Track %02d).bin", stem, i + 1);
+        refuse_to_overwrite(track_file_names[i]);
+        track_file_name_pointers[i] = track_file_names[i];
+    }
+
+    options->tracks = cue_sheet.tracks;
+    options->track_count = cue_sheet.track_count;
+    options->track_file_names = track_file_name_pointers;
+    options->track_hashes = options->hashes ? options->hashes : HASH_CRC32;
+}
+
 int main(int argc, char** argv) {
     char* infilename  = NULL;
     char* outfilename = NULL;
     int silent = 0;
+    int archive = 0;
+    int info = 0;
+    int resume = 0;
+    char* cuefilename = NULL;
+    int jobs = 0;
+    char** batch_files = NULL;
+    int batch_count = 0;
+
+    DecodingOptions options;
+    init_decoding_options(&options);
 
     normalize_argv0(argv[0]);
 
@@ -65,6 +360,64 @@ int main(int argc, char** argv) {
             outfilename = STDOUT_MARKER;
             silent = 1;
         }
+        else if(strcmp(DICTIONARY, current_argv) == 0 && i + 1 < argc){
+            options.dictionary_file = argv[++i];
+        }
+        else if(strcmp(ARCHIVE, current_argv) == 0){
+            archive = 1;
+        }
+        else if(strcmp(SPLIT, current_argv) == 0 && i + 1 < argc){
+            cuefilename = argv[++i];
+        }
+        else if(strcmp(PREALLOCATE, current_argv) == 0){
+            options.preallocate = 1;
+        }
+        else if(strcmp(SPARSE, current_argv) == 0){
+            options.sparse = 1;
+        }
+        else if(strcmp(IO_URING, current_argv) == 0){
+            options.io.backend = IO_BACKEND_URING;
+        }
+        else if(strcmp(IO_THREADS, current_argv) == 0){
+            options.io.backend = IO_BACKEND_THREADS;
+        }
+        else if(strcmp(BLOCK_SIZE, current_argv) == 0 && i + 1 < argc){
+            options.io.block_size = parse_size(argv[++i]);
+            options.io.stdio_buffer_size = options.io.block_size;
+            if(options.io.block_size == 0){
+                show_usage();
+                exit_with_error();
+            }
+        }
+        else if(strcmp(DROP_CACHE, current_argv) == 0){
+            options.io.drop_cache = 1;
+        }
+        else if(strcmp(DIRECT, current_argv) == 0){
+            options.io.direct = 1;
+        }
+        else if(strcmp(STATS, current_argv) == 0){
+            options.stats = &stats;
+        }
+        else if(strcmp(RESUME, current_argv) == 0){
+            resume = 1;
+        }
+        else if(strcmp(JOBS, current_argv) == 0 && i + 1 < argc && batch_files == NULL){
+            jobs = atoi(argv[++i]);
+            batch_files = malloc(argc * sizeof(char*));
+            if(jobs <= 0 || !batch_files){
+                show_usage();
+                exit_with_error();
+            }
+        }
+        else if(batch_files != NULL){
+            batch_files[batch_count++] = current_argv;
+        }
+        else if(strcmp(INFO, current_argv) == 0){
+            info = 1;
+        }
+        else if(strcmp(HASH, current_argv) == 0){
+            options.hashes = ALL_HASHES;
+        }
         else if(infilename == NULL){
             infilename = current_argv;
         }
@@ -77,90 +430,114 @@ int main(int argc, char** argv) {
         }
     }
 
+    if(batch_files != NULL){
+        if(
+            archive || info || resume || cuefilename != NULL ||
+            (infilename != NULL && strcmp(STDIN_MARKER, infilename) == 0) ||
+            (outfilename != NULL && strcmp(STDOUT_MARKER, outfilename) == 0)
+        ){
+            show_usage();
+            exit_with_error();
+        }
+        //
+        // Files given before the number of jobs
+        //
+        if(infilename != NULL) batch_files[batch_count++] = infilename;
+        if(outfilename != NULL) batch_files[batch_count++] = outfilename;
+        if(batch_count == 0){
+            show_usage();
+            exit_with_error();
+        }
+        const int failed = run_batch(batch_files, batch_count, jobs, submit_decoding, report_decoding, &options);
+        free(batch_files);
+        if(failed){
+            fprintf(stderr, "ERROR: %d of %d files failed\n", failed, batch_count);
+            exit_with_error();
+        }
+        return 0;
+    }
+
     if(infilename == NULL){
         show_usage();
         exit_with_error();
     }
 
+    if(info){
+        if(strcmp(STDIN_MARKER, infilename) == 0 || outfilename != NULL || resume){
+            show_usage();
+            exit_with_error();
+        }
+        show_info(infilename);
+        return 0;
+    }
+
+    if(!silent){
+        options.progress_callback = show_progress;
+        options.progress_interval_ms = PROGRESS_INTERVAL_MS;
+    }
+
+    if(archive){
+        if(resume || strcmp(STDIN_MARKER, infilename) == 0 || (outfilename != NULL && strcmp(STDOUT_MARKER, outfilename) == 0)){
+            show_usage();
+            exit_with_error();
+        }
+        decode_archive(infilename, outfilename, &options);
+        if(options.stats) fprintstats(stderr, options.stats);
+        return 0;
+    }
+
     if(outfilename == NULL){
-        tempfilename = malloc(strlen(infilename) + 7);
-        if(!tempfilename) {
+        outfilename = tempfilename = image_file_name(infilename);
+    }
+
+    if(resume){
+        if(strcmp(STDIN_MARKER, infilename) == 0 || strcmp(STDOUT_MARKER, outfilename) == 0){
+            show_usage();
+            exit_with_error();
+        }
+        options.checkpoint_file = checkpoint_file_name(outfilename);
+        if(!options.checkpoint_file){
             fprintf(stderr, "Out of memory\n");
             exit_with_error();
         }
+        resuming = file_exists(options.checkpoint_file);
+    }
 
-        strcpy(tempfilename, infilename);
-
-        //
-        // Remove ".ecm" from the input filename
-        //
-        size_t l = strlen(tempfilename);
-        if(
-            (l > 4) &&
-            tempfilename[l - 4] == '.' &&
-            tolower(tempfilename[l - 3]) == 'e' &&
-            tolower(tempfilename[l - 2]) == 'c' &&
-            tolower(tempfilename[l - 1]) == 'm'
-        ) {
-            tempfilename[l - 4] = 0;
-        } else {
-            //
-            // If that fails, append ".unecm" to the input filename
-            //
-            strcat(tempfilename, ".unecm");
-        }
-
-        outfilename = tempfilename;
-    }
-
-    if(strcmp(STDOUT_MARKER, outfilename) != 0){
-        FILE *file = fopen(outfilename, "rb");
-        if(file != NULL){
-            fclose(file);
-            fprintf(stderr, "Error: %s exists; refusing to overwrite\n", outfilename);
+    if(cuefilename != NULL){
+        if(strcmp(STDOUT_MARKER, outfilename) == 0){
+            show_usage();
             exit_with_error();
         }
+        split_tracks(cuefilename, outfilename, &options);
+    }
+    else if(strcmp(STDOUT_MARKER, outfilename) != 0){
+        refuse_to_overwrite(outfilename);
     }
 
     Progress progress;
-    const FailureReason ret = prepare_decoding(infilename, outfilename, MAX_STEP_IN_BYTES, &progress);
+    const FailureReason ret = resume ?
+        resume_decoding(infilename, outfilename, MAX_STEP_IN_BYTES, &options, &progress) :
+        prepare_decoding_with_options(infilename, outfilename, MAX_STEP_IN_BYTES, &options, &progress);
     if(ret != SUCCESS){
         fprintf(stderr, "ERROR: %s\n", get_failure_reason_string(ret));
         exit_with_error();
     }
 
-    if(!silent) fprintf(stderr, "Decoding %s to %s...\n", infilename, outfilename);
-
-    int last_decoding_progress = - 1;
-    do{
-        decode(&progress);
+    if(!silent) fprintf(stderr, "Decoding %s to %s...\n", infilename, cuefilename != NULL ? "tracks" : outfilename);
 
-        if(progress.encoding_or_decoding_percentage != last_decoding_progress){
-            if(!silent){
-                fprintf(stderr,
-                        "Decode(%02d%%)\r", progress.encoding_or_decoding_percentage
-                        );
-            }
+    run_decoding(&progress, silent);
 
-            last_decoding_progress = progress.encoding_or_decoding_percentage;
+    if(cuefilename != NULL){
+        for(int i = 0; i < progress.track_count; i++){
+            fprinthashes(stdout, &progress.track_hashes[i], options.track_hashes, track_file_names[i]);
         }
-    }while(progress.state == IN_PROGRESS);
-
-    if(progress.state != SUCCESS){
-        fprintf(stderr, "ERROR: %s\n", get_failure_reason_string(progress.failure_reason));
-        exit_with_error();
     }
+    if(options.hashes){
+        fprinthashes(stdout, &progress.hashes, options.hashes, cuefilename != NULL ? "(image)" : outfilename);
+    }
+    if(options.stats) fprintstats(stderr, options.stats);
 
     if(!silent){
-        //
-        // Show report
-        //
-        fprintf(stderr, "Decoded ");
-        fprintdec(stderr, progress.bytes_before_processing);
-        fprintf(stderr, " bytes -> ");
-        fprintdec(stderr, progress.bytes_after_processing);
-        fprintf(stderr, " bytes\n");
-
         //
         // Success
         //
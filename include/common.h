@@ -113,6 +113,8 @@ typedef   signed __int16  int16_t;
 typedef unsigned __int16 uint16_t;
 typedef   signed __int32  int32_t;
 typedef unsigned __int32 uint32_t;
+typedef   signed __int64  int64_t;
+typedef unsigned __int64 uint64_t;
 
 #else
 
@@ -421,3 +423,5 @@ void __cmpdf2(void) {}
 
 uint32_t get32lsb(const uint8_t* src);
 void put32lsb(uint8_t* dest, uint32_t value);
+uint64_t get64lsb(const uint8_t* src);
+void put64lsb(uint8_t* dest, uint64_t value);
@@ -0,0 +1,55 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2022      Antonio Fermiano
+//
+// This file is part of libecm.
+//
+// libecm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libecm is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "common.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Content-addressed store of sector payloads, shared by many ECM files
+//
+// It is made of a pack file, where each payload is appended once, and an index
+// file (pack file name + ".idx") with the hash and offset of every payload.
+// ECM files refer to payloads by their offset in the pack file, so decoding
+// doesn't need the index at all.
+//
+// Only one encoder at a time may write to a store.
+//
+
+typedef struct _Dictionary Dictionary;
+
+Dictionary* dictionary_open(const char* name, int8_t writable);
+void dictionary_close(Dictionary* dictionary);
+
+//
+// Offset of a payload in the pack file, or -1 if it isn't there
+//
+off_t dictionary_find(Dictionary* dictionary, uint64_t hash, const uint8_t* payload, size_t size);
+
+//
+// Append a payload, returns its offset in the pack file or -1 on error
+//
+off_t dictionary_add(Dictionary* dictionary, uint64_t hash, const uint8_t* payload, size_t size);
+
+//
+// Copy a payload out of the pack file, returns zero on error
+//
+int8_t dictionary_read(Dictionary* dictionary, off_t offset, uint8_t* payload, size_t size);
@@ -22,6 +22,10 @@
 
 #include "common.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef enum _State { COMPLETED,
                       IN_PROGRESS,
                       FAILURE } State;
@@ -37,7 +41,17 @@ typedef enum _State { COMPLETED,
     F(ERROR_WRITING_OUTPUT_FILE)\
     F(INVALID_ECM_FILE)\
     F(ERROR_IN_CHECKSUM)\
-    F(STDIN_NOT_SUPPORTED)
+    F(STDIN_NOT_SUPPORTED)\
+    F(STDOUT_NOT_SUPPORTED)\
+    F(ERROR_OPENING_DICTIONARY)\
+    F(ERROR_IN_DICTIONARY)\
+    F(ERROR_OPENING_CUE_SHEET)\
+    F(INVALID_CUE_SHEET)\
+    F(INVALID_ARCHIVE)\
+    F(ERROR_IN_ARCHIVE)\
+    F(ASYNC_NOT_SUPPORTED)\
+    F(CANCELLED)\
+    F(INVALID_WORKSPACE)
 #define F(x) x,
 typedef enum _FailureReason { FAILURE_REASONS } FailureReason;
 #undef F
@@ -48,6 +62,64 @@ extern const char * const failure_reason_names[];
 #define STDIN_MARKER "_marker_stdin"
 #define STDOUT_MARKER "_marker_stdout"
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Track layout of an image, usually read from its cue sheet
+//
+#define MAX_TRACKS 99
+#define MAX_CUE_FILE_NAME 256
+
+typedef enum _TrackMode { TRACK_AUDIO,
+                          TRACK_MODE1,
+                          TRACK_MODE2,
+                          TRACK_OTHER } TrackMode;
+
+typedef struct _Track {
+    int file;        // index of the file of the track in its cue sheet
+    int lba;         // first sector of the track, counted from the start of its file
+    TrackMode mode;
+    int sector_size; // bytes per sector in the file: 2352 when raw, 2048, 2336...
+} Track;
+
+//
+// A track whose pregap is stored at the end of the previous file (INDEX 00
+// before the FILE line, INDEX 01 after it) has an entry in each file: from its
+// pregap to the end of the first one, and from the start of the next one
+//
+typedef struct _CueSheet {
+    int file_count;
+    char file_names[MAX_TRACKS][MAX_CUE_FILE_NAME];
+    int track_count;
+    Track tracks[2 * MAX_TRACKS];
+} CueSheet;
+
+FailureReason parse_cue_sheet(char *cueFileName, CueSheet *cueSheet);
+
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// Checksums of the original image, computed while it's read or written
+//
+#define HASH_CRC32 1
+#define HASH_MD5   2
+#define HASH_SHA1  4
+
+typedef struct _Hashes {
+    uint32_t crc32;
+    uint8_t md5[16];
+    uint8_t sha1[20];
+} Hashes;
+
+//
+// State of a conversion, kept by the library from its preparation until it's
+// done (or aborted)
+//
+typedef struct _Conversion Conversion;
+
+//
+// A conversion is identified by its Progress: conversions with a Progress of
+// their own can run at the same time, each on one thread at a time
+//
 typedef struct _Progress {
     State state;
     FailureReason failure_reason;
@@ -59,12 +131,459 @@ typedef struct _Progress {
     off_t mode_2_form_2_sectors;
     off_t bytes_before_processing;
     off_t bytes_after_processing;
+
+    // Checksums of the whole image and of each of its tracks, when asked for.
+    // Only filled in once done
+    Hashes hashes;
+    int track_count;
+    Hashes track_hashes[MAX_TRACKS];
+
+    // Owned by the library, NULL once the conversion is over
+    Conversion *conversion;
 } Progress;
 
+//
+// Called from within encode() or decode() as the conversion goes, and once
+// it's done
+//
+typedef void (*ProgressCallback)(const Progress *progress, void *userData);
+
+//
+// How the input is read and the output written
+//
+typedef enum _IoBackend { IO_BACKEND_STDIO,
+                          IO_BACKEND_URING,
+                          IO_BACKEND_THREADS } IoBackend;
+
+typedef struct _IoOptions {
+    // With io_uring (Linux only) or a thread of its own, the next blocks of
+    // the input are read and the previous blocks of the output written while
+    // the current one is processed. Falls back to stdio where the backend
+    // isn't available
+    IoBackend backend;
+
+    // Size and number of the blocks in flight, 0 for the defaults. That's all
+    // the memory the backend uses. The block size is also the least the
+    // encoder reads at once
+    int block_size;
+    int queue_depth;
+
+    // Buffer size of the stdio streams, 0 for the default
+    int stdio_buffer_size;
+
+    // Drop what was read or written from the page cache as the conversion
+    // goes, so that converting many images doesn't evict everything else
+    int drop_cache;
+
+    // Bypass the page cache (O_DIRECT) for the blocks of the backend, where
+    // the system supports it. Needs a block size multiple of 4096
+    int direct;
+} IoOptions;
+
+//
+// Runs what the library does in the background (the thread of
+// IO_BACKEND_THREADS, and the conversion of start_async()) on the caller's
+// threads, such as the thread pool of a server. Without one, the library
+// starts threads of its own. It waits for its tasks itself, so only starting
+// them is needed.
+//
+// It's a task launcher, not a compute pool: a conversion submits at most two
+// tasks (its reading or writing thread, and itself with start_async()), and
+// the conversion itself isn't split into parallel stages, sector detection
+// and reconstruction run on one thread. Handing it more threads doesn't make
+// a conversion faster.
+//
+// A task runs until the library is done with it (a reading thread, for as
+// long as the file is open) and can wait on the others, so the executor must
+// not hold one back until another finishes, which rules out a fixed pool
+// with fewer threads than the tasks it may be given
+//
+typedef void (*ExecutorTask)(void *argument);
+
+typedef struct _Executor {
+    // Start task(argument), returns zero if it can't
+    int (*submit)(void *context, ExecutorTask task, void *argument);
+    void *context;
+} Executor;
+
+//
+// Where the time of a conversion goes, collected when a Stats is passed in
+// the options. The library only adds to it, so it can be read between calls
+// to encode() or decode(), and shared by several conversions as long as they
+// don't run at the same time
+//
+typedef enum _Stage { STAGE_READ,        // reads of the input, or of what decoding copies from elsewhere
+                      STAGE_DETECT,      // looking for sectors where one was found
+                      STAGE_SCAN,        // looking for sectors where none was, bytes are the literal ones
+                      STAGE_EDC,         // EDC of the whole image
+                      STAGE_HASH,        // checksums of the image and its tracks
+                      STAGE_RECONSTRUCT, // rebuilding sectors from their payload
+                      STAGE_WRITE,       // writes of the output (the encoder reads the sectors again there)
+                      STAGE_COUNT } Stage;
+
+extern const char * const stage_names[];
+
+typedef struct _StageStats {
+    uint64_t nanoseconds;
+    uint64_t bytes;
+    uint64_t calls; // reads or writes issued, positions looked at...
+} StageStats;
+
+typedef struct _Stats {
+    StageStats stages[STAGE_COUNT];
+
+    // Records written or read, and the sectors in them. The detection
+    // attempts are the calls of STAGE_DETECT and STAGE_SCAN
+    uint64_t records;
+    uint64_t mode_1_sectors;
+    uint64_t mode_2_form_1_sectors;
+    uint64_t mode_2_form_2_sectors;
+} Stats;
+
+#define WORKSPACE_ALIGNMENT 4096
+
+typedef struct _EncodingOptions {
+    // Write the extended format, which has more sector types but can't be
+    // decoded by tools that only know the original ECM format
+    int extended_format;
+
+    // Number of entries of the table used to find sectors whose payload
+    // repeats an earlier one, 0 to disable it. Implies extended_format, and
+    // decoding the result needs a seekable output file
+    int dedup_table_size;
+
+    // Store sector payloads in this dictionary (see dictionary.h), which is
+    // created if it doesn't exist, instead of the ECM file. Implies
+    // extended_format and takes precedence over dedup_table_size
+    char *dictionary_file;
+
+    // Tracks of the input file, in order. When given, sectors are only looked
+    // for where the tracks say they are, and audio tracks are copied as they
+    // are, which is much faster than trying every position
+    const Track *tracks;
+    int track_count;
+
+    // Checksums (HASH_* flags) to compute of the whole image and, when the
+    // tracks are given, of each track
+    int hashes;
+    int track_hashes;
+
+    // How the input file is read
+    IoOptions io;
+
+    // Where the background tasks run, NULL for threads of the library's own.
+    // Must stay valid until the conversion is done
+    const Executor *executor;
+
+    // Memory the state and the buffers of the conversion are taken from
+    // instead of being allocated, of get_encoding_workspace_size() bytes and
+    // aligned to WORKSPACE_ALIGNMENT (INVALID_WORKSPACE if not), NULL to
+    // allocate them. Must stay valid until the conversion is done.
+    // Dictionaries still grow their index, and the system allocates its FILEs
+    // and threads
+    void *workspace;
+    size_t workspace_size;
+
+    // File where the state of the conversion is saved every
+    // checkpoint_interval_bytes of the input (64 MiB if 0), so that
+    // resume_encoding() can go on from there after an interruption. NULL not
+    // to save it. Not saved when writing to stdout or with a dictionary
+    char *checkpoint_file;
+    int checkpoint_interval_bytes;
+
+    // Where to add the timings and counters of the conversion, NULL not to
+    // collect them
+    Stats *stats;
+
+    // The percentages of the Progress are only worked out every
+    // progress_interval_bytes of the image, or when progress_interval_ms have
+    // passed (every 1 MiB when neither is given), and the callback, if any, is
+    // called then
+    ProgressCallback progress_callback;
+    void *progress_user_data;
+    int progress_interval_bytes;
+    int progress_interval_ms;
+} EncodingOptions;
+
+void init_encoding_options(EncodingOptions *options);
+
+// Size of the workspace of a conversion with these options
+size_t get_encoding_workspace_size(const EncodingOptions *options);
+
 FailureReason prepare_encoding(char *inputFileName, char *outputFileName, int maxStepInBytes, Progress *progress);
+FailureReason prepare_encoding_with_options(char *inputFileName, char *outputFileName, int maxStepInBytes, const EncodingOptions *options, Progress *progress);
+
+// Like prepare_encoding_with_options(), from and to streams the caller opened
+// (with fmemopen(), fdopen(), fopencookie()...) and closes once the conversion
+// is over. The input must be seekable. Neither the I/O backends nor
+// checkpoints are used with them
+FailureReason prepare_encoding_with_streams(FILE *input, FILE *output, int maxStepInBytes, const EncodingOptions *options, Progress *progress);
+
+// Like prepare_encoding_with_options(), but goes on from the checkpoint file
+// of the options when it was saved by an interrupted encoding of the same
+// input, not modified since, to the same output file, with the same options
+// (those the output or the checksums depend on: the format, the deduplication
+// table, the dictionary, the tracks, the hashes and, when decoding, the
+// sparse output and the preallocation). It starts over otherwise
+FailureReason resume_encoding(char *inputFileName, char *outputFileName, int maxStepInBytes, const EncodingOptions *options, Progress *progress);
 void encode(Progress *progress);
 
+// Like encode(), but goes on until the deadline (see get_monotonic_time())
+// passes instead of returning after each step. The clock is only looked at
+// every few sectors, so the deadline can be overrun by that much, and by a
+// single read of up to maxStepInBytes
+void encode_for(Progress *progress, uint64_t deadline);
+
+typedef struct _DecodingOptions {
+    // Dictionary used when encoding, if any
+    char *dictionary_file;
+
+    // Tracks of the image, in order, and the file each of them is written to.
+    // When given, the image is split into these files in the same pass, and
+    // the output file passed to prepare_decoding_with_options() is unused
+    const Track *tracks;
+    int track_count;
+    char * const *track_file_names;
+
+    // Checksums (HASH_* flags) to compute of the whole image and, when the
+    // tracks are given, of each track
+    int hashes;
+    int track_hashes;
+
+    // Size of the image, if known in advance (see scan_ecm_file()). Lets
+    // decoding from stdin report its progress
+    off_t original_size;
+
+    // Reserve the space of the output up front, where the system supports it.
+    // The size of the image is found by scanning the input if not given
+    int preallocate;
+
+    // Leave runs of zeros as holes in the output instead of writing them
+    int sparse;
+
+    // How the output files are written
+    IoOptions io;
+
+    // Where the background tasks run, NULL for threads of the library's own.
+    // Must stay valid until the conversion is done
+    const Executor *executor;
+
+    // Memory the state and the buffers of the conversion are taken from
+    // instead of being allocated, of get_decoding_workspace_size() bytes and
+    // aligned to WORKSPACE_ALIGNMENT (INVALID_WORKSPACE if not), NULL to
+    // allocate them. Must stay valid until the conversion is done.
+    // Dictionaries still grow their index, and the system allocates its FILEs
+    // and threads
+    void *workspace;
+    size_t workspace_size;
+
+    // File where the state of the conversion is saved every
+    // checkpoint_interval_bytes of the image (64 MiB if 0), for
+    // resume_decoding(). NULL not to save it. Not saved when writing to stdout
+    // or extracting from an archive
+    char *checkpoint_file;
+    int checkpoint_interval_bytes;
+
+    // Where to add the timings and counters of the conversion, NULL not to
+    // collect them
+    Stats *stats;
+
+    // The percentages of the Progress are only worked out every
+    // progress_interval_bytes of the image, or when progress_interval_ms have
+    // passed (every 1 MiB when neither is given), and the callback, if any, is
+    // called then
+    ProgressCallback progress_callback;
+    void *progress_user_data;
+    int progress_interval_bytes;
+    int progress_interval_ms;
+} DecodingOptions;
+
+void init_decoding_options(DecodingOptions *options);
+
+size_t get_decoding_workspace_size(const DecodingOptions *options);
+
 FailureReason prepare_decoding(char *inputFileName, char *outputFileName, int maxStepInBytes, Progress *progress);
+FailureReason prepare_decoding_with_options(char *inputFileName, char *outputFileName, int maxStepInBytes, const DecodingOptions *options, Progress *progress);
+
+// Like prepare_decoding_with_options(), from and to streams the caller opened,
+// which are used as stdin and stdout would be: the image can't be split into
+// tracks, nor have references to earlier sectors (STDOUT_NOT_SUPPORTED)
+FailureReason prepare_decoding_with_streams(FILE *input, FILE *output, int maxStepInBytes, const DecodingOptions *options, Progress *progress);
+
+// Like prepare_decoding_with_options(), going on from a checkpoint when
+// possible (see resume_encoding())
+FailureReason resume_decoding(char *inputFileName, char *outputFileName, int maxStepInBytes, const DecodingOptions *options, Progress *progress);
 void decode(Progress *progress);
 
+// Like decode(), but goes on until the deadline passes (see encode_for())
+void decode_for(Progress *progress, uint64_t deadline);
+
+// Current time of the clock of the deadlines, in nanoseconds
+uint64_t get_monotonic_time(void);
+
+// Give up on a conversion before it's done, closing what it has open (the
+// output is left as far as it got). Its Progress becomes a FAILURE with
+// CANCELLED. A conversion started with start_async() is stopped with
+// cancel_async() instead
+void abort_conversion(Progress *progress);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Once prepared, a conversion can also run on a thread of the library (or on
+// the executor of the options) instead of calling encode() or decode() until
+// it's done. Any number can run this way at the same time, each with a file
+// descriptor of its own, and it needs POSIX threads (ASYNC_NOT_SUPPORTED if
+// not, or if the conversion was started already). To run many conversions
+// within a budget of threads and memory, see the scheduler below
+//
+// wait_async() must be called once for every conversion started, even after
+// it ended: the library keeps its state (and its file descriptor) until then
+//
+// The Progress passed is the one given when preparing it, and it's only safe
+// to look at once wait_async() returned. Meanwhile the functions below take
+// it to tell which conversion they're about, and get_async_progress() gets a
+// copy of it as it was last reported (see progress_interval_bytes in the
+// options). The progress callback is called from the thread of the library,
+// also when the conversion fails or is cancelled
+//
+FailureReason start_async(Progress *progress);
+
+// File descriptor (an eventfd on Linux) that becomes readable when the
+// progress is reported and when the conversion ends, to poll along with
+// others. clear_async_fd() reads it back. -1 once waited for
+int get_async_fd(const Progress *progress);
+void clear_async_fd(const Progress *progress);
+
+// The copy has no conversion attached: it's only to be looked at
+void get_async_progress(const Progress *progress, Progress *snapshot);
+
+// Stop the conversion, which then fails with CANCELLED. Its output is left
+// as it is. Doesn't wait for it to stop
+void cancel_async(const Progress *progress);
+
+// Wait for the conversion to end, from the thread that started it
+void wait_async(Progress *progress);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Scheduler of many conversions in the background, such as a batch of files:
+// conversions are submitted to it and shared out between the queues of a pool
+// of threads, each of which steals from the others' once its own queue is
+// empty. They run in slices of a few milliseconds, and between two of them
+// the one of the queue with the least input left goes next, so small files
+// don't wait behind big ones even when submitted after them.
+//
+// The threads of the pool are the budget of the whole scheduler: a conversion
+// with IO_BACKEND_THREADS counts for two while it runs. The memory budget
+// bounds the workspaces (see get_encoding_workspace_size()) of the conversions
+// started and not over yet, the others wait for memory to be freed (one still
+// runs when it needs more than the whole budget). The scheduler allocates the
+// workspace of each conversion, unless given one in its options.
+//
+// Encodings to the same dictionary run one at a time. Without POSIX threads,
+// the conversions run one after the other within wait_scheduler()
+//
+// The unit of work is a whole conversion, run slice by slice: the sectors of
+// one conversion are detected and rebuilt in order on the thread running it,
+// not split across the pool. A batch keeps all the threads busy, a single
+// conversion only uses one
+//
+typedef struct _Scheduler Scheduler;
+
+typedef struct _SchedulerOptions {
+    // Threads the conversions run on, 0 for one per processor
+    int threads;
+
+    // Bytes the workspaces of the conversions may take at once, 0 for no limit
+    size_t memory_budget;
+
+    // Where the threads of the pool are started (see Executor), NULL for
+    // threads of the library's own. They run until destroy_scheduler(). The
+    // conversions whose options have no executor start their background
+    // tasks on it too. Must stay valid until the scheduler is destroyed
+    const Executor *executor;
+} SchedulerOptions;
+
+void init_scheduler_options(SchedulerOptions *options);
+
+// NULL if out of memory
+Scheduler *create_scheduler(const SchedulerOptions *options);
+
+// Submit a conversion, which is prepared once its turn comes, as
+// prepare_encoding_with_options() or prepare_decoding_with_options() would.
+// The options are copied, but what they point to must stay valid until it's
+// over, and conversions running at the same time can't share a Stats. The
+// progress callback is called from the threads of the scheduler.
+//
+// The Progress is only safe to look at once wait_scheduler() returned, and
+// then holds how the conversion went, failures included
+FailureReason schedule_encoding(Scheduler *scheduler, char *inputFileName, char *outputFileName, int maxStepInBytes, const EncodingOptions *options, Progress *progress);
+FailureReason schedule_decoding(Scheduler *scheduler, char *inputFileName, char *outputFileName, int maxStepInBytes, const DecodingOptions *options, Progress *progress);
+
+// Wait until every conversion submitted is over
+void wait_scheduler(Scheduler *scheduler);
+
+// Wait, then stop the threads and free the scheduler
+void destroy_scheduler(Scheduler *scheduler);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Archives hold several images, usually the files of the tracks of one cue
+// sheet, in a single file. Each of them is encoded on its own, so any of them
+// can be extracted without decoding the others
+//
+#define MAX_ARCHIVE_MEMBERS MAX_TRACKS
+#define MAX_ARCHIVE_MEMBER_NAME MAX_CUE_FILE_NAME
+
+typedef struct _ArchiveMember {
+    char name[MAX_ARCHIVE_MEMBER_NAME];
+    off_t offset;        // where its ECM data starts in the archive
+    off_t size;          // size of its ECM data
+    off_t original_size; // size of its image
+} ArchiveMember;
+
+typedef struct _ArchiveDirectory {
+    int member_count;
+    ArchiveMember members[MAX_ARCHIVE_MEMBERS];
+} ArchiveDirectory;
+
+// To write an archive, create it, then add each member by calling
+// prepare_archive_encoding() and encode() as for a single file, and finally
+// close it, which writes the directory. Only one archive can be written at a
+// time, with one member at a time: a member goes into the directory once it's
+// encoded, and one that fails to encode is left out
+FailureReason create_archive(char *archiveFileName);
+FailureReason prepare_archive_encoding(char *inputFileName, char *memberName, int maxStepInBytes, const EncodingOptions *options, Progress *progress);
+FailureReason close_archive(void);
+
+// To read one, get its directory, then extract any member by calling
+// prepare_archive_decoding() and decode() as for a single file
+FailureReason read_archive_directory(char *archiveFileName, ArchiveDirectory *directory);
+FailureReason prepare_archive_decoding(char *archiveFileName, const ArchiveMember *member, char *outputFileName, int maxStepInBytes, const DecodingOptions *options, Progress *progress);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// What an ECM file holds, found by going through its records without decoding
+// them, which only takes a fraction of the time
+//
+typedef struct _EcmInfo {
+    int extended_format;
+    off_t ecm_size;       // size of the ECM data
+    off_t original_size;  // size of the image once decoded
+    off_t record_count;
+    off_t literal_bytes;
+    off_t mode_1_sectors;
+    off_t mode_2_form_1_sectors;
+    off_t mode_2_form_2_sectors;
+    int uses_references;  // decoding needs a seekable output file
+    int uses_dictionary;  // decoding needs the dictionary it was encoded with
+} EcmInfo;
+
+FailureReason scan_ecm_file(char *inputFileName, EcmInfo *info);
+FailureReason scan_archive_member(char *archiveFileName, const ArchiveMember *member, EcmInfo *info);
+
 const char *get_failure_reason_string(FailureReason failureReason);
+
+#ifdef __cplusplus
+}
+#endif
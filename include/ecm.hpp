@@ -0,0 +1,625 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2022      Antonio Fermiano
+//
+// This file is part of libecm.
+//
+// libecm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libecm is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ecm.h"
+
+#if defined(_POSIX_VERSION)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ECM_HPP_STREAMS 1
+#endif
+
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+#define ECM_HPP_COOKIES 1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#define ECM_HPP_FUNOPEN 1
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// C++17 interface: the conversions of ecm.h as move-only objects, which throw
+// ecm::Error when they fail and give up on what they have open when they're
+// destroyed before being done
+//
+//     ecm::Encoder<ecm::Path, ecm::Path> encoder("foo.bin", "foo.bin.ecm");
+//     encoder.run();
+//
+// Each object is a conversion of its own, so any number of them can be
+// unfinished at once, and run on different threads.
+//
+// Sources and sinks are picked at compile time: files (by name or descriptor),
+// stdin and stdout, memory, mapped files and functions. Between two files by
+// name the library opens them itself. Otherwise both ends are streams, as
+// with prepare_encoding_with_streams(), and files by name are opened here,
+// which leaves out what only files the library opens get: the I/O backends,
+// checkpoints, and decoding images with references to earlier sectors.
+//
+// Picking them at compile time only spares the choice: every end that isn't a
+// file by name still reaches the library as a FILE*, so the data goes through
+// stdio and, for functions, through calls the compiler can't inline
+//
+
+namespace ecm {
+
+class Error : public std::runtime_error {
+public:
+    explicit Error(FailureReason reason)
+        : std::runtime_error(get_failure_reason_string(reason)), reason_(reason) {}
+
+    FailureReason reason() const noexcept { return reason_; }
+
+private:
+    FailureReason reason_;
+};
+
+//
+// Sources and sinks
+//
+struct Path {
+    Path(std::string name) : name(std::move(name)) {}
+    Path(const char* name) : name(name) {}
+    std::string name;
+};
+
+struct Standard {}; // stdin as a source, stdout as a sink
+
+#if defined(ECM_HPP_STREAMS)
+
+// Bytes in memory as a source, which must stay valid until the conversion is
+// over
+struct Span {
+    Span(const void* data, std::size_t size) : data(data), size(size) {}
+    const void* data;
+    std::size_t size;
+};
+
+// A vector as a sink, which the output is appended to. What was appended is
+// taken back if the conversion fails. It must stay valid until it's over
+struct Buffer {
+    Buffer(std::vector<std::uint8_t>& bytes) : bytes(&bytes) {}
+    std::vector<std::uint8_t>* bytes;
+};
+
+// An open file descriptor (a pipe, a socket...), which is left open
+struct Descriptor {
+    explicit Descriptor(int fd) : fd(fd) {}
+    int fd;
+};
+
+// A file read through a mapping of it, as a source
+struct Mapped {
+    Mapped(std::string name) : name(std::move(name)) {}
+    Mapped(const char* name) : name(name) {}
+    std::string name;
+};
+
+#endif
+
+#if defined(ECM_HPP_COOKIES) || defined(ECM_HPP_FUNOPEN)
+
+//
+// Functions the data goes through. A reader fills up to size bytes and
+// returns how many it did (0 at the end), a writer returns how many it took
+// (all of them unless it failed). They're called from within the library, so
+// they must not throw. Encoding needs to seek its input, so a reader can only
+// be the source of a decoding
+//
+struct Reader {
+    std::function<std::size_t(void* data, std::size_t size)> read;
+};
+
+struct Writer {
+    std::function<std::size_t(const void* data, std::size_t size)> write;
+};
+
+#endif
+
+//
+// Called as the conversion goes (see progress_interval_bytes in the options).
+// It's called from within the library, so it must not throw
+//
+using ProgressFunction = std::function<void(const Progress&)>;
+
+namespace detail {
+
+//
+// A source or a sink, as given to the library: a name it opens, or a stream
+// (owned unless it's stdin or stdout). What the stream goes through is kept
+// alive along with it, and done is called once it's closed, with whether the
+// conversion went well
+//
+struct Stream {
+    std::string name;
+    std::FILE* file = nullptr;
+    bool owned = false;
+    std::shared_ptr<void> keep;
+    std::function<void(bool completed)> done;
+
+    Stream() = default;
+
+    Stream(Stream&& other) noexcept { *this = std::move(other); }
+
+    Stream& operator=(Stream&& other) noexcept {
+        if(this != &other) {
+            close();
+            name = std::move(other.name);
+            file = other.file;
+            owned = other.owned;
+            keep = std::move(other.keep);
+            done = std::move(other.done);
+            other.file = nullptr;
+        }
+        return *this;
+    }
+
+    ~Stream() { close(); }
+
+    static Stream named(std::string name) {
+        Stream stream;
+        stream.name = std::move(name);
+        return stream;
+    }
+
+    static Stream opened(std::FILE* file, FailureReason failure) {
+        if(file == nullptr) {
+            throw Error(failure);
+        }
+        Stream stream;
+        stream.file = file;
+        stream.owned = true;
+        return stream;
+    }
+
+    //
+    // Open the file it names, when the other end is a stream
+    //
+    void open(const char* mode, std::FILE* standard) {
+        if(file != nullptr) {
+            return;
+        }
+        if(name == STDIN_MARKER || name == STDOUT_MARKER) {
+            file = standard;
+            return;
+        }
+        file = std::fopen(name.c_str(), mode);
+        if(file == nullptr) {
+            throw Error(mode[0] == 'r' ? ERROR_OPENING_INPUT_FILE : ERROR_OPENING_OUTPUT_FILE);
+        }
+        owned = true;
+    }
+
+    // Returns false if the last of the output couldn't be written
+    bool close() noexcept {
+        bool ok = true;
+        if(file != nullptr) {
+            ok = (owned ? std::fclose(file) : (file == stdin) ? 0 : std::fflush(file)) == 0;
+        }
+        file = nullptr;
+        return ok;
+    }
+};
+
+} // namespace detail
+
+#if defined(ECM_HPP_COOKIES) || defined(ECM_HPP_FUNOPEN)
+
+namespace detail {
+
+#if defined(ECM_HPP_COOKIES)
+inline ssize_t read_cookie(void* cookie, char* data, std::size_t size) {
+    return (ssize_t)static_cast<Reader*>(cookie)->read(data, size);
+}
+
+inline ssize_t write_cookie(void* cookie, const char* data, std::size_t size) {
+    const std::size_t written = static_cast<Writer*>(cookie)->write(data, size);
+    return (written == size) ? (ssize_t)written : -1;
+}
+#else
+inline int read_cookie(void* cookie, char* data, int size) {
+    return (int)static_cast<Reader*>(cookie)->read(data, (std::size_t)size);
+}
+
+inline int write_cookie(void* cookie, const char* data, int size) {
+    const std::size_t written = static_cast<Writer*>(cookie)->write(data, (std::size_t)size);
+    return (written == (std::size_t)size) ? size : -1;
+}
+#endif
+
+template<typename Function>
+Stream function_stream(const Function& function, bool reading) {
+    auto kept = std::make_shared<Function>(function);
+#if defined(ECM_HPP_COOKIES)
+    cookie_io_functions_t functions{};
+    if(reading) {
+        functions.read = &read_cookie;
+    } else {
+        functions.write = &write_cookie;
+    }
+    Stream stream = Stream::opened(fopencookie(kept.get(), reading ? "rb" : "wb", functions), reading ? ERROR_OPENING_INPUT_FILE : ERROR_OPENING_OUTPUT_FILE);
+#else
+    Stream stream = Stream::opened(funopen(kept.get(), reading ? &read_cookie : nullptr, reading ? nullptr : &write_cookie, nullptr, nullptr), reading ? ERROR_OPENING_INPUT_FILE : ERROR_OPENING_OUTPUT_FILE);
+#endif
+    stream.keep = kept;
+    return stream;
+}
+
+} // namespace detail
+
+#endif
+
+//
+// How a source or a sink is passed to the library, specialized for each of
+// them
+//
+template<typename T>
+struct Endpoint {
+    static_assert(!std::is_same<T, T>::value, "ecm: not a source or sink (see the structures of ecm.hpp)");
+};
+
+template<>
+struct Endpoint<Path> {
+    static detail::Stream input(const Path& path) { return detail::Stream::named(path.name); }
+    static detail::Stream output(const Path& path) { return detail::Stream::named(path.name); }
+};
+
+template<>
+struct Endpoint<Standard> {
+    static detail::Stream input(const Standard&) { return detail::Stream::named(STDIN_MARKER); }
+    static detail::Stream output(const Standard&) { return detail::Stream::named(STDOUT_MARKER); }
+};
+
+#if defined(ECM_HPP_STREAMS)
+
+template<>
+struct Endpoint<Span> {
+    static detail::Stream input(const Span& span) {
+        return detail::Stream::opened(fmemopen(const_cast<void*>(span.data), span.size, "rb"), ERROR_OPENING_INPUT_FILE);
+    }
+};
+
+template<>
+struct Endpoint<Buffer> {
+#if defined(ECM_HPP_COOKIES) || defined(ECM_HPP_FUNOPEN)
+    //
+    // Written straight into the vector as stdio flushes
+    //
+    static detail::Stream output(const Buffer& buffer) {
+        std::vector<std::uint8_t>* bytes = buffer.bytes;
+        const std::size_t size = bytes->size();
+        Writer writer{[bytes](const void* data, std::size_t size) {
+            const std::uint8_t* begin = static_cast<const std::uint8_t*>(data);
+            bytes->insert(bytes->end(), begin, begin + size);
+            return size;
+        }};
+        detail::Stream stream = detail::function_stream(writer, false);
+        stream.done = [bytes, size](bool completed) {
+            if(!completed) {
+                bytes->resize(size);
+            }
+        };
+        return stream;
+    }
+#else
+    //
+    // A memory stream, whose buffer is only complete once it's closed
+    //
+    struct Memory {
+        char* data = nullptr;
+        std::size_t size = 0;
+        ~Memory() { std::free(data); }
+    };
+
+    static detail::Stream output(const Buffer& buffer) {
+        auto memory = std::make_shared<Memory>();
+        detail::Stream stream = detail::Stream::opened(open_memstream(&memory->data, &memory->size), ERROR_OPENING_OUTPUT_FILE);
+        stream.keep = memory;
+        stream.done = [memory, bytes = buffer.bytes](bool completed) {
+            if(completed) {
+                bytes->insert(bytes->end(), memory->data, memory->data + memory->size);
+            }
+        };
+        return stream;
+    }
+#endif
+};
+
+template<>
+struct Endpoint<Descriptor> {
+    static detail::Stream input(const Descriptor& descriptor) { return open(descriptor, "rb", ERROR_OPENING_INPUT_FILE); }
+    static detail::Stream output(const Descriptor& descriptor) { return open(descriptor, "wb", ERROR_OPENING_OUTPUT_FILE); }
+
+private:
+    static detail::Stream open(const Descriptor& descriptor, const char* mode, FailureReason failure) {
+        const int fd = dup(descriptor.fd);
+        std::FILE* file = (fd >= 0) ? fdopen(fd, mode) : nullptr;
+        if(file == nullptr && fd >= 0) {
+            close(fd);
+        }
+        return detail::Stream::opened(file, failure);
+    }
+};
+
+template<>
+struct Endpoint<Mapped> {
+    static detail::Stream input(const Mapped& mapped) {
+        struct stat status;
+        void* map = MAP_FAILED;
+        const int fd = ::open(mapped.name.c_str(), O_RDONLY);
+        if(fd < 0) {
+            throw Error(ERROR_OPENING_INPUT_FILE);
+        }
+        if(fstat(fd, &status) == 0 && status.st_size > 0) {
+            map = mmap(nullptr, (std::size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if(map == MAP_FAILED) {
+            throw Error(ERROR_READING_INPUT_FILE);
+        }
+        const std::size_t size = (std::size_t)status.st_size;
+        std::shared_ptr<void> keep(map, [size](void* map) { munmap(map, size); });
+        detail::Stream stream = detail::Stream::opened(fmemopen(map, size, "rb"), ERROR_OPENING_INPUT_FILE);
+        stream.keep = std::move(keep);
+        return stream;
+    }
+};
+
+#endif
+
+#if defined(ECM_HPP_COOKIES) || defined(ECM_HPP_FUNOPEN)
+
+template<>
+struct Endpoint<Reader> {
+    static detail::Stream input(const Reader& reader) { return detail::function_stream(reader, true); }
+};
+
+template<>
+struct Endpoint<Writer> {
+    static detail::Stream output(const Writer& writer) { return detail::function_stream(writer, false); }
+};
+
+#endif
+
+namespace detail {
+
+//
+// What the library keeps a pointer to, so it's on the heap and the objects
+// can move
+//
+template<typename Options>
+struct State {
+    Progress progress{};
+    Options options{};
+    ProgressFunction on_progress;
+    Stream input;
+    Stream output;
+
+    static void callback(const Progress* progress, void* user_data) {
+        static_cast<State*>(user_data)->on_progress(*progress);
+    }
+
+    // Returns false if the output couldn't be completed
+    bool close() noexcept {
+        input.close();
+        return output.close();
+    }
+};
+
+template<typename Direction>
+class Conversion {
+public:
+    using Options = typename Direction::Options;
+
+    Conversion(Stream input, Stream output, const Options& options, ProgressFunction on_progress, int max_step_in_bytes) {
+        FailureReason reason;
+        state_ = std::make_unique<State<Options>>();
+        state_->options = options;
+        state_->input = std::move(input);
+        state_->output = std::move(output);
+        if(on_progress) {
+            state_->on_progress = std::move(on_progress);
+            state_->options.progress_callback = &State<Options>::callback;
+            state_->options.progress_user_data = state_.get();
+        }
+        if(state_->input.file == nullptr && state_->output.file == nullptr) {
+            reason = Direction::prepare(&state_->input.name[0], &state_->output.name[0], max_step_in_bytes, &state_->options, &state_->progress);
+        } else {
+            state_->input.open("rb", stdin);
+            state_->output.open("wb", stdout);
+            reason = Direction::prepare_streams(state_->input.file, state_->output.file, max_step_in_bytes, &state_->options, &state_->progress);
+        }
+        if(reason != SUCCESS) {
+            state_->close();
+            finish(false);
+            state_.reset();
+            throw Error(reason);
+        }
+    }
+
+    Conversion(Conversion&&) noexcept = default;
+
+    Conversion& operator=(Conversion&& other) noexcept {
+        if(this != &other) {
+            release();
+            state_ = std::move(other.state_);
+        }
+        return *this;
+    }
+
+    Conversion(const Conversion&) = delete;
+    Conversion& operator=(const Conversion&) = delete;
+
+    ~Conversion() { release(); }
+
+    //
+    // Go on with the conversion for a step (maxStepInBytes), returns false
+    // once it's done
+    //
+    bool step() {
+        Direction::step(&state().progress);
+        return check();
+    }
+
+    //
+    // Go on until the time is up, returns false once it's done
+    //
+    template<typename Rep, typename Period>
+    bool run_for(std::chrono::duration<Rep, Period> duration) {
+        const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+        Direction::step_for(&state().progress, get_monotonic_time() + (uint64_t)(nanoseconds > 0 ? nanoseconds : 0));
+        return check();
+    }
+
+    void run() {
+        while(step()) {}
+    }
+
+    bool done() const noexcept { return state_ == nullptr || state_->progress.state != IN_PROGRESS; }
+
+    const Progress& progress() const { return state_->progress; }
+
+private:
+    State<Options>& state() {
+        if(state_ == nullptr) {
+            throw std::logic_error("ecm: conversion moved from");
+        }
+        return *state_;
+    }
+
+    //
+    // Once it's over, close the streams, and hand the output over when it
+    // went well
+    //
+    bool check() {
+        Progress& progress = state_->progress;
+        if(progress.state == IN_PROGRESS) {
+            return true;
+        }
+        if(!state_->close() && progress.state == COMPLETED) {
+            progress.state = FAILURE;
+            progress.failure_reason = ERROR_WRITING_OUTPUT_FILE;
+        }
+        finish(progress.state == COMPLETED);
+        if(progress.state == FAILURE) {
+            throw Error(progress.failure_reason);
+        }
+        return false;
+    }
+
+    void finish(bool completed) noexcept {
+        if(state_->output.done) {
+            state_->output.done(completed);
+            state_->output.done = nullptr;
+        }
+    }
+
+    void release() noexcept {
+        if(state_ != nullptr && state_->progress.state == IN_PROGRESS) {
+            abort_conversion(&state_->progress);
+        }
+        if(state_ != nullptr) {
+            state_->close();
+            finish(false);
+        }
+        state_.reset();
+    }
+
+    std::unique_ptr<State<Options>> state_;
+};
+
+struct Encoding {
+    using Options = EncodingOptions;
+    static FailureReason prepare(char* input, char* output, int max_step_in_bytes, const Options* options, Progress* progress) {
+        return prepare_encoding_with_options(input, output, max_step_in_bytes, options, progress);
+    }
+    static FailureReason prepare_streams(std::FILE* input, std::FILE* output, int max_step_in_bytes, const Options* options, Progress* progress) {
+        return prepare_encoding_with_streams(input, output, max_step_in_bytes, options, progress);
+    }
+    static void step(Progress* progress) { encode(progress); }
+    static void step_for(Progress* progress, uint64_t deadline) { encode_for(progress, deadline); }
+};
+
+struct Decoding {
+    using Options = DecodingOptions;
+    static FailureReason prepare(char* input, char* output, int max_step_in_bytes, const Options* options, Progress* progress) {
+        return prepare_decoding_with_options(input, output, max_step_in_bytes, options, progress);
+    }
+    static FailureReason prepare_streams(std::FILE* input, std::FILE* output, int max_step_in_bytes, const Options* options, Progress* progress) {
+        return prepare_decoding_with_streams(input, output, max_step_in_bytes, options, progress);
+    }
+    static void step(Progress* progress) { decode(progress); }
+    static void step_for(Progress* progress, uint64_t deadline) { decode_for(progress, deadline); }
+};
+
+} // namespace detail
+
+constexpr int default_max_step_in_bytes = 1024 * 1024;
+
+inline EncodingOptions default_encoding_options() {
+    EncodingOptions options;
+    init_encoding_options(&options);
+    return options;
+}
+
+inline DecodingOptions default_decoding_options() {
+    DecodingOptions options;
+    init_decoding_options(&options);
+    return options;
+}
+
+template<typename Source = Path, typename Sink = Path>
+class Encoder : public detail::Conversion<detail::Encoding> {
+public:
+    Encoder(Source source, Sink sink,
+            const EncodingOptions& options = default_encoding_options(),
+            ProgressFunction on_progress = nullptr,
+            int max_step_in_bytes = default_max_step_in_bytes)
+        : detail::Conversion<detail::Encoding>(Endpoint<Source>::input(source), Endpoint<Sink>::output(sink),
+                                               options, std::move(on_progress), max_step_in_bytes) {}
+};
+
+template<typename Source = Path, typename Sink = Path>
+class Decoder : public detail::Conversion<detail::Decoding> {
+public:
+    Decoder(Source source, Sink sink,
+            const DecodingOptions& options = default_decoding_options(),
+            ProgressFunction on_progress = nullptr,
+            int max_step_in_bytes = default_max_step_in_bytes)
+        : detail::Conversion<detail::Decoding>(Endpoint<Source>::input(source), Endpoint<Sink>::output(sink),
+                                               options, std::move(on_progress), max_step_in_bytes) {}
+};
+
+} // namespace ecm
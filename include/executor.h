@@ -0,0 +1,61 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2022      Antonio Fermiano
+//
+// This file is part of libecm.
+//
+// libecm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libecm is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+#pragma once
+
+#include "common.h"
+#include "ecm.h"
+
+#if defined(HAVE_PTHREADS)
+#include <pthread.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Background tasks of the library, started on the Executor given in the
+// options or on a thread of their own, and waited for with a wait group of
+// the library's so that executors only need to start them. The caller holds
+// the task, so starting one allocates nothing. Tasks are long-lived (an I/O
+// thread, a whole conversion), which is why each has a wait group of its own
+// rather than sharing a pool's
+//
+
+typedef struct _Task {
+    ExecutorTask run;
+    void* argument;
+#if defined(HAVE_PTHREADS)
+    // Wait group of a single task: set once it's done
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    int8_t done;
+#endif
+} Task;
+
+//
+// Returns zero if the task couldn't be started, or threads aren't available
+// here
+//
+int8_t task_start(Task* task, const Executor* executor, ExecutorTask run, void* argument);
+
+//
+// Wait until the task is done
+//
+void task_wait(Task* task);
@@ -0,0 +1,72 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2022      Antonio Fermiano
+//
+// This file is part of libecm.
+//
+// libecm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libecm is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+#pragma once
+
+#include "common.h"
+
+#include "ecm.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Checksums of the original image, as found in disc image databases
+//
+
+void crc32_init(void);
+
+//
+// Start with crc = 0, the result of each call is the crc of the next one
+//
+uint32_t crc32_compute(uint32_t crc, const uint8_t* data, size_t size);
+
+typedef struct _Md5 {
+    uint32_t state[4];
+    uint64_t length;
+    uint8_t buffer[64];
+} Md5;
+
+void md5_start(Md5* md5);
+void md5_update(Md5* md5, const uint8_t* data, size_t size);
+void md5_finish(Md5* md5, uint8_t digest[16]);
+
+typedef struct _Sha1 {
+    uint32_t state[5];
+    uint64_t length;
+    uint8_t buffer[64];
+} Sha1;
+
+void sha1_start(Sha1* sha1);
+void sha1_update(Sha1* sha1, const uint8_t* data, size_t size);
+void sha1_finish(Sha1* sha1, uint8_t digest[20]);
+
+//
+// Any of the above at once, as selected by the HASH_* flags of ecm.h
+//
+typedef struct _HashState {
+    int flags;
+    uint32_t crc32;
+    Md5 md5;
+    Sha1 sha1;
+} HashState;
+
+void hash_start(HashState* state, int flags);
+void hash_update(HashState* state, const uint8_t* data, size_t size);
+void hash_finish(HashState* state, Hashes* hashes);
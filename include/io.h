@@ -0,0 +1,79 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2022      Antonio Fermiano
+//
+// This file is part of libecm.
+//
+// libecm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libecm is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+#pragma once
+
+#include "common.h"
+#include "ecm.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Sequential access to a file by blocks, with the next blocks being read (or
+// the previous ones being written) in the background while the caller works
+// on the current one.
+//
+// Opening returns NULL when the backend asked for isn't available here, the
+// caller goes on with stdio then. The thread of IO_BACKEND_THREADS runs on the
+// executor, or on a thread of its own when it's NULL. With memory given (of
+// block_io_memory_size() bytes, aligned to 4096) nothing is allocated. Both
+// work on file descriptors and never move their file position.
+//
+
+//
+// Memory a reader or a writer needs, 0 if the backend isn't available here
+//
+size_t block_io_memory_size(const IoOptions* options);
+
+typedef struct _BlockReader BlockReader;
+
+BlockReader* block_reader_open(int fd, off_t offset, off_t length, const IoOptions* options, const Executor* executor, void* memory);
+
+//
+// Next block of the file, valid until the following call. Sets size to 0 at
+// the end, returns NULL on error
+//
+const uint8_t* block_reader_next(BlockReader* reader, size_t* size);
+
+void block_reader_close(BlockReader* reader);
+
+typedef struct _BlockWriter BlockWriter;
+
+BlockWriter* block_writer_open(int fd, off_t offset, const IoOptions* options, const Executor* executor, void* memory);
+
+int8_t block_writer_write(BlockWriter* writer, const uint8_t* data, size_t size);
+
+//
+// Move ahead without writing, which leaves a hole at the end of the file
+//
+int8_t block_writer_skip(BlockWriter* writer, off_t size);
+
+//
+// Wait until everything written so far is in the file
+//
+int8_t block_writer_flush(BlockWriter* writer);
+
+off_t block_writer_position(const BlockWriter* writer);
+
+//
+// Flush and free the writer, the file descriptor stays open. Returns zero if
+// anything couldn't be written
+//
+int8_t block_writer_close(BlockWriter* writer);
@@ -0,0 +1,56 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2022      Antonio Fermiano
+//
+// This file is part of libecm.
+//
+// libecm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libecm is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "common.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// The sector level of the format: EDC/ECC, and the detection and
+// reconstruction of each sector type (see sector.c). Internal to the library,
+// but exposed to the benchmarks
+//
+
+//
+// Fill the LUTs, needed before anything else
+//
+void eccedc_init(void);
+
+uint32_t edc_compute(uint32_t edc, const uint8_t* src, size_t size);
+
+int8_t ecc_checksector(const uint8_t* address, const uint8_t* data, const uint8_t* ecc);
+void ecc_writesector(const uint8_t* address, const uint8_t* data, uint8_t* ecc);
+
+//
+// Address used in the ECC of mode 2 sectors, which don't include theirs
+//
+extern const uint8_t zeroaddress[4];
+
+//
+// Type of the sector at the start of the data, 0 if there's none
+//
+int8_t detect_sector(const uint8_t* sector, size_t size_available);
+int8_t detect_sector_extended(const uint8_t* sector, size_t size_available);
+
+//
+// Rebuild the parts of a sector that the given type predicts
+//
+void reconstruct_sector(uint8_t* sector, int8_t type);
@@ -36,3 +36,14 @@ void put32lsb(uint8_t* dest, uint32_t value) {
     dest[2] = (uint8_t)(value >> 16);
     dest[3] = (uint8_t)(value >> 24);
 }
+
+uint64_t get64lsb(const uint8_t* src) {
+    return
+        (((uint64_t)get32lsb(src    ))      ) |
+        (((uint64_t)get32lsb(src + 4)) << 32);
+}
+
+void put64lsb(uint8_t* dest, uint64_t value) {
+    put32lsb(dest    , (uint32_t)(value      ));
+    put32lsb(dest + 4, (uint32_t)(value >> 32));
+}
@@ -0,0 +1,205 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2022      Antonio Fermiano
+//
+// This file is part of libecm.
+//
+// libecm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libecm is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "common.h"
+#include "ecm.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Minimal cue sheet parser
+//
+// Only FILE, TRACK and INDEX are relevant to us; everything else is ignored.
+// A track starts at its first INDEX, so its pregap (INDEX 00), when it's
+// stored in the file, belongs to it. When that is in an earlier file than the
+// rest of the track, the track goes on from the start of the next file.
+//
+
+#define MAX_CUE_LINE 1024
+
+//
+// Copy the next token of the line, which may be quoted, returns the position
+// after it or NULL if there's none
+//
+static const char* next_token(const char* line, char* token, size_t token_size) {
+    size_t length = 0;
+    char end = ' ';
+
+    while(*line == ' ' || *line == '\t') { line++; }
+    if(*line == 0 || *line == '\r' || *line == '\n') {
+        return NULL;
+    }
+    if(*line == '"') {
+        end = '"';
+        line++;
+    }
+    while(*line && *line != '\r' && *line != '\n' && (end == '"' ? *line != '"' : (*line != ' ' && *line != '\t'))) {
+        if(length + 1 < token_size) {
+            token[length++] = *line;
+        }
+        line++;
+    }
+    if(end == '"' && *line == '"') {
+        line++;
+    }
+    token[length] = 0;
+    return line;
+}
+
+static int same_keyword(const char* token, const char* keyword) {
+    for(; *token && *keyword; token++, keyword++) {
+        if(toupper((unsigned char)*token) != *keyword) {
+            return 0;
+        }
+    }
+    return *token == 0 && *keyword == 0;
+}
+
+static int8_t parse_track_mode(const char* token, Track* track) {
+    if(same_keyword(token, "AUDIO")) {
+        track->mode = TRACK_AUDIO;
+        track->sector_size = 2352;
+    } else if(same_keyword(token, "CDG")) {
+        track->mode = TRACK_OTHER;
+        track->sector_size = 2448;
+    } else if(
+        (toupper((unsigned char)token[0]) == 'M') &&
+        (same_keyword(token, "MODE1/2048") || same_keyword(token, "MODE1/2352") ||
+         same_keyword(token, "MODE2/2048") || same_keyword(token, "MODE2/2324") ||
+         same_keyword(token, "MODE2/2336") || same_keyword(token, "MODE2/2352"))
+    ) {
+        track->mode = (token[4] == '1') ? TRACK_MODE1 : TRACK_MODE2;
+        track->sector_size = atoi(token + 6);
+    } else if(same_keyword(token, "CDI/2336") || same_keyword(token, "CDI/2352")) {
+        track->mode = TRACK_MODE2;
+        track->sector_size = atoi(token + 4);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+//
+// Parse "mm:ss:ff" into a sector number
+//
+static int8_t parse_msf(const char* token, int* lba) {
+    int minutes, seconds, frames;
+    char extra;
+    if(sscanf(token, "%d:%d:%d%c", &minutes, &seconds, &frames, &extra) != 3) {
+        return 0;
+    }
+    if(minutes < 0 || seconds < 0 || seconds >= 60 || frames < 0 || frames >= 75) {
+        return 0;
+    }
+    *lba = (minutes * 60 + seconds) * 75 + frames;
+    return 1;
+}
+
+FailureReason parse_cue_sheet(char *cue_file_name, CueSheet *cue_sheet) {
+    char line[MAX_CUE_LINE];
+    char token[MAX_CUE_FILE_NAME];
+    int8_t track_has_index = 0;
+    FailureReason ret = SUCCESS;
+
+    FILE* cue = fopen(cue_file_name, "r");
+    if(!cue) {
+        return ERROR_OPENING_CUE_SHEET;
+    }
+
+    memset(cue_sheet, 0, sizeof(CueSheet));
+
+    while(ret == SUCCESS && fgets(line, sizeof(line), cue)) {
+        const char* rest = next_token(line, token, sizeof(token));
+        if(!rest) {
+            continue;
+        }
+
+        if(same_keyword(token, "FILE")) {
+            if(cue_sheet->file_count >= MAX_TRACKS || !next_token(rest, token, sizeof(token))) {
+                ret = INVALID_CUE_SHEET;
+                break;
+            }
+            strcpy(cue_sheet->file_names[cue_sheet->file_count++], token);
+
+        } else if(same_keyword(token, "TRACK")) {
+            Track* track;
+            if(
+                cue_sheet->file_count == 0 ||
+                cue_sheet->track_count >= 2 * MAX_TRACKS ||
+                (cue_sheet->track_count > 0 && !track_has_index)
+            ) {
+                ret = INVALID_CUE_SHEET;
+                break;
+            }
+            track = &cue_sheet->tracks[cue_sheet->track_count++];
+            track->file = cue_sheet->file_count - 1;
+            track_has_index = 0;
+
+            rest = next_token(rest, token, sizeof(token)); // number
+            if(!rest || !next_token(rest, token, sizeof(token)) || !parse_track_mode(token, track)) {
+                ret = INVALID_CUE_SHEET;
+                break;
+            }
+
+        } else if(same_keyword(token, "INDEX")) {
+            Track* track;
+            int lba;
+            if(cue_sheet->track_count == 0) {
+                ret = INVALID_CUE_SHEET;
+                break;
+            }
+            track = &cue_sheet->tracks[cue_sheet->track_count - 1];
+
+            rest = next_token(rest, token, sizeof(token)); // number
+            if(!rest || !next_token(rest, token, sizeof(token)) || !parse_msf(token, &lba)) {
+                ret = INVALID_CUE_SHEET;
+                break;
+            }
+            if(!track_has_index) {
+                //
+                // A track is in the file of its first INDEX, which may come
+                // after the next FILE line
+                //
+                track->file = cue_sheet->file_count - 1;
+                track->lba = lba;
+                track_has_index = 1;
+            } else if(track->file != cue_sheet->file_count - 1) {
+                //
+                // Its pregap ended the previous file: the rest of it starts
+                // this one
+                //
+                if(cue_sheet->track_count >= 2 * MAX_TRACKS) {
+                    ret = INVALID_CUE_SHEET;
+                    break;
+                }
+                cue_sheet->tracks[cue_sheet->track_count] = *track;
+                track = &cue_sheet->tracks[cue_sheet->track_count++];
+                track->file = cue_sheet->file_count - 1;
+                track->lba = 0;
+            }
+        }
+    }
+
+    if(ret == SUCCESS && (cue_sheet->track_count == 0 || !track_has_index)) {
+        ret = INVALID_CUE_SHEET;
+    }
+
+    fclose(cue);
+    return ret;
+}
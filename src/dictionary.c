@@ -0,0 +1,278 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2022      Antonio Fermiano
+//
+// This file is part of libecm.
+//
+// libecm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libecm is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "dictionary.h"
+
+//
+// The pack file is mapped in memory for decoding where possible
+//
+#if defined(_POSIX_VERSION)
+#include <sys/mman.h>
+#define DICTIONARY_MMAP 1
+#endif
+
+#define INDEX_SUFFIX ".idx"
+#define INDEX_ENTRY_SIZE 16
+
+static const uint8_t pack_magic[4] = {'E', 'C', 'M', 'D'};
+
+typedef struct _DictionaryEntry {
+    uint64_t hash;
+    off_t offset;
+} DictionaryEntry;
+
+struct _Dictionary {
+    FILE* pack;
+    FILE* index;
+    off_t pack_length;
+
+    //
+    // Open addressing hash table of the payloads in the pack file
+    //
+    DictionaryEntry* entries;
+    size_t mask;
+    size_t count;
+
+    const uint8_t* map;
+    size_t map_length;
+
+    uint8_t buffer[0x918];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int8_t table_grow(Dictionary* dictionary);
+
+static int8_t table_insert(Dictionary* dictionary, uint64_t hash, off_t offset) {
+    size_t i;
+    //
+    // Keep the load factor under 1/2
+    //
+    if((dictionary->count + 1) * 2 > dictionary->mask + 1) {
+        if(!table_grow(dictionary)) {
+            return 0;
+        }
+    }
+    i = (size_t)hash & dictionary->mask;
+    while(dictionary->entries[i].offset >= 0) {
+        i = (i + 1) & dictionary->mask;
+    }
+    dictionary->entries[i].hash = hash;
+    dictionary->entries[i].offset = offset;
+    dictionary->count++;
+    return 1;
+}
+
+static int8_t table_grow(Dictionary* dictionary) {
+    DictionaryEntry* old_entries = dictionary->entries;
+    const size_t old_size = old_entries ? dictionary->mask + 1 : 0;
+    const size_t new_size = old_size ? old_size * 2 : 4096;
+    size_t i;
+
+    dictionary->entries = malloc(new_size * sizeof(DictionaryEntry));
+    if(!dictionary->entries) {
+        dictionary->entries = old_entries;
+        return 0;
+    }
+    for(i = 0; i < new_size; i++) {
+        dictionary->entries[i].offset = -1;
+    }
+    dictionary->mask = new_size - 1;
+    dictionary->count = 0;
+
+    for(i = 0; i < old_size; i++) {
+        if(old_entries[i].offset >= 0) {
+            table_insert(dictionary, old_entries[i].hash, old_entries[i].offset);
+        }
+    }
+    if(old_entries) { free(old_entries); }
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int8_t load_index(Dictionary* dictionary, const char* index_name) {
+    uint8_t entry[INDEX_ENTRY_SIZE];
+    FILE* index = fopen(index_name, "rb");
+    if(!index) {
+        //
+        // New store
+        //
+        return 1;
+    }
+    while(fread(entry, 1, INDEX_ENTRY_SIZE, index) == INDEX_ENTRY_SIZE) {
+        const uint64_t hash = get64lsb(entry);
+        const off_t offset = (off_t)get64lsb(entry + 8);
+        //
+        // Ignore entries whose payload didn't make it to the pack file
+        //
+        if(offset < (off_t)sizeof(pack_magic) || offset >= dictionary->pack_length) {
+            continue;
+        }
+        if(!table_insert(dictionary, hash, offset)) {
+            fclose(index);
+            return 0;
+        }
+    }
+    fclose(index);
+    return 1;
+}
+
+Dictionary* dictionary_open(const char* name, int8_t writable) {
+    uint8_t magic[4];
+    Dictionary* dictionary = calloc(1, sizeof(Dictionary));
+    if(!dictionary) {
+        return NULL;
+    }
+
+    dictionary->pack = fopen(name, writable ? "r+b" : "rb");
+    if(!dictionary->pack && writable) {
+        dictionary->pack = fopen(name, "w+b");
+        if(dictionary->pack && fwrite(pack_magic, 1, sizeof(pack_magic), dictionary->pack) != sizeof(pack_magic)) {
+            dictionary_close(dictionary);
+            return NULL;
+        }
+    }
+    if(!dictionary->pack) {
+        dictionary_close(dictionary);
+        return NULL;
+    }
+
+    //
+    // Check the magic and get the length of the pack file
+    //
+    if(
+        fseeko(dictionary->pack, 0, SEEK_SET) != 0 ||
+        fread(magic, 1, sizeof(magic), dictionary->pack) != sizeof(magic) ||
+        memcmp(magic, pack_magic, sizeof(magic)) != 0 ||
+        fseeko(dictionary->pack, 0, SEEK_END) != 0
+    ) {
+        dictionary_close(dictionary);
+        return NULL;
+    }
+    dictionary->pack_length = ftello(dictionary->pack);
+    if(dictionary->pack_length < 0) {
+        dictionary_close(dictionary);
+        return NULL;
+    }
+
+    if(writable) {
+        char* index_name = malloc(strlen(name) + sizeof(INDEX_SUFFIX));
+        if(!index_name) {
+            dictionary_close(dictionary);
+            return NULL;
+        }
+        strcpy(index_name, name);
+        strcat(index_name, INDEX_SUFFIX);
+
+        if(!table_grow(dictionary) || !load_index(dictionary, index_name)) {
+            free(index_name);
+            dictionary_close(dictionary);
+            return NULL;
+        }
+        dictionary->index = fopen(index_name, "ab");
+        free(index_name);
+        if(!dictionary->index) {
+            dictionary_close(dictionary);
+            return NULL;
+        }
+    }
+#ifdef DICTIONARY_MMAP
+    else if((off_t)(size_t)dictionary->pack_length == dictionary->pack_length) {
+        void* map = mmap(NULL, (size_t)dictionary->pack_length, PROT_READ, MAP_SHARED, fileno(dictionary->pack), 0);
+        if(map != MAP_FAILED) {
+            dictionary->map = map;
+            dictionary->map_length = (size_t)dictionary->pack_length;
+        }
+    }
+#endif
+
+    return dictionary;
+}
+
+void dictionary_close(Dictionary* dictionary) {
+#ifdef DICTIONARY_MMAP
+    if(dictionary->map) { munmap((void*)dictionary->map, dictionary->map_length); }
+#endif
+    if(dictionary->pack) { fclose(dictionary->pack); }
+    if(dictionary->index) { fclose(dictionary->index); }
+    if(dictionary->entries) { free(dictionary->entries); }
+    free(dictionary);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+off_t dictionary_find(Dictionary* dictionary, uint64_t hash, const uint8_t* payload, size_t size) {
+    size_t i = (size_t)hash & dictionary->mask;
+    for(; dictionary->entries[i].offset >= 0; i = (i + 1) & dictionary->mask) {
+        if(dictionary->entries[i].hash != hash) {
+            continue;
+        }
+        //
+        // Compare the payloads, in case of hash collisions
+        //
+        if(
+            size <= sizeof(dictionary->buffer) &&
+            dictionary_read(dictionary, dictionary->entries[i].offset, dictionary->buffer, size) &&
+            memcmp(dictionary->buffer, payload, size) == 0
+        ) {
+            return dictionary->entries[i].offset;
+        }
+    }
+    return -1;
+}
+
+off_t dictionary_add(Dictionary* dictionary, uint64_t hash, const uint8_t* payload, size_t size) {
+    uint8_t entry[INDEX_ENTRY_SIZE];
+    const off_t offset = dictionary->pack_length;
+
+    if(fseeko(dictionary->pack, offset, SEEK_SET) != 0) {
+        return -1;
+    }
+    if(fwrite(payload, 1, size, dictionary->pack) != size) {
+        return -1;
+    }
+    dictionary->pack_length += size;
+
+    put64lsb(entry    , hash);
+    put64lsb(entry + 8, (uint64_t)offset);
+    if(fwrite(entry, 1, INDEX_ENTRY_SIZE, dictionary->index) != INDEX_ENTRY_SIZE) {
+        return -1;
+    }
+
+    if(!table_insert(dictionary, hash, offset)) {
+        return -1;
+    }
+    return offset;
+}
+
+int8_t dictionary_read(Dictionary* dictionary, off_t offset, uint8_t* payload, size_t size) {
+    if(offset < (off_t)sizeof(pack_magic) || offset + (off_t)size > dictionary->pack_length) {
+        return 0;
+    }
+    if(dictionary->map) {
+        memcpy(payload, dictionary->map + offset, size);
+        return 1;
+    }
+    if(fseeko(dictionary->pack, offset, SEEK_SET) != 0) {
+        return 0;
+    }
+    return fread(payload, 1, size, dictionary->pack) == size;
+}
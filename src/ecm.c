@@ -20,384 +20,213 @@
 //
 ////////////////////////////////////////////////////////////////////////////////
 
+#if defined(__linux__)
+// For fallocate(), copy_file_range(), splice() and sync_file_range()
+#define _GNU_SOURCE
+#endif
+
 #include "common.h"
 #include "ecm.h"
+#include "dictionary.h"
+#include "hash.h"
+#include "io.h"
+#include "executor.h"
+#include "sector.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#define OUTPUT_FALLOCATE 1
+#define FILE_SPLICE 1
+#define FILE_FADVISE 1
+#define FILE_SYNC_RANGE 1
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define FILE_COPY_RANGE 1
+#endif
+#endif
+
+#if defined(_POSIX_VERSION)
+#include <sys/mman.h>
+#define INPUT_MMAP 1
+// Needs fsync() and ftruncate()
+#define CHECKPOINTS 1
+#endif
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#include <fcntl.h>
+#define ASYNC 1
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#define ASYNC_EVENTFD 1
+#endif
+#endif
 
-////////////////////////////////////////////////////////////////////////////////
 //
-// Sector types
-//
-// Mode 1
-// -----------------------------------------------------
-//        0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
-// 0000h 00 FF FF FF FF FF FF FF FF FF FF 00 [-ADDR-] 01
-// 0010h [---DATA...
-// ...
-// 0800h                                     ...DATA---]
-// 0810h [---EDC---] 00 00 00 00 00 00 00 00 [---ECC...
-// ...
-// 0920h                                      ...ECC---]
-// -----------------------------------------------------
-//
-// Mode 2 (XA), form 1
-// -----------------------------------------------------
-//        0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
-// 0000h 00 FF FF FF FF FF FF FF FF FF FF 00 [-ADDR-] 02
-// 0010h [--FLAGS--] [--FLAGS--] [---DATA...
-// ...
-// 0810h             ...DATA---] [---EDC---] [---ECC...
-// ...
-// 0920h                                      ...ECC---]
-// -----------------------------------------------------
-//
-// Mode 2 (XA), form 2
-// -----------------------------------------------------
-//        0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
-// 0000h 00 FF FF FF FF FF FF FF FF FF FF 00 [-ADDR-] 02
-// 0010h [--FLAGS--] [--FLAGS--] [---DATA...
-// ...
-// 0920h                         ...DATA---] [---EDC---]
-// -----------------------------------------------------
-//
-// ADDR:  Sector address, encoded as minutes:seconds:frames in BCD
-// FLAGS: Used in Mode 2 (XA) sectors describing the type of sector; repeated
-//        twice for redundancy
-// DATA:  Area of the sector which contains the actual data itself
-// EDC:   Error Detection Code
-// ECC:   Error Correction Code
+// Literal runs at least this long are copied in bulk, without going through
+// sector_buffer
 //
+#define BULK_COPY_MIN 0x10000
 
 ////////////////////////////////////////////////////////////////////////////////
+//
+// In the extended format, the sector type is in the low 4 bits of the record
+// type, while the high bits tell where the payload of the sectors comes from
+//
+#define SECTOR_TYPE(type) ((type) & 0x0F)
+#define PAYLOAD_MASK      0x70
+#define PAYLOAD_STORED    0x00 // after the record header, as in the original format
+#define PAYLOAD_CONSTANT  0x10 // a single byte after the record header, repeated
+#define PAYLOAD_REFERENCE 0x20 // copied from the sectors at an earlier offset of
+                               // the original file, stored after the record header
+#define PAYLOAD_DICTIONARY 0x30 // copied from consecutive payloads of a dictionary,
+                               // whose offset is stored after the record header
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// LUTs used for computing ECC/EDC
+// Sector types whose records store only the address of the first sector; the
+// following sectors are expected to have consecutive addresses
 //
-static uint8_t  ecc_f_lut[256];
-static uint8_t  ecc_b_lut[256];
-static uint32_t edc_lut  [256];
-
-static void eccedc_init(void) {
-    size_t i;
-    for(i = 0; i < 256; i++) {
-        uint32_t edc = i;
-        size_t j = (i << 1) ^ (i & 0x80 ? 0x11D : 0);
-        ecc_f_lut[i] = j;
-        ecc_b_lut[i ^ j] = i;
-        for(j = 0; j < 8; j++) {
-            edc = (edc >> 1) ^ (edc & 1 ? 0xD8018001 : 0);
-        }
-        edc_lut[i] = edc;
-    }
+static int8_t type_has_address(int8_t type) {
+    type = SECTOR_TYPE(type);
+    return type == 4 || type == 5 || type == 6;
 }
 
-////////////////////////////////////////////////////////////////////////////////
 //
-// Compute EDC for a block
+// Addresses are handled as 0xMMSSFF, with each field in BCD
 //
-static uint32_t edc_compute(
-    uint32_t edc,
-    const uint8_t* src,
-    size_t size
-) {
-    for(; size; size--) {
-        edc = (edc >> 8) ^ edc_lut[(edc ^ (*src++)) & 0xFF];
-    }
-    return edc;
+static uint32_t get_address(const uint8_t* sector) {
+    return
+        (((uint32_t)(sector[0x00C])) << 16) |
+        (((uint32_t)(sector[0x00D])) <<  8) |
+        (((uint32_t)(sector[0x00E]))      );
 }
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Check ECC block (either P or Q)
-// Returns true if the ECC data is an exact match
-//
-static int8_t ecc_checkpq(
-    const uint8_t* address,
-    const uint8_t* data,
-    size_t major_count,
-    size_t minor_count,
-    size_t major_mult,
-    size_t minor_inc,
-    const uint8_t* ecc
-) {
-    size_t size = major_count * minor_count;
-    size_t major;
-    for(major = 0; major < major_count; major++) {
-        size_t index = (major >> 1) * major_mult + (major & 1);
-        uint8_t ecc_a = 0;
-        uint8_t ecc_b = 0;
-        size_t minor;
-        for(minor = 0; minor < minor_count; minor++) {
-            uint8_t temp;
-            if(index < 4) {
-                temp = address[index];
-            } else {
-                temp = data[index - 4];
-            }
-            index += minor_inc;
-            if(index >= size) { index -= size; }
-            ecc_a ^= temp;
-            ecc_b ^= temp;
-            ecc_a = ecc_f_lut[ecc_a];
-        }
-        ecc_a = ecc_b_lut[ecc_f_lut[ecc_a] ^ ecc_b];
-        if(
-            ecc[major              ] != (ecc_a        ) ||
-            ecc[major + major_count] != (ecc_a ^ ecc_b)
-        ) {
-            return 0;
-        }
-    }
-    return 1;
+static void put_address(uint8_t* sector, uint32_t address) {
+    sector[0x00C] = (uint8_t)(address >> 16);
+    sector[0x00D] = (uint8_t)(address >>  8);
+    sector[0x00E] = (uint8_t)(address      );
 }
 
 //
-// Write ECC block (either P or Q)
+// Increment a BCD field, returns nonzero when it wraps around
 //
-static void ecc_writepq(
-    const uint8_t* address,
-    const uint8_t* data,
-    size_t major_count,
-    size_t minor_count,
-    size_t major_mult,
-    size_t minor_inc,
-    uint8_t* ecc
-) {
-    size_t size = major_count * minor_count;
-    size_t major;
-    for(major = 0; major < major_count; major++) {
-        size_t index = (major >> 1) * major_mult + (major & 1);
-        uint8_t ecc_a = 0;
-        uint8_t ecc_b = 0;
-        size_t minor;
-        for(minor = 0; minor < minor_count; minor++) {
-            uint8_t temp;
-            if(index < 4) {
-                temp = address[index];
-            } else {
-                temp = data[index - 4];
-            }
-            index += minor_inc;
-            if(index >= size) { index -= size; }
-            ecc_a ^= temp;
-            ecc_b ^= temp;
-            ecc_a = ecc_f_lut[ecc_a];
-        }
-        ecc_a = ecc_b_lut[ecc_f_lut[ecc_a] ^ ecc_b];
-        ecc[major              ] = (ecc_a        );
-        ecc[major + major_count] = (ecc_a ^ ecc_b);
+static int8_t bcd_increment(uint8_t* field, uint8_t limit) {
+    if((*field & 0x0F) < 9) {
+        (*field)++;
+    } else {
+        *field = (*field & 0xF0) + 0x10;
+    }
+    if(*field >= limit) {
+        *field = 0;
+        return 1;
     }
+    return 0;
 }
 
 //
-// Check ECC P and Q codes for a sector
-// Returns true if the ECC data is an exact match
+// Address of the sector following the given one
 //
-static int8_t ecc_checksector(
-    const uint8_t *address,
-    const uint8_t *data,
-    const uint8_t *ecc
-) {
+// Encoder and decoder only have to agree on this, so it doesn't matter what it
+// does with addresses that are not valid BCD
+//
+static uint32_t next_address(uint32_t address) {
+    uint8_t minutes = (uint8_t)(address >> 16);
+    uint8_t seconds = (uint8_t)(address >>  8);
+    uint8_t frames  = (uint8_t)(address      );
+    if(bcd_increment(&frames, 0x75)) {
+        if(bcd_increment(&seconds, 0x60)) {
+            bcd_increment(&minutes, 0xA0);
+        }
+    }
     return
-        ecc_checkpq(address, data, 86, 24,  2, 86, ecc) &&      // P
-        ecc_checkpq(address, data, 52, 43, 86, 88, ecc + 0xAC); // Q
+        (((uint32_t)minutes) << 16) |
+        (((uint32_t)seconds) <<  8) |
+        (((uint32_t)frames )      );
 }
 
+////////////////////////////////////////////////////////////////////////////////
 //
-// Write ECC P and Q codes for a sector
+// Part of the sector that is stored for each sector type (extended format only)
 //
-static void ecc_writesector(
-    const uint8_t *address,
-    const uint8_t *data,
-    uint8_t *ecc
-) {
-    ecc_writepq(address, data, 86, 24,  2, 86, ecc);        // P
-    ecc_writepq(address, data, 52, 43, 86, 88, ecc + 0xAC); // Q
-}
-
-////////////////////////////////////////////////////////////////////////////////
+static const size_t payload_offset[7] = {
+    0,
+    0,     // not used by the extended format
+    0x004,
+    0x004,
+    0x014,
+    0x014,
+    0x010
+};
 
-static const uint8_t zeroaddress[4] = {0, 0, 0, 0};
+static const size_t payload_size[7] = {
+    1,
+    0,     // not used by the extended format
+    0x804,
+    0x918,
+    0x804,
+    0x918,
+    0x800
+};
 
-////////////////////////////////////////////////////////////////////////////////
 //
-// Check if this is a sector we can compress
+// Minimum number of repeated literal bytes worth a record of their own
 //
-// Sector types:
-//   0: Literal bytes (not a sector)
-//   1: 2352 mode 1         predict sync, mode, reserved, edc, ecc
-//   2: 2336 mode 2 form 1  predict redundant flags, edc, ecc
-//   3: 2336 mode 2 form 2  predict redundant flags, edc
-//
-static int8_t detect_sector(const uint8_t* sector, size_t size_available) {
-    if(
-        size_available >= 2352 &&
-        sector[0x000] == 0x00 && // sync (12 bytes)
-        sector[0x001] == 0xFF &&
-        sector[0x002] == 0xFF &&
-        sector[0x003] == 0xFF &&
-        sector[0x004] == 0xFF &&
-        sector[0x005] == 0xFF &&
-        sector[0x006] == 0xFF &&
-        sector[0x007] == 0xFF &&
-        sector[0x008] == 0xFF &&
-        sector[0x009] == 0xFF &&
-        sector[0x00A] == 0xFF &&
-        sector[0x00B] == 0x00 &&
-        sector[0x00F] == 0x01 && // mode (1 byte)
-        sector[0x814] == 0x00 && // reserved (8 bytes)
-        sector[0x815] == 0x00 &&
-        sector[0x816] == 0x00 &&
-        sector[0x817] == 0x00 &&
-        sector[0x818] == 0x00 &&
-        sector[0x819] == 0x00 &&
-        sector[0x81A] == 0x00 &&
-        sector[0x81B] == 0x00
-    ) {
-        //
-        // Might be Mode 1
-        //
-        if(
-            ecc_checksector(
-                sector + 0xC,
-                sector + 0x10,
-                sector + 0x81C
-            ) &&
-            edc_compute(0, sector, 0x810) == get32lsb(sector + 0x810)
-        ) {
-            return 1; // Mode 1
-        }
-
-    } else if(
-        size_available >= 2336 &&
-        sector[0] == sector[4] && // flags (4 bytes)
-        sector[1] == sector[5] && //   versus redundant copy
-        sector[2] == sector[6] &&
-        sector[3] == sector[7]
-    ) {
-        //
-        // Might be Mode 2, Form 1 or 2
-        //
-        if(
-            ecc_checksector(
-                zeroaddress,
-                sector,
-                sector + 0x80C
-            ) &&
-            edc_compute(0, sector, 0x808) == get32lsb(sector + 0x808)
-        ) {
-            return 2; // Mode 2, Form 1
-        }
-        //
-        // Might be Mode 2, Form 2
-        //
-        if(
-            edc_compute(0, sector, 0x91C) == get32lsb(sector + 0x91C)
-        ) {
-            return 3; // Mode 2, Form 2
-        }
-    }
+#define MIN_CONSTANT_LITERALS 32
 
-    //
-    // Nothing
-    //
-    return 0;
+//
+// Returns true if all bytes of the block have the same value
+//
+static int8_t is_constant(const uint8_t* data, size_t size) {
+    return size > 0 && memcmp(data, data + 1, size - 1) == 0;
 }
 
-////////////////////////////////////////////////////////////////////////////////
 //
-// Reconstruct a sector based on type
+// Hash of a sector payload, it only needs to be good enough to avoid comparing
+// payloads that don't match
 //
-static void reconstruct_sector(
-    uint8_t* sector, // must point to a full 2352-byte sector
-    int8_t type
-) {
-    //
-    // Sync
-    //
-    sector[0x000] = 0x00;
-    sector[0x001] = 0xFF;
-    sector[0x002] = 0xFF;
-    sector[0x003] = 0xFF;
-    sector[0x004] = 0xFF;
-    sector[0x005] = 0xFF;
-    sector[0x006] = 0xFF;
-    sector[0x007] = 0xFF;
-    sector[0x008] = 0xFF;
-    sector[0x009] = 0xFF;
-    sector[0x00A] = 0xFF;
-    sector[0x00B] = 0x00;
-
-    switch(type) {
-    case 1:
-        //
-        // Mode
-        //
-        sector[0x00F] = 0x01;
-        //
-        // Reserved
-        //
-        sector[0x814] = 0x00;
-        sector[0x815] = 0x00;
-        sector[0x816] = 0x00;
-        sector[0x817] = 0x00;
-        sector[0x818] = 0x00;
-        sector[0x819] = 0x00;
-        sector[0x81A] = 0x00;
-        sector[0x81B] = 0x00;
-        break;
-    case 2:
-    case 3:
-        //
-        // Mode
-        //
-        sector[0x00F] = 0x02;
-        //
-        // Flags
-        //
-        sector[0x010] = sector[0x014];
-        sector[0x011] = sector[0x015];
-        sector[0x012] = sector[0x016];
-        sector[0x013] = sector[0x017];
-        break;
-    }
-
-    //
-    // Compute EDC
-    //
-    switch(type) {
-    case 1: put32lsb(sector+0x810, edc_compute(0, sector     , 0x810)); break;
-    case 2: put32lsb(sector+0x818, edc_compute(0, sector+0x10, 0x808)); break;
-    case 3: put32lsb(sector+0x92C, edc_compute(0, sector+0x10, 0x91C)); break;
+static uint64_t hash_payload(const uint8_t* data, size_t size, int8_t type) {
+    uint64_t hash = 0x9E3779B97F4A7C15ull * (uint64_t)(type + 1);
+    size_t i;
+    for(i = 0; i + 8 <= size; i += 8) {
+        hash ^= ((uint64_t)get32lsb(data + i)) | (((uint64_t)get32lsb(data + i + 4)) << 32);
+        hash *= 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 32;
     }
-
-    //
-    // Compute ECC
-    //
-    switch(type) {
-    case 1: ecc_writesector(sector+0xC , sector+0x10, sector+0x81C); break;
-    case 2: ecc_writesector(zeroaddress, sector+0x10, sector+0x81C); break;
+    for(; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001B3ull;
     }
-
-    //
-    // Done
-    //
+    return hash;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Encode a type/count combo
 //
+// The extended format stores the type in a byte of its own, as it doesn't fit
+// in the 2 bits the original format reserves for it
+//
 static FailureReason write_type_count(
     FILE *out,
+    int8_t extended,
     int8_t type,
     uint32_t count
 ) {
     count--;
-    if(fputc(((count >= 32) << 7) | ((count & 31) << 2) | type, out) == EOF) {
-        return ERROR_WRITING_OUTPUT_FILE;
+    if(extended) {
+        if(fputc(type, out) == EOF) {
+            return ERROR_WRITING_OUTPUT_FILE;
+        }
+        if(fputc(((count >= 128) << 7) | (count & 127), out) == EOF) {
+            return ERROR_WRITING_OUTPUT_FILE;
+        }
+        count >>= 7;
+    } else {
+        if(fputc(((count >= 32) << 7) | ((count & 31) << 2) | type, out) == EOF) {
+            return ERROR_WRITING_OUTPUT_FILE;
+        }
+        count >>= 5;
     }
-    count >>= 5;
     while(count) {
         if(fputc(((count >= 128) << 7) | (count & 127), out) == EOF) {
             return ERROR_WRITING_OUTPUT_FILE;
@@ -409,514 +238,2752 @@ static FailureReason write_type_count(
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+//
+// Table of recently seen sector payloads, indexed by their hash
+//
+typedef struct _DedupEntry {
+    uint64_t hash;
+    off_t offset;
+} DedupEntry;
 
-static uint8_t sector_buffer[2352];
+//
+// Which file a checkpoint was taken with. The input and the dictionary must
+// also not have been modified since
+//
+typedef struct _FileIdentity {
+    uint64_t device;
+    uint64_t inode;
+    int64_t size;
+    int64_t modified; // in nanoseconds
+} FileIdentity;
 
-static off_t mycounter_analyze = (off_t)-1;
-static off_t mycounter_encode  = (off_t)-1;
-static off_t mycounter_decode  = (off_t)-1;
-static off_t mycounter_total   = 0;
+//
+// Everything a checkpoint only holds for (see Checkpoints below): the files
+// and the options that change the output or the checksums
+//
+typedef struct _CheckpointSettings {
+    int8_t extended_format;
+    uint64_t dedup_table_entries;
+    FileIdentity input;
+    FileIdentity dictionary; // zeros without one
+    int track_count;
+    Track tracks[MAX_TRACKS];
+    int hashes;
+    int track_hashes;
+    int8_t sparse;
+    int8_t preallocate;
+    int64_t original_size;
+} CheckpointSettings;
 
-static void resetcounter(off_t total) {
-    mycounter_analyze = (off_t)-1;
-    mycounter_encode  = (off_t)-1;
-    mycounter_decode  = (off_t)-1;
-    mycounter_total   = total;
-}
+//
+// State of a conversion, from its preparation until it's done: everything the
+// encoder and the decoder keep between two calls. Each Progress has its own,
+// so conversions can run side by side, on different threads or interleaved on
+// the same one
+//
+struct _Conversion {
+    uint8_t sector_buffer[2352];
 
-static void refresh_progress_decode(Progress *progress) {
-    // Case stdin total size is unknown
-    if(mycounter_total < 0){
-        return;
-    }
+    int8_t decoding;
+    int8_t extended_format;
+    int max_step_in_bytes;
 
-    off_t d = (mycounter_decode  + 64) / 128;
-    off_t t = (mycounter_total   + 64) / 128;
-    if(!t) { t = 1; }
+    FILE* in;
+    FILE* out;
 
-    progress->encoding_or_decoding_percentage = (((off_t)100) * d) / t;
-}
+    //
+    // Whether they're streams of the caller's (stdin and stdout too), which
+    // have no name and aren't closed
+    //
+    int8_t caller_input;
+    int8_t caller_output;
 
-static void setcounter_analyze(off_t n) {
-    mycounter_analyze = n;
-}
+    off_t mycounter_total;
 
-static void setcounter_encode(off_t n) {
-    mycounter_encode = n;
-}
+    //
+    // Caller's memory the buffers are taken from (see workspace in the
+    // options), one after the other, starting with this structure. Each of
+    // them is rounded up to WORKSPACE_ALIGNMENT, as get_*_workspace_size()
+    // counts them
+    //
+    uint8_t* workspace;
+    size_t workspace_size;
+    size_t workspace_used;
 
-static void setcounter_decode(off_t n) {
-    mycounter_decode = n;
-}
+    //
+    // Buffers of the stdio streams of the files, taken from the workspace when
+    // there's one. Those of the decoder's output are reused by each track
+    //
+    uint8_t* output_stdio_buffer;
+    uint8_t* output_reader_buffer;
+    void* output_writer_memory;
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Encode a run of sectors/literals of the same type
-//
-// Returns nonzero on error
-//
+    // Where the background tasks run, NULL for threads of their own
+    const Executor* executor;
 
-int write_sectors_step;
-int write_sectors_count;
+#ifdef ASYNC
+    //
+    // When run with start_async(): the task converting it, a copy of its
+    // progress for other threads, and the file descriptor signalled as it
+    // goes. async_started is only changed by the caller's thread, before the
+    // task starts and after it was waited for, and the state is kept until
+    // then. The rest is used with async_lock held
+    //
+    int8_t async_started;
+    Task async_task;
+    pthread_mutex_t async_lock;
+    int8_t async_cancelled;
+    Progress async_progress;
+    int async_fd[2]; // both ends are the same with eventfd
+#endif
 
-static FailureReason write_sectors(
-    int8_t type,
-    uint32_t count,
-    FILE* in,
-    FILE* out,
-    int max_step_in_bytes
-) {
-    int written_bytes = 0;
+    //
+    // With drop_cache, how far the input and output files were dropped from
+    // the page cache
+    //
+    int8_t drop_caches;
+    off_t input_dropped;
+    off_t output_dropped;
 
-    if(write_sectors_step == 1){
-        const FailureReason ret = write_type_count(out, type, count);
-        if( ret != SUCCESS) {
-            return ret;
-        }
+    //
+    // Timings and counters of the conversion, when asked for. Without them,
+    // all the stages cost is checking for NULL
+    //
+    Stats* stats;
 
-        write_sectors_step = 2;
-        write_sectors_count = count;
-    }
+    //
+    // Progress callback, and when it's due next (see progress_due())
+    //
+    ProgressCallback progress_callback;
+    void* progress_user_data;
+    off_t progress_interval_bytes;
+    uint64_t progress_interval_ns;
+    off_t progress_next;
+    off_t progress_reported;
+    uint64_t progress_reported_time;
 
-    if(write_sectors_step == 2){
-        if(type == 0) {
-            while(write_sectors_count) {
-                uint32_t b = write_sectors_count;
-                if(b > sizeof(sector_buffer)) { b = sizeof(sector_buffer); }
-                if(fread(sector_buffer, 1, b, in) != b) { return ERROR_READING_INPUT_FILE; }
-                if(fwrite(sector_buffer, 1, b, out) != b) { return ERROR_WRITING_OUTPUT_FILE; }
-                write_sectors_count -= b;
-                written_bytes += b;
-                setcounter_encode(ftello(in));
+    //
+    // With encode_for() and decode_for(), when to stop (see deadline_passed())
+    //
+    int8_t deadline_set;
+    int8_t deadline_reached;
+    uint64_t deadline;
+    int deadline_countdown;
 
-                if(write_sectors_count && written_bytes >= max_step_in_bytes){
-                    return SUCCESS_PARTIAL;
-                }
-            }
-            return SUCCESS;
-        }
-        write_sectors_step = 3;
-    }
+    //
+    // Encoder: the queue of the input, the run of sectors being checked and
+    // the one being written out
+    //
+    uint8_t* queue;
+    size_t queue_size;
+    int8_t queue_in_workspace;
+    size_t queue_start_ofs;
+    size_t queue_bytes_available;
+
+    uint32_t input_edc;
+
+    int8_t   curtype;
+    uint32_t curtype_count;
+    off_t    curtype_in_start;
+    uint32_t curtype_address;
+    uint32_t curtype_next_address;
+    uint8_t  curtype_fill;
+    off_t    curtype_reference;
+
+    uint32_t literal_skip;
+
+    int8_t detecttype;
+    uint32_t detectcount;
+    uint32_t detectaddress;
+    uint8_t detectfill;
+    off_t detectreference;
+    off_t no_constant_before; // no run of constant literals starts before
+
+    off_t input_file_length;
+    off_t input_bytes_checked;
+    off_t input_bytes_queued;
+    off_t input_bytes_summed; // in the EDC and checksums of the input
+
+    off_t typetally[7];
+
+    int writing_sectors;
+    int write_sectors_step;
+    int write_sectors_count;
 
-    if(write_sectors_step == 3){
-        for(; write_sectors_count; write_sectors_count--) {
-            switch(type) {
-            case 1:
-                if(fread(sector_buffer, 1, 2352, in) != 2352) { return ERROR_READING_INPUT_FILE; }
-                if(fwrite(sector_buffer + 0x00C, 1, 0x003, out) != 0x003) { return ERROR_WRITING_OUTPUT_FILE; }
-                if(fwrite(sector_buffer + 0x010, 1, 0x800, out) != 0x800) { return ERROR_WRITING_OUTPUT_FILE; }
-                written_bytes += 0x003 + 0x800;
-                break;
-            case 2:
-                if(fread(sector_buffer, 1, 2336, in) != 2336) { return ERROR_READING_INPUT_FILE; }
-                if(fwrite(sector_buffer + 0x004, 1, 0x804, out) != 0x804) { return ERROR_WRITING_OUTPUT_FILE; }
-                written_bytes += 2336 + 0x804;
-                break;
-            case 3:
-                if(fread(sector_buffer, 1, 2336, in) != 2336) { return ERROR_READING_INPUT_FILE; }
-                if(fwrite(sector_buffer + 0x004, 1, 0x918, out) != 0x918) { return ERROR_WRITING_OUTPUT_FILE; }
-                written_bytes += 0x918;
-                break;
-            }
-            setcounter_encode(ftello(in));
+    //
+    // When the input is read in the background, the block being queued and
+    // how much of it is
+    //
+    BlockReader* input_reader;
+    const uint8_t* input_block;
+    size_t input_block_size;
+    size_t input_block_used;
+
+    DedupEntry* dedup_table;
+    size_t dedup_mask;
+
+    Dictionary* dictionary;
 
-            if(written_bytes >= max_step_in_bytes){
-                write_sectors_count--;
-                return SUCCESS_PARTIAL;
-            }
-        }
-    }
     //
-    // Success
+    // Decoder: the record being written
     //
-    return SUCCESS;
-}
+    int decoding_state;
+    uint32_t output_edc;
+    int8_t type;
+    uint32_t num;
+    uint32_t output_address;
+    uint8_t output_fill;
+    off_t output_reference;
+    off_t output_flushed;
+    char* output_name;
+    FILE* output_reader;
+    int output_reader_track;
 
-static FILE *in;
-static FILE *out;
+    //
+    // Bytes of the image written so far when decoding, and how many there
+    // will be if known
+    //
+    off_t output_position;
+    off_t output_expected_size;
 
-static uint8_t* queue;
-static size_t queue_start_ofs;
-static size_t queue_bytes_available;
+    //
+    // Output options: reserve the space of the files up front, and leave runs
+    // of zeros as holes (output_zeros are the ones not written yet)
+    //
+    int8_t output_preallocate;
+    int8_t sparse_output;
+    off_t output_zeros;
 
-static uint32_t input_edc;
+    //
+    // When the output is written in the background, what writes it. Only
+    // used with files, stdout goes through stdio
+    //
+    IoOptions output_io;
+    BlockWriter* output_writer;
 
-static int8_t   curtype;
-static uint32_t curtype_count;
-static off_t    curtype_in_start;
+    //
+    // Track layout of the input file, with the offset where each track starts
+    //
+    Track track_table[MAX_TRACKS];
+    off_t track_offset[MAX_TRACKS];
+    int track_count;
+    int track_index;
+    int8_t track_body_type;
 
-static uint32_t literal_skip;
+    //
+    // When decoding with a track layout, where each track goes
+    //
+    char* const* track_file_names;
 
-static off_t input_file_length;
-static off_t input_bytes_checked;
-static off_t input_bytes_queued;
+    //
+    // Checksums of the image and of its tracks, the one of the track being
+    // hashed is in track_hash until it's done
+    //
+    HashState image_hash;
+    HashState track_hash;
+    int hash_track;
+    Hashes image_hashes;
+    Hashes track_hashes[MAX_TRACKS];
 
-static off_t typetally[4];
+    //
+    // Where the ECM data starts in the output (encoding) or input (decoding),
+    // nonzero for archive members
+    //
+    off_t output_start;
+    off_t input_start;
 
-static const size_t sectorsize[4] = {
-    1,
-    2352,
-    2336,
-    2336
+    //
+    // Checkpoints (see checkpoint_file in the options)
+    //
+    char* checkpoint_file;
+    off_t checkpoint_interval;
+    off_t checkpoint_next;
+    CheckpointSettings checkpoint_settings;
 };
 
-static uint32_t output_edc;
-static int8_t type;
-static uint32_t num;
+////////////////////////////////////////////////////////////////////////////////
 
-static size_t queue_size;
-static int8_t detecttype;
-static int max_step_in_bytes;
+//
+// With sparse output, runs of zeros are looked for by blocks of this size
+//
+#define SPARSE_BLOCK 4096
 
-int writing_sectors;
-int decoding_state;
+static size_t workspace_round(size_t size) {
+    return (size + WORKSPACE_ALIGNMENT - 1) / WORKSPACE_ALIGNMENT * WORKSPACE_ALIGNMENT;
+}
 
-const char * const failure_reason_names[] = { FAILURE_REASONS };
+//
+// Lookup tables of the EDC, ECC and CRC32, filled in once for all the
+// conversions, which may be prepared on several threads at once
+//
+static void init_tables(void) {
+    eccedc_init();
+    crc32_init();
+}
 
-////////////////////////////////////////////////////////////////////////////////
+#ifdef HAVE_PTHREADS
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+#endif
 
-static void reset_progress(Progress *progress){
-    memset(progress, 0, sizeof(Progress));
-    progress->state = IN_PROGRESS;
+//
+// State of a new conversion, at the start of the caller's workspace when
+// there's one (which has to be large enough for the buffers that follow)
+//
+static FailureReason new_conversion(Progress* progress, void* memory, size_t size, size_t needed) {
+    Conversion* c;
+#ifdef HAVE_PTHREADS
+    pthread_once(&tables_once, init_tables);
+#else
+    init_tables();
+#endif
+    if(memory != NULL && (size < needed || (uintptr_t)memory % WORKSPACE_ALIGNMENT != 0)) {
+        return INVALID_WORKSPACE;
+    }
+    c = (memory != NULL) ? memory : malloc(sizeof(Conversion));
+    if(c == NULL) {
+        return OUT_OF_MEMORY;
+    }
+    memset(c, 0, sizeof(Conversion));
+    if(memory != NULL) {
+        c->workspace = memory;
+        c->workspace_size = size;
+        c->workspace_used = workspace_round(sizeof(Conversion));
+    }
+    progress->conversion = c;
+    return SUCCESS;
+}
 
-    return;
+//
+// Next buffer of the workspace, NULL without one (the caller allocates it
+// then). It always fits, since the size was checked up front
+//
+static void* workspace_take(Conversion* c, size_t size) {
+    uint8_t* taken;
+    if(c->workspace == NULL || size == 0 || workspace_round(size) > c->workspace_size - c->workspace_used) {
+        return NULL;
+    }
+    taken = c->workspace + c->workspace_used;
+    c->workspace_used += workspace_round(size);
+    return taken;
 }
 
-static void fill_report_encoding(Progress *progress){
-    progress->literal_bytes = typetally[0];
-    progress->mode_1_sectors = typetally[1];
-    progress->mode_2_form_1_sectors = typetally[2];
-    progress->mode_2_form_2_sectors = typetally[3];
-    progress->bytes_before_processing = input_file_length;
-    progress->bytes_after_processing = ftello(out);
+//
+// Convert between streams of the caller's instead of opening files
+//
+static void use_streams(Conversion* c, FILE* input, FILE* output) {
+    c->in = input;
+    c->out = output;
+    c->caller_input = 1;
+    c->caller_output = 1;
 }
 
-static void fill_report_decoding(Progress *progress){
-    progress->bytes_before_processing = ftello(in);
-    progress->bytes_after_processing = ftello(out);
+//
+// Free a buffer unless it's in the workspace
+//
+static void release_memory(Conversion* c, void* memory) {
+    if(memory != NULL && (c->workspace == NULL || (uint8_t*)memory < c->workspace || (uint8_t*)memory >= c->workspace + c->workspace_size)) {
+        free(memory);
+    }
 }
 
-void refresh_progress_encode(Progress *progress){
-    off_t a = (mycounter_analyze + 64) / 128;
-    off_t e = (mycounter_encode  + 64) / 128;
-    off_t t = (mycounter_total   + 64) / 128;
-    if(!t) { t = 1; }
+static void release_conversion(Conversion* c);
+static void fail_conversion(Progress *progress, FailureReason reason);
 
-    progress->analyze_percentage = (unsigned)((((off_t)100) * a) / t);
-    progress->encoding_or_decoding_percentage = (unsigned)((((off_t)100) * e) / t);
+static size_t stdio_buffer_size(const IoOptions* io) {
+    return io->stdio_buffer_size > 0 ? (size_t)io->stdio_buffer_size : BUFSIZ;
 }
 
-////////////////////////////////////////////////////////////////////////////////
+//
+// With drop_cache, the files are dropped from the page cache by steps of this
+// size
+//
+#define DROP_CACHE_STEP 0x800000
 
-FailureReason prepare_decoding(char *input_file_name, char *output_file_name, int max_step_in_bytes_, Progress *progress){
-    reset_progress(progress);
+const char * const stage_names[] = {
+    "read", "detect", "scan", "edc", "hash", "reconstruct", "write"
+};
 
-    max_step_in_bytes = max_step_in_bytes_;
-    decoding_state = 1;
+static uint64_t now_nanoseconds(void) {
+#if defined(_POSIX_TIMERS) && _POSIX_TIMERS > 0
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec) * 1000000000u + (uint64_t)now.tv_nsec;
+#else
+    return ((uint64_t)clock()) * 1000000000u / CLOCKS_PER_SEC;
+#endif
+}
 
-    eccedc_init();
+static uint64_t stats_start(Conversion* c) {
+    return (c->stats != NULL) ? now_nanoseconds() : 0;
+}
 
-    output_edc = 0;
+static void stats_stop(Conversion* c, Stage stage, uint64_t started, uint64_t bytes) {
+    if(c->stats != NULL) {
+        c->stats->stages[stage].nanoseconds += now_nanoseconds() - started;
+        c->stats->stages[stage].bytes += bytes;
+        c->stats->stages[stage].calls++;
+    }
+}
 
-    //
-    // Open both files
-    //
-    if(strcmp(STDIN_MARKER, input_file_name) == 0){
-        in = stdin;
+static void stats_record(Conversion* c, int8_t record_type, uint32_t count) {
+    if(c->stats == NULL) {
+        return;
+    }
+    c->stats->records++;
+    switch(SECTOR_TYPE(record_type)) {
+    case 1: case 6: c->stats->mode_1_sectors        += count; break;
+    case 2: case 4: c->stats->mode_2_form_1_sectors += count; break;
+    case 3: case 5: c->stats->mode_2_form_2_sectors += count; break;
+    }
+}
 
+//
+// The progress is only worked out every so often: once the work done, which is
+// kept track of as the conversion goes, reaches progress_next, the interval
+// asked for is checked, and if it passed the percentages are updated and the
+// callback called
+//
+#define DEFAULT_PROGRESS_INTERVAL 0x100000
+#define PROGRESS_CLOCK_STEP 0x10000
+
+//
+// How far apart the interval is checked: at each interval if it's in bytes,
+// more often if the clock has to be looked at
+//
+static off_t progress_step(Conversion* c) {
+    if(
+        c->progress_interval_ns == 0 ||
+        (c->progress_interval_bytes > 0 && c->progress_interval_bytes < PROGRESS_CLOCK_STEP)
+    ) {
+        return c->progress_interval_bytes;
+    }
+    return PROGRESS_CLOCK_STEP;
+}
+
+static void set_progress_options(Conversion* c, ProgressCallback callback, void* user_data, int interval_bytes, int interval_ms) {
+    c->progress_callback = callback;
+    c->progress_user_data = user_data;
+    c->progress_interval_bytes = (interval_bytes > 0) ? interval_bytes : 0;
+    c->progress_interval_ns = (interval_ms > 0) ? ((uint64_t)interval_ms) * 1000000u : 0;
+    if(c->progress_interval_bytes == 0 && c->progress_interval_ns == 0) {
+        c->progress_interval_bytes = DEFAULT_PROGRESS_INTERVAL;
+    }
+    c->progress_reported = 0;
+    c->progress_reported_time = (c->progress_interval_ns > 0) ? now_nanoseconds() : 0;
+    c->progress_next = progress_step(c);
+}
+
+//
+// Check whether the progress is due now that done was reached
+//
+static int8_t progress_due(Conversion* c, off_t done) {
+    c->progress_next = done + progress_step(c);
+    if(c->progress_interval_bytes > 0 && done - c->progress_reported >= c->progress_interval_bytes) {
+        if(c->progress_interval_ns > 0) {
+            c->progress_reported_time = now_nanoseconds();
+        }
+    } else {
+        const uint64_t now = now_nanoseconds();
+        if(now - c->progress_reported_time < c->progress_interval_ns) {
+            return 0;
+        }
+        c->progress_reported_time = now;
+    }
+    c->progress_reported = done;
+    return 1;
+}
+
+//
+// For a conversion run with start_async(), make its progress available to
+// other threads and signal its file descriptor
+//
+static void publish_progress(Conversion* c, const Progress *progress) {
+#ifdef ASYNC
+#ifdef ASYNC_EVENTFD
+    const uint64_t one = 1;
+#else
+    const uint8_t one = 1;
+#endif
+    if(!c->async_started) {
+        return;
+    }
+    pthread_mutex_lock(&c->async_lock);
+    c->async_progress = *progress;
+    c->async_progress.conversion = NULL;
+    pthread_mutex_unlock(&c->async_lock);
+    if(write(c->async_fd[1], &one, sizeof(one)) != sizeof(one)) {
+        // Already signalled
+    }
+#else
+    (void)c;
+    (void)progress;
+#endif
+}
+
+static void report_progress(Conversion* c, Progress *progress) {
+    if(c->progress_callback != NULL) {
+        c->progress_callback(progress, c->progress_user_data);
+    }
+    publish_progress(c, progress);
+}
+
+//
+// With encode_for() and decode_for(), when to stop. The clock is only looked
+// at every DEADLINE_CHECK_STEP sectors (or positions looked at, or sectors
+// worth of literal bytes), and once the deadline passed it stays so until the
+// next call
+//
+#define DEADLINE_CHECK_STEP 64
+
+static int8_t deadline_passed(Conversion* c, int steps) {
+    if(!c->deadline_set || c->deadline_reached) {
+        return c->deadline_reached;
+    }
+    c->deadline_countdown -= steps;
+    if(c->deadline_countdown > 0) {
+        return 0;
+    }
+    c->deadline_countdown = DEADLINE_CHECK_STEP;
+    c->deadline_reached = now_nanoseconds() >= c->deadline;
+    return c->deadline_reached;
+}
+
+static void set_deadline(Conversion* c, int8_t set, uint64_t when) {
+    c->deadline_set = set;
+    c->deadline_reached = 0;
+    c->deadline = when;
+    c->deadline_countdown = DEADLINE_CHECK_STEP;
+}
+
+static FailureReason scan_from(FILE* f, EcmInfo* info);
+
+static void resetcounter(Conversion* c, off_t total) {
+    c->mycounter_total   = total;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Encode a run of sectors/literals of the same type
+//
+// Returns nonzero on error
+//
+
+//
+// Copy bytes from one file to the other, at their current positions, without
+// going through user space where the system can. Sets copied to how many were,
+// 0 if it can't be done (the caller copies them itself then). Returns zero on
+// error
+//
+static int8_t copy_range(FILE* from, FILE* to, size_t size, size_t* copied) {
+    *copied = 0;
+#if defined(FILE_COPY_RANGE) || defined(FILE_SPLICE)
+    off_t from_offset = ftello(from);
+    off_t to_offset;
+    ssize_t result = -1;
+    struct stat to_stat;
+
+    if(from_offset < 0 || fflush(to) != 0 || fstat(fileno(to), &to_stat) != 0) {
+        return 1;
+    }
+    to_offset = ftello(to);
+#ifdef FILE_COPY_RANGE
+    if(S_ISREG(to_stat.st_mode) && to_offset >= 0) {
+        result = copy_file_range(fileno(from), &from_offset, fileno(to), &to_offset, size, 0);
+    }
+#endif
+#ifdef FILE_SPLICE
+    if(S_ISFIFO(to_stat.st_mode)) {
+        result = splice(fileno(from), &from_offset, fileno(to), NULL, size, 0);
+    }
+#endif
+    if(result <= 0) {
+        return 1;
+    }
+    if(fseeko(from, from_offset, SEEK_SET) != 0) {
+        return 0;
+    }
+    if(S_ISREG(to_stat.st_mode) && fseeko(to, to_offset, SEEK_SET) != 0) {
+        return 0;
+    }
+    *copied = (size_t)result;
+#else
+    (void)from;
+    (void)to;
+    (void)size;
+#endif
+    return 1;
+}
+
+static FailureReason write_sectors(Conversion* c, 
+    int8_t extended,
+    int8_t type,
+    uint32_t count,
+    uint32_t address,
+    uint8_t fill,
+    off_t reference,
+    FILE* in,
+    FILE* out,
+    int max_step_in_bytes
+) {
+    int written_bytes = 0;
+
+    if(c->write_sectors_step == 1){
+        const FailureReason ret = write_type_count(out, extended, type, count);
+        if( ret != SUCCESS) {
+            return ret;
+        }
+
+        if(type_has_address(type)) {
+            put_address(c->sector_buffer, address);
+            if(fwrite(c->sector_buffer + 0x00C, 1, 0x003, out) != 0x003) { return ERROR_WRITING_OUTPUT_FILE; }
+        }
+
+        if((type & PAYLOAD_MASK) == PAYLOAD_CONSTANT) {
+            //
+            // Nothing else to write, the whole run is described by its fill byte
+            //
+            if(fputc(fill, out) == EOF) { return ERROR_WRITING_OUTPUT_FILE; }
+            return SUCCESS;
+        }
+
+        if((type & PAYLOAD_MASK) == PAYLOAD_REFERENCE || (type & PAYLOAD_MASK) == PAYLOAD_DICTIONARY) {
+            //
+            // Nor here, the decoder copies the payloads from its own output or
+            // from the dictionary
+            //
+            put64lsb(c->sector_buffer, reference);
+            if(fwrite(c->sector_buffer, 1, 8, out) != 8) { return ERROR_WRITING_OUTPUT_FILE; }
+            return SUCCESS;
+        }
+
+        c->write_sectors_step = 2;
+        c->write_sectors_count = count;
+    }
+
+    if(c->write_sectors_step == 2){
+        if(type == 0) {
+            while(c->write_sectors_count) {
+                uint32_t b = c->write_sectors_count;
+                size_t copied = 0;
+                if(b >= BULK_COPY_MIN) {
+                    if(b > (uint32_t)max_step_in_bytes) { b = max_step_in_bytes; }
+                    if(!copy_range(in, out, b, &copied)) { return ERROR_WRITING_OUTPUT_FILE; }
+                }
+                if(copied > 0) {
+                    b = (uint32_t)copied;
+                } else {
+                    if(b > sizeof(c->sector_buffer)) { b = sizeof(c->sector_buffer); }
+                    if(fread(c->sector_buffer, 1, b, in) != b) { return ERROR_READING_INPUT_FILE; }
+                    if(fwrite(c->sector_buffer, 1, b, out) != b) { return ERROR_WRITING_OUTPUT_FILE; }
+                }
+                c->write_sectors_count -= b;
+                written_bytes += b;
+
+                if(c->write_sectors_count && (deadline_passed(c, 1 + b / 2352) || written_bytes >= max_step_in_bytes)){
+                    return SUCCESS_PARTIAL;
+                }
+            }
+            return SUCCESS;
+        }
+        c->write_sectors_step = 3;
+    }
+
+    if(c->write_sectors_step == 3){
+        for(; c->write_sectors_count; c->write_sectors_count--) {
+            switch(type) {
+            case 1:
+                if(fread(c->sector_buffer, 1, 2352, in) != 2352) { return ERROR_READING_INPUT_FILE; }
+                if(fwrite(c->sector_buffer + 0x00C, 1, 0x003, out) != 0x003) { return ERROR_WRITING_OUTPUT_FILE; }
+                if(fwrite(c->sector_buffer + 0x010, 1, 0x800, out) != 0x800) { return ERROR_WRITING_OUTPUT_FILE; }
+                written_bytes += 0x003 + 0x800;
+                break;
+            case 2:
+                if(fread(c->sector_buffer, 1, 2336, in) != 2336) { return ERROR_READING_INPUT_FILE; }
+                if(fwrite(c->sector_buffer + 0x004, 1, 0x804, out) != 0x804) { return ERROR_WRITING_OUTPUT_FILE; }
+                written_bytes += 2336 + 0x804;
+                break;
+            case 3:
+                if(fread(c->sector_buffer, 1, 2336, in) != 2336) { return ERROR_READING_INPUT_FILE; }
+                if(fwrite(c->sector_buffer + 0x004, 1, 0x918, out) != 0x918) { return ERROR_WRITING_OUTPUT_FILE; }
+                written_bytes += 0x918;
+                break;
+            case 4:
+                if(fread(c->sector_buffer, 1, 2352, in) != 2352) { return ERROR_READING_INPUT_FILE; }
+                if(fwrite(c->sector_buffer + 0x014, 1, 0x804, out) != 0x804) { return ERROR_WRITING_OUTPUT_FILE; }
+                written_bytes += 0x804;
+                break;
+            case 5:
+                if(fread(c->sector_buffer, 1, 2352, in) != 2352) { return ERROR_READING_INPUT_FILE; }
+                if(fwrite(c->sector_buffer + 0x014, 1, 0x918, out) != 0x918) { return ERROR_WRITING_OUTPUT_FILE; }
+                written_bytes += 0x918;
+                break;
+            case 6:
+                if(fread(c->sector_buffer, 1, 2352, in) != 2352) { return ERROR_READING_INPUT_FILE; }
+                if(fwrite(c->sector_buffer + 0x010, 1, 0x800, out) != 0x800) { return ERROR_WRITING_OUTPUT_FILE; }
+                written_bytes += 0x800;
+                break;
+            }
+
+            if(deadline_passed(c, 1) || written_bytes >= max_step_in_bytes){
+                c->write_sectors_count--;
+                return SUCCESS_PARTIAL;
+            }
+        }
+    }
+    //
+    // Success
+    //
+    return SUCCESS;
+}
+
+static const size_t sectorsize[7] = {
+    1,
+    2352,
+    2336,
+    2336,
+    2352,
+    2352,
+    2352
+};
+
+//
+// Entries of the deduplication table, its size rounded down to a power of two
+// (0 without one)
+//
+static size_t dedup_table_entries(const EncodingOptions* options) {
+    size_t entries = 1;
+    if(options->dedup_table_size <= 0) {
+        return 0;
+    }
+    while(entries <= ((size_t)options->dedup_table_size) / 2) {
+        entries <<= 1;
+    }
+    return entries;
+}
+
+static size_t encoding_queue_size(const EncodingOptions* options) {
+    size_t size = ((size_t)(-1)) - 4095;
+    if((unsigned long)size > 0x40000lu) {
+        size = (size_t)0x40000lu;
+    }
+    // Larger blocks make larger reads
+    if(options->io.block_size > 0 && (size_t)options->io.block_size > size) {
+        size = (size_t)options->io.block_size;
+    }
+    return size;
+}
+
+//
+// Archive being written, and its members so far. Its members are encoded one
+// at a time, so there's only one for all the conversions. A member only goes
+// into the directory once it's complete. The queue of the last member is kept
+// for the next one
+//
+static FILE* archive;
+static ArchiveDirectory archive_directory;
+static int8_t archive_member_open;
+static uint8_t* archive_queue;
+static size_t archive_queue_size;
+
+static void release_queue(Conversion* c) {
+    if(c->queue != NULL && !c->queue_in_workspace) {
+        if(archive != NULL && c->out == archive && archive_queue == NULL) {
+            archive_queue = c->queue;
+            archive_queue_size = c->queue_size;
+        } else {
+            free(c->queue);
+        }
+    }
+    c->queue = NULL;
+}
+
+//
+// The queue left by the previous member of the archive, if it has the size
+// needed
+//
+static uint8_t* take_archive_queue(size_t size) {
+    uint8_t* queue = archive_queue;
+    archive_queue = NULL;
+    if(queue != NULL && archive_queue_size != size) {
+        free(queue);
+        queue = NULL;
+    }
+    return queue;
+}
+
+//
+// The member just encoded is complete: add it to the directory
+//
+static int8_t add_archive_member(Conversion* c) {
+    ArchiveMember* member;
+    off_t end;
+    if(archive == NULL || c->out != archive) {
+        return 1;
+    }
+    member = &archive_directory.members[archive_directory.member_count];
+    end = ftello(archive);
+    if(end < 0) {
+        return 0;
+    }
+    member->size = end - member->offset;
+    archive_directory.member_count++;
+    return 1;
+}
+
+const char * const failure_reason_names[] = { FAILURE_REASONS };
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void reset_progress(Progress *progress){
+    memset(progress, 0, sizeof(Progress));
+    progress->state = IN_PROGRESS;
+
+    return;
+}
+
+static void fill_report_hashes(Conversion* c, Progress *progress){
+    progress->hashes = c->image_hashes;
+    if(c->track_hash.flags) {
+        progress->track_count = c->track_count;
+        memcpy(progress->track_hashes, c->track_hashes, c->track_count * sizeof(Hashes));
+    }
+}
+
+static void fill_report_encoding(Conversion* c, Progress *progress){
+    progress->literal_bytes = c->typetally[0];
+    progress->mode_1_sectors = c->typetally[1] + c->typetally[6];
+    progress->mode_2_form_1_sectors = c->typetally[2] + c->typetally[4];
+    progress->mode_2_form_2_sectors = c->typetally[3] + c->typetally[5];
+    progress->bytes_before_processing = c->input_file_length;
+    progress->bytes_after_processing = ftello(c->out) - c->output_start;
+    fill_report_hashes(c, progress);
+}
+
+static void fill_report_decoding(Conversion* c, Progress *progress){
+    progress->bytes_before_processing = ftello(c->in) - c->input_start;
+    progress->bytes_after_processing = c->output_position;
+    fill_report_hashes(c, progress);
+}
+
+//
+// Check if the payload of the sector (or the literal bytes) at the current
+// position is a single repeated byte
+//
+static int8_t detect_constant(Conversion* c, const uint8_t* sector, size_t size_available, int8_t type) {
+    if(type == 0) {
+        //
+        // A single byte is enough to continue a run, but it takes a few more
+        // to start one
+        //
+        if(c->curtype == (0 | PAYLOAD_CONSTANT) && c->curtype_fill == sector[0]) {
+            return 1;
+        }
+        if(c->input_bytes_checked < c->no_constant_before || size_available < MIN_CONSTANT_LITERALS) {
+            return 0;
+        }
+        //
+        // A run starting anywhere up to the last byte of the window contains
+        // that byte, so none starts before the bytes equal to it: most of the
+        // time the next one to check is a whole window ahead
+        //
+        size_t start = MIN_CONSTANT_LITERALS - 1;
+        while(start > 0 && sector[start - 1] == sector[MIN_CONSTANT_LITERALS - 1]) {
+            start--;
+        }
+        c->no_constant_before = c->input_bytes_checked + start;
+        return start == 0;
+    }
+
+    return is_constant(sector + payload_offset[type], payload_size[type]);
+}
+
+//
+// Check if the payload of the sector at offset matches the given one
+//
+static int8_t payload_matches(Conversion* c, off_t offset, int8_t type, const uint8_t* payload) {
+    if(fseeko(c->in, offset + payload_offset[type], SEEK_SET) != 0) {
+        return 0;
+    }
+    if(fread(c->sector_buffer, 1, payload_size[type], c->in) != payload_size[type]) {
+        return 0;
+    }
+    return memcmp(c->sector_buffer, payload, payload_size[type]) == 0;
+}
+
+//
+// Check if the payload of the sector at the current position repeats an
+// earlier one
+//
+static int8_t detect_reference(Conversion* c, const uint8_t* sector, int8_t type) {
+    const uint8_t* payload = sector + payload_offset[type];
+    const uint64_t hash = hash_payload(payload, payload_size[type], type);
+    DedupEntry* entry = &c->dedup_table[hash & c->dedup_mask];
+    int8_t found = 0;
+
+    //
+    // Prefer continuing the current run, so it becomes a single record
+    //
+    if(c->curtype == (type | PAYLOAD_REFERENCE)) {
+        c->detectreference = c->curtype_reference + ((off_t)c->curtype_count) * sectorsize[type];
+        found = payload_matches(c, c->detectreference, type, payload);
+    }
+
+    if(!found && entry->offset >= 0 && entry->hash == hash) {
+        c->detectreference = entry->offset;
+        found = payload_matches(c, c->detectreference, type, payload);
+    }
+
+    entry->hash = hash;
+    entry->offset = c->input_bytes_checked;
+
+    return found;
+}
+
+//
+// Find the payload of the sector at the current position in the dictionary,
+// adding it if it's not there yet. Returns zero on error
+//
+static int8_t detect_dictionary(Conversion* c, const uint8_t* sector, int8_t type) {
+    const uint8_t* payload = sector + payload_offset[type];
+    // Payloads are shared between sector types
+    const uint64_t hash = hash_payload(payload, payload_size[type], 0);
+
+    c->detectreference = dictionary_find(c->dictionary, hash, payload, payload_size[type]);
+    if(c->detectreference < 0) {
+        c->detectreference = dictionary_add(c->dictionary, hash, payload, payload_size[type]);
+    }
+    return c->detectreference >= 0;
+}
+
+//
+// Distance between the payloads of consecutive sectors of a record whose
+// payloads are copied from elsewhere
+//
+static off_t reference_stride(int8_t type) {
+    if((type & PAYLOAD_MASK) == PAYLOAD_DICTIONARY) {
+        return payload_size[SECTOR_TYPE(type)];
+    }
+    return sectorsize[SECTOR_TYPE(type)];
+}
+
+//
+// Whether the mode 1 sector at the start of the data is followed by the one
+// with the next address, as far as can be told from its header. When it isn't
+// there yet, it's taken to be
+//
+static int8_t next_address_follows(const uint8_t* sector, size_t size_available) {
+    const uint8_t* next = sector + 2352;
+    if(size_available < 2352 + 0x10) {
+        return 1;
+    }
+    return
+        next[0x000] == 0x00 &&
+        next[0x001] == 0xFF &&
+        next[0x002] == 0xFF &&
+        next[0x003] == 0xFF &&
+        next[0x004] == 0xFF &&
+        next[0x005] == 0xFF &&
+        next[0x006] == 0xFF &&
+        next[0x007] == 0xFF &&
+        next[0x008] == 0xFF &&
+        next[0x009] == 0xFF &&
+        next[0x00A] == 0xFF &&
+        next[0x00B] == 0x00 &&
+        next[0x00F] == 0x01 &&
+        get_address(next) == next_address(get_address(sector));
+}
+
+//
+// A type 6 record only stores the address once, but a sector whose address
+// doesn't follow on either side would be a record of its own, one header more
+// than joining a run of type 1 (extended format only)
+//
+static void detect_lone_mode_1(Conversion* c, const uint8_t* sector, size_t size_available) {
+    if(
+        c->detecttype == 6 &&
+        !(c->curtype == 6 && c->detectaddress == c->curtype_next_address) &&
+        !next_address_follows(sector, size_available)
+    ) {
+        c->detecttype = 1;
+    }
+}
+
+//
+// Find out where the payload of the detected sector comes from (extended
+// format only)
+//
+static FailureReason detect_payload(Conversion* c, const uint8_t* sector, size_t size_available) {
+    if(type_has_address(c->detecttype)) {
+        c->detectaddress = get_address(sector);
+    }
+    if(detect_constant(c, sector, size_available, c->detecttype)) {
+        c->detectfill = sector[payload_offset[c->detecttype]];
+        c->detecttype |= PAYLOAD_CONSTANT;
+    } else if(c->dictionary != NULL && c->detecttype >= 2) {
+        if(!detect_dictionary(c, sector, c->detecttype)) {
+            return ERROR_IN_DICTIONARY;
+        }
+        c->detecttype |= PAYLOAD_DICTIONARY;
+    } else if(
+        c->dedup_table != NULL &&
+        c->detecttype >= 2 &&
+        detect_reference(c, sector, c->detecttype)
+    ) {
+        c->detecttype |= PAYLOAD_REFERENCE;
+    }
+    detect_lone_mode_1(c, sector, size_available);
+    return SUCCESS;
+}
+
+//
+// Whether there's anything to find out about the payload of what was detected.
+// Literal bytes where no run of constant ones can start, most of them on
+// audio, are just literal
+//
+static int8_t payload_unknown(Conversion* c) {
+    return
+        c->detecttype != 0 ||
+        c->curtype == (0 | PAYLOAD_CONSTANT) ||
+        c->input_bytes_checked >= c->no_constant_before;
+}
+
+//
+// Take as many literal bytes as possible at once, up to size. In the extended
+// format, runs of constant bytes are kept apart
+//
+static void detect_literals(Conversion* c, const uint8_t* data, size_t size) {
+    size_t count;
+    size_t run;
+
+    c->detecttype = 0;
+    if(c->extended_format) {
+        if(
+            (c->curtype == (0 | PAYLOAD_CONSTANT) && c->curtype_fill == data[0]) ||
+            (size >= MIN_CONSTANT_LITERALS && is_constant(data, MIN_CONSTANT_LITERALS))
+        ) {
+            for(count = 1; count < size && data[count] == data[0]; count++) {}
+            c->detecttype = 0 | PAYLOAD_CONSTANT;
+            c->detectfill = data[0];
+            c->detectcount = count;
+            return;
+        }
+        //
+        // Stop where the next run of constant bytes starts
+        //
+        for(count = 1, run = 1; count < size; count++) {
+            run = (data[count] == data[count - 1]) ? run + 1 : 1;
+            if(run == MIN_CONSTANT_LITERALS) {
+                size = count + 1 - MIN_CONSTANT_LITERALS;
+                break;
+            }
+        }
+    }
+    c->detectcount = size;
+}
+
+//
+// Detect what is at the current position using the track layout: sectors are
+// only looked for at the start of each sector of data tracks, and only of the
+// mode of the track. Anything else is literal
+//
+static void detect_track(Conversion* c, const uint8_t* data, size_t size_available) {
+    const Track* track;
+    off_t track_end;
+    size_t in_sector;
+    size_t size;
+
+    while(c->track_index + 1 < c->track_count && c->input_bytes_checked >= c->track_offset[c->track_index + 1]) {
+        c->track_index++;
+    }
+    track = &c->track_table[c->track_index];
+    track_end = (c->track_index + 1 < c->track_count) ? c->track_offset[c->track_index + 1] : c->input_file_length;
+    if(track_end >= 0 && (off_t)size_available > track_end - c->input_bytes_checked) {
+        size_available = (size_t)(track_end - c->input_bytes_checked);
+    }
+
+    if(
+        track->mode == TRACK_AUDIO ||
+        track->mode == TRACK_OTHER ||
+        (track->sector_size != 2352 && !(track->mode == TRACK_MODE2 && track->sector_size == 2336))
+    ) {
+        detect_literals(c, data, size_available);
+        return;
+    }
+
+    size = track->sector_size;
+    in_sector = (size_t)((c->input_bytes_checked - c->track_offset[c->track_index]) % size);
+
+    if(in_sector == 0 && size_available >= size) {
+        if(track->mode == TRACK_MODE1) {
+            if(detect_sector(data, size) == 1) {
+                c->detecttype = c->extended_format ? 6 : 1;
+                return;
+            }
+        } else if(size == 2336) {
+            c->detecttype = detect_sector(data, size);
+            if(c->detecttype == 2 || c->detecttype == 3) {
+                return;
+            }
+        } else if(c->extended_format) {
+            c->detecttype = detect_sector_extended(data, size);
+            if(c->detecttype == 4 || c->detecttype == 5) {
+                return;
+            }
+        } else if(
+            data[0x000] == 0x00 && // sync (12 bytes)
+            data[0x001] == 0xFF &&
+            data[0x002] == 0xFF &&
+            data[0x003] == 0xFF &&
+            data[0x004] == 0xFF &&
+            data[0x005] == 0xFF &&
+            data[0x006] == 0xFF &&
+            data[0x007] == 0xFF &&
+            data[0x008] == 0xFF &&
+            data[0x009] == 0xFF &&
+            data[0x00A] == 0xFF &&
+            data[0x00B] == 0x00 &&
+            data[0x00F] == 0x02    // mode (1 byte)
+        ) {
+            //
+            // The original format has no raw mode 2 sectors: the sync and
+            // header are literal, followed by the rest of the sector
+            //
+            c->track_body_type = detect_sector(data + 0x10, size - 0x10);
+            if(c->track_body_type == 2 || c->track_body_type == 3) {
+                c->detecttype = 0;
+                c->detectcount = 0x10;
+                return;
+            }
+        }
+        //
+        // Not a sector after all, its bytes are copied as they are
+        //
+        detect_literals(c, data, size);
+        return;
+    }
+
+    if(in_sector == 0x10 && (c->track_body_type == 2 || c->track_body_type == 3)) {
+        c->detecttype = c->track_body_type;
+        c->track_body_type = 0;
+        return;
+    }
+
+    //
+    // Somewhere in the middle of a sector, copy up to its end
+    //
+    if(size_available > size - in_sector) {
+        size_available = size - in_sector;
+    }
+    detect_literals(c, data, size_available);
+}
+
+//
+// Keep a copy of the track layout, along with where each track starts
+//
+static FailureReason set_track_layout(Conversion* c, const Track* tracks, int count) {
+    int i;
+
+    c->track_count = 0;
+    c->track_index = 0;
+    c->track_body_type = 0;
+    if(count <= 0) {
+        return SUCCESS;
+    }
+    if(tracks == NULL || count > MAX_TRACKS) {
+        return INVALID_CUE_SHEET;
+    }
+    for(i = 0; i < count; i++) {
+        const Track* track = &tracks[i];
+        if(track->lba < 0 || track->sector_size <= 0) {
+            return INVALID_CUE_SHEET;
+        }
+        if(i == 0) {
+            c->track_offset[i] = ((off_t)track->lba) * track->sector_size;
+        } else if(track->lba < c->track_table[i - 1].lba) {
+            return INVALID_CUE_SHEET;
+        } else {
+            c->track_offset[i] = c->track_offset[i - 1] +
+                ((off_t)(track->lba - c->track_table[i - 1].lba)) * c->track_table[i - 1].sector_size;
+        }
+        c->track_table[i] = *track;
+    }
+    c->track_count = count;
+
+    return SUCCESS;
+}
+
+//
+// Reserve the space of an output file, which keeps it in one piece. It's not
+// an error if that can't be done
+//
+static void preallocate_output(Conversion* c, FILE* f, off_t size) {
+#ifdef OUTPUT_FALLOCATE
+    if(c->output_preallocate && size > 0) {
+        if(fallocate(fileno(f), 0, 0, size) != 0) {
+            // Not supported here
+        }
+    }
+#else
+    (void)f;
+    (void)size;
+#endif
+}
+
+//
+// Open the image (or ECM file) being read, with the buffer size of the I/O
+// options. It's read from start to end, which lets the system read ahead more
+//
+static FILE* open_input(const char* name, const IoOptions* io, uint8_t* buffer) {
+    FILE* f = fopen(name, "rb");
+    if(f == NULL) {
+        return NULL;
+    }
+    if(buffer != NULL || io->stdio_buffer_size > 0) {
+        setvbuf(f, (char*)buffer, _IOFBF, stdio_buffer_size(io));
+    }
+#ifdef FILE_FADVISE
+    posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return f;
+}
+
+//
+// Create a file being written, with the buffer size of the I/O options
+//
+static FILE* open_output(const char* name, const IoOptions* io, uint8_t* buffer) {
+    FILE* f = fopen(name, "wb");
+    if(f != NULL && (buffer != NULL || io->stdio_buffer_size > 0)) {
+        setvbuf(f, (char*)buffer, _IOFBF, stdio_buffer_size(io));
+    }
+    return f;
+}
+
+//
+// Open a file written up to a checkpoint again, cut back to where the
+// checkpoint was taken (or extended, over a hole left at its end)
+//
+static FILE* reopen_output(const char* name, const IoOptions* io, uint8_t* buffer, off_t length) {
+#if defined(CHECKPOINTS)
+    FILE* f = fopen(name, "r+b");
+    if(f == NULL) {
+        return NULL;
+    }
+    if(buffer != NULL || io->stdio_buffer_size > 0) {
+        setvbuf(f, (char*)buffer, _IOFBF, stdio_buffer_size(io));
+    }
+    if(ftruncate(fileno(f), length) != 0 || fseeko(f, length, SEEK_SET) != 0) {
+        fclose(f);
+        return NULL;
+    }
+    return f;
+#else
+    (void)name;
+    (void)io;
+    (void)buffer;
+    (void)length;
+    return NULL;
+#endif
+}
+
+//
+// Drop what's before upto from the page cache, leaving the last step there
+// since it may still be used (all of it at the end). Written pages have to
+// reach the disk before, so their writeback is started a step in advance
+//
+static void drop_cache(Conversion* c, FILE* f, off_t* dropped, off_t upto, int8_t written, int8_t at_end) {
+#ifdef FILE_FADVISE
+    const off_t until = at_end ? upto : upto - DROP_CACHE_STEP;
+    if(!c->drop_caches || until <= *dropped || (!at_end && until - *dropped < DROP_CACHE_STEP)) {
+        return;
+    }
+#ifdef FILE_SYNC_RANGE
+    if(written) {
+        if(!at_end) {
+            sync_file_range(fileno(f), until, DROP_CACHE_STEP, SYNC_FILE_RANGE_WRITE);
+        }
+        sync_file_range(fileno(f), *dropped, until - *dropped, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+#endif
+    posix_fadvise(fileno(f), *dropped, until - *dropped, POSIX_FADV_DONTNEED);
+    *dropped = until;
+#else
+    (void)f;
+    (void)dropped;
+    (void)upto;
+    (void)written;
+    (void)at_end;
+#endif
+}
+
+//
+// Create the next file of the decoded image, which is written through the
+// I/O backend when there's one. When resuming, the file is opened again
+// instead, at the given length
+//
+static FILE* open_image_output(Conversion* c, const char* name, off_t size, off_t resumed_length) {
+    FILE* f;
+    if(resumed_length >= 0) {
+        f = reopen_output(name, &c->output_io, c->output_stdio_buffer, resumed_length);
+    } else {
+        f = open_output(name, &c->output_io, c->output_stdio_buffer);
+        if(f != NULL) { preallocate_output(c, f, size); }
+    }
+    if(f != NULL) {
+        c->output_writer = block_writer_open(fileno(f), resumed_length >= 0 ? resumed_length : 0, &c->output_io, c->executor, c->output_writer_memory);
+        c->output_dropped = 0;
+    }
+    return f;
+}
+
+//
+// Size of the file of a track, the last one ends where the image does
+//
+static off_t track_output_size(Conversion* c, int index) {
+    if(index + 1 < c->track_count) {
+        return c->track_offset[index + 1] - c->track_offset[index];
+    }
+    return (c->output_expected_size > 0) ? c->output_expected_size - c->track_offset[index] : 0;
+}
+
+static void start_hashes(Conversion* c, int flags, int track_flags) {
+    hash_start(&c->image_hash, flags);
+    hash_start(&c->track_hash, (c->track_count > 0) ? track_flags : 0);
+    c->hash_track = 0;
+    memset(&c->image_hashes, 0, sizeof(c->image_hashes));
+    memset(c->track_hashes, 0, sizeof(c->track_hashes));
+}
+
+//
+// Feed the next bytes of the image, found at the given position, to the
+// checksums. Anything before the first track counts as part of it
+//
+static void hash_image(Conversion* c, off_t position, const uint8_t* data, size_t size) {
+    const size_t total = size;
+    uint64_t started;
+
+    if(!c->image_hash.flags && !c->track_hash.flags) {
+        return;
+    }
+    started = stats_start(c);
+    if(c->image_hash.flags) {
+        hash_update(&c->image_hash, data, size);
+    }
+    while(c->track_hash.flags && size > 0) {
+        size_t chunk = size;
+        while(c->hash_track + 1 < c->track_count && position >= c->track_offset[c->hash_track + 1]) {
+            hash_finish(&c->track_hash, &c->track_hashes[c->hash_track]);
+            c->hash_track++;
+            hash_start(&c->track_hash, c->track_hash.flags);
+        }
+        if(c->hash_track + 1 < c->track_count && (off_t)chunk > c->track_offset[c->hash_track + 1] - position) {
+            chunk = (size_t)(c->track_offset[c->hash_track + 1] - position);
+        }
+        hash_update(&c->track_hash, data, chunk);
+        position += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    stats_stop(c, STAGE_HASH, started, total);
+}
+
+static void finish_hashes(Conversion* c) {
+    if(c->image_hash.flags) {
+        hash_finish(&c->image_hash, &c->image_hashes);
+    }
+    if(c->track_hash.flags) {
+        for(; c->hash_track < c->track_count; c->hash_track++) {
+            hash_finish(&c->track_hash, &c->track_hashes[c->hash_track]);
+            hash_start(&c->track_hash, c->track_hash.flags);
+        }
+    }
+}
+
+//
+// How much of the input was encoded so far
+//
+static off_t encoded_position(Conversion* c) {
+    if(!c->writing_sectors) {
+        return c->curtype_in_start;
+    }
+    return c->curtype_in_start + ((off_t)(c->curtype_count - c->write_sectors_count)) * sectorsize[SECTOR_TYPE(c->curtype)];
+}
+
+static void refresh_progress_encode(Conversion* c, Progress *progress){
+    off_t a = (c->input_bytes_queued + 64) / 128;
+    off_t e = (encoded_position(c) + 64) / 128;
+    off_t t = (c->mycounter_total   + 64) / 128;
+    if(!t) { t = 1; }
+
+    progress->analyze_percentage = (unsigned)((((off_t)100) * a) / t);
+    progress->encoding_or_decoding_percentage = (unsigned)((((off_t)100) * e) / t);
+}
+
+//
+// Goes by the bytes of the image checked, which counts each of them once
+//
+static void update_progress_encode(Conversion* c, Progress *progress) {
+    if(c->input_bytes_checked >= c->progress_next && progress_due(c, c->input_bytes_checked)) {
+        refresh_progress_encode(c, progress);
+        report_progress(c, progress);
+    }
+}
+
+static void refresh_progress_decode(Conversion* c, Progress *progress) {
+    // Case stdin total size is unknown, unless the size of the output is
+    if(c->mycounter_total < 0){
+        if(c->output_expected_size > 0) {
+            progress->encoding_or_decoding_percentage = (int)((((off_t)100) * c->output_position) / c->output_expected_size);
+        }
+        return;
+    }
+
+    off_t d = (ftello(c->in) - c->input_start + 64) / 128;
+    off_t t = (c->mycounter_total   + 64) / 128;
+    if(!t) { t = 1; }
+
+    progress->encoding_or_decoding_percentage = (((off_t)100) * d) / t;
+}
+
+static void update_progress_decode(Conversion* c, Progress *progress) {
+    if(c->output_position >= c->progress_next && progress_due(c, c->output_position)) {
+        refresh_progress_decode(c, progress);
+        report_progress(c, progress);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Checkpoints (see checkpoint_file in the options)
+//
+// Taken between two sectors, where the state to go on from is small: the
+// decoder's record being written, or the encoder's run of sectors being
+// checked, which isn't written yet and is read again from the input when it
+// is. A checkpoint is only resumed from by a conversion with the same
+// settings, from the same unmodified input, to the same output file it was
+// taken in
+//
+
+#define DEFAULT_CHECKPOINT_INTERVAL 0x4000000
+
+//
+// Version of the layout of the checkpoint files, after their magic. Any other
+// means starting over
+//
+#define CHECKPOINT_VERSION 2
+
+typedef struct _CheckpointState {
+    int8_t decoding;
+    CheckpointSettings settings;
+    uint64_t output_device;  // the output file, or the file of the current track
+    uint64_t output_inode;
+    int64_t output_size;     // at least, what reached it before the checkpoint
+    off_t input_position;    // checked by the encoder, read by the decoder
+    off_t output_length;     // of the output, or of the file of the current track
+    uint32_t edc;            // of the input or the output up to there
+
+    // Encoder, the run of sectors being checked
+    int8_t curtype;
+    uint32_t curtype_count;
+    off_t curtype_in_start;
+    uint32_t curtype_address;
+    uint32_t curtype_next_address;
+    uint8_t curtype_fill;
+    off_t curtype_reference;
+    uint32_t literal_skip;
+    off_t typetally[7];
+
+    // Decoder, the record being written
+    int8_t decoding_state;
+    int8_t type;
+    uint32_t num;
+    uint32_t output_address;
+    uint8_t output_fill;
+    off_t output_reference;
+    off_t output_position;
+    off_t output_zeros;
+    int track_index;
+
+    HashState image_hash;
+    HashState track_hash;
+    int hash_track;
+    Hashes track_hashes[MAX_TRACKS];
+} CheckpointState;
+
+static void identify_file(const struct stat* status, FileIdentity* identity) {
+    identity->device = (uint64_t)status->st_dev;
+    identity->inode = (uint64_t)status->st_ino;
+    identity->size = (int64_t)status->st_size;
+#if defined(__linux__)
+    identity->modified = ((int64_t)status->st_mtim.tv_sec) * 1000000000 + status->st_mtim.tv_nsec;
+#else
+    identity->modified = ((int64_t)status->st_mtime) * 1000000000;
+#endif
+}
+
+//
+// Zeros without a file name
+//
+static int8_t identify_file_name(const char* name, FileIdentity* identity) {
+    struct stat status;
+
+    memset(identity, 0, sizeof(FileIdentity));
+    if(name == NULL) {
+        return 1;
+    }
+    if(stat(name, &status) != 0) {
+        return 0;
+    }
+    identify_file(&status, identity);
+    return 1;
+}
+
+static int8_t same_file(const FileIdentity* a, const FileIdentity* b) {
+    return
+        a->device == b->device &&
+        a->inode == b->inode &&
+        a->size == b->size &&
+        a->modified == b->modified;
+}
+
+//
+// The settings of either direction. Fails when a file can't be looked at,
+// which leaves the conversion without checkpoints
+//
+static int8_t start_checkpoint_settings(CheckpointSettings* settings, const char* input_file_name, const char* dictionary_file, const Track* tracks, int track_count_, int hashes, int track_hashes_) {
+    memset(settings, 0, sizeof(CheckpointSettings));
+    if(track_count_ > MAX_TRACKS || (track_count_ > 0 && tracks == NULL)) {
+        return 0;
+    }
+    if(track_count_ > 0) {
+        settings->track_count = track_count_;
+        memcpy(settings->tracks, tracks, track_count_ * sizeof(Track));
+    }
+    settings->hashes = hashes;
+    settings->track_hashes = (track_count_ > 0) ? track_hashes_ : 0;
+    return
+        identify_file_name(input_file_name, &settings->input) &&
+        identify_file_name(dictionary_file, &settings->dictionary);
+}
+
+static int8_t encoding_checkpoint_settings(const char* input_file_name, const EncodingOptions* options, CheckpointSettings* settings) {
+    if(!start_checkpoint_settings(settings, input_file_name, options->dictionary_file, options->tracks, options->track_count, options->hashes, options->track_hashes)) {
+        return 0;
+    }
+    settings->extended_format = (options->extended_format || options->dedup_table_size > 0 || options->dictionary_file != NULL) ? 1 : 0;
+    settings->dedup_table_entries = dedup_table_entries(options);
+    return 1;
+}
+
+static int8_t decoding_checkpoint_settings(const char* input_file_name, const DecodingOptions* options, CheckpointSettings* settings) {
+    if(!start_checkpoint_settings(settings, input_file_name, options->dictionary_file, options->tracks, options->track_count, options->hashes, options->track_hashes)) {
+        return 0;
+    }
+    settings->sparse = options->sparse ? 1 : 0;
+    settings->preallocate = options->preallocate ? 1 : 0;
+    settings->original_size = options->original_size;
+    return 1;
+}
+
+static int8_t same_checkpoint_settings(const CheckpointSettings* a, const CheckpointSettings* b) {
+    int i;
+
+    if(
+        a->extended_format != b->extended_format ||
+        a->dedup_table_entries != b->dedup_table_entries ||
+        !same_file(&a->input, &b->input) ||
+        !same_file(&a->dictionary, &b->dictionary) ||
+        a->track_count != b->track_count ||
+        a->hashes != b->hashes ||
+        a->track_hashes != b->track_hashes ||
+        a->sparse != b->sparse ||
+        a->preallocate != b->preallocate ||
+        a->original_size != b->original_size
+    ) {
+        return 0;
+    }
+    for(i = 0; i < a->track_count; i++) {
+        if(
+            a->tracks[i].file != b->tracks[i].file ||
+            a->tracks[i].lba != b->tracks[i].lba ||
+            a->tracks[i].mode != b->tracks[i].mode ||
+            a->tracks[i].sector_size != b->tracks[i].sector_size
+        ) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//
+// Whether the output to be opened again is the file the checkpoint was taken
+// in, rather than one made anew since (which may have been given the inode
+// of the removed one, but not what it had)
+//
+static int8_t checkpoint_output(const CheckpointState* state, const char* name) {
+    struct stat status;
+
+    return
+        name != NULL &&
+        stat(name, &status) == 0 &&
+        (uint64_t)status.st_dev == state->output_device &&
+        (uint64_t)status.st_ino == state->output_inode &&
+        (int64_t)status.st_size >= state->output_size;
+}
+
+//
+// Checkpoints are only taken where they can be resumed from: to a file of
+// our own, from a file whose settings are known
+//
+static void set_checkpoint_options(Conversion* c, char* file, int interval_bytes, int8_t resumable, off_t position) {
+#if defined(CHECKPOINTS)
+    c->checkpoint_file = resumable ? file : NULL;
+#else
+    (void)file;
+    (void)resumable;
+    c->checkpoint_file = NULL;
+#endif
+    c->checkpoint_interval = interval_bytes > 0 ? interval_bytes : DEFAULT_CHECKPOINT_INTERVAL;
+    c->checkpoint_next = position + c->checkpoint_interval;
+}
+
+static int8_t checkpoint_due(Conversion* c, off_t position) {
+    return c->checkpoint_file != NULL && position >= c->checkpoint_next;
+}
+
+//
+// The state both directions have, at the current position
+//
+static void start_checkpoint(Conversion* c, CheckpointState* state) {
+    memset(state, 0, sizeof(CheckpointState));
+    state->decoding = c->decoding;
+    state->settings = c->checkpoint_settings;
+    state->image_hash = c->image_hash;
+    state->track_hash = c->track_hash;
+    state->hash_track = c->hash_track;
+    memcpy(state->track_hashes, c->track_hashes, sizeof(c->track_hashes));
+}
+
+static void restore_checkpoint(Conversion* c, const CheckpointState* state) {
+    c->image_hash = state->image_hash;
+    c->track_hash = state->track_hash;
+    c->hash_track = state->hash_track;
+    memcpy(c->track_hashes, state->track_hashes, sizeof(c->track_hashes));
+}
+
+#if defined(CHECKPOINTS)
+
+//
+// A checkpoint file being written or read. Both go through the same
+// functions, so that they can't disagree on the layout: each field in turn,
+// least significant byte first
+//
+typedef struct _CheckpointFile {
+    FILE* f;
+    int8_t writing;
+    int8_t failed;
+} CheckpointFile;
+
+static void checkpoint_bytes(CheckpointFile* file, void* data, size_t size) {
+    if(file->failed) {
+        return;
+    }
+    if(file->writing) {
+        file->failed = fwrite(data, 1, size, file->f) != size;
+    } else {
+        file->failed = fread(data, 1, size, file->f) != size;
+    }
+}
+
+//
+// The value written, or the one read in its place
+//
+static uint64_t checkpoint_value(CheckpointFile* file, uint64_t value, size_t size) {
+    uint8_t bytes[8];
+
+    if(file->writing) {
+        put64lsb(bytes, value);
+    } else {
+        memset(bytes, 0, sizeof(bytes));
+    }
+    checkpoint_bytes(file, bytes, size);
+    return get64lsb(bytes);
+}
+
+static void checkpoint_u8(CheckpointFile* file, uint8_t* value) {
+    *value = (uint8_t)checkpoint_value(file, *value, 1);
+}
+
+static void checkpoint_i8(CheckpointFile* file, int8_t* value) {
+    *value = (int8_t)(uint8_t)checkpoint_value(file, (uint8_t)*value, 1);
+}
+
+static void checkpoint_u32(CheckpointFile* file, uint32_t* value) {
+    *value = (uint32_t)checkpoint_value(file, *value, 4);
+}
+
+static void checkpoint_int(CheckpointFile* file, int* value) {
+    *value = (int)(int32_t)(uint32_t)checkpoint_value(file, (uint32_t)*value, 4);
+}
+
+static void checkpoint_u64(CheckpointFile* file, uint64_t* value) {
+    *value = checkpoint_value(file, *value, 8);
+}
+
+static void checkpoint_i64(CheckpointFile* file, int64_t* value) {
+    *value = (int64_t)checkpoint_value(file, (uint64_t)*value, 8);
+}
+
+static void checkpoint_off(CheckpointFile* file, off_t* value) {
+    *value = (off_t)(int64_t)checkpoint_value(file, (uint64_t)(int64_t)*value, 8);
+}
+
+static void checkpoint_identity(CheckpointFile* file, FileIdentity* identity) {
+    checkpoint_u64(file, &identity->device);
+    checkpoint_u64(file, &identity->inode);
+    checkpoint_i64(file, &identity->size);
+    checkpoint_i64(file, &identity->modified);
+}
+
+static void checkpoint_hash_state(CheckpointFile* file, HashState* hash) {
+    int i;
+
+    checkpoint_int(file, &hash->flags);
+    checkpoint_u32(file, &hash->crc32);
+    for(i = 0; i < 4; i++) {
+        checkpoint_u32(file, &hash->md5.state[i]);
+    }
+    checkpoint_u64(file, &hash->md5.length);
+    checkpoint_bytes(file, hash->md5.buffer, sizeof(hash->md5.buffer));
+    for(i = 0; i < 5; i++) {
+        checkpoint_u32(file, &hash->sha1.state[i]);
+    }
+    checkpoint_u64(file, &hash->sha1.length);
+    checkpoint_bytes(file, hash->sha1.buffer, sizeof(hash->sha1.buffer));
+}
+
+static void checkpoint_settings(CheckpointFile* file, CheckpointSettings* settings) {
+    int i;
+
+    checkpoint_i8(file, &settings->extended_format);
+    checkpoint_u64(file, &settings->dedup_table_entries);
+    checkpoint_identity(file, &settings->input);
+    checkpoint_identity(file, &settings->dictionary);
+    checkpoint_int(file, &settings->hashes);
+    checkpoint_int(file, &settings->track_hashes);
+    checkpoint_i8(file, &settings->sparse);
+    checkpoint_i8(file, &settings->preallocate);
+    checkpoint_i64(file, &settings->original_size);
+    checkpoint_int(file, &settings->track_count);
+    if(settings->track_count < 0 || settings->track_count > MAX_TRACKS) {
+        file->failed = 1;
+        return;
+    }
+    for(i = 0; i < settings->track_count; i++) {
+        Track* track = &settings->tracks[i];
+        int mode = (int)track->mode;
+        checkpoint_int(file, &track->file);
+        checkpoint_int(file, &track->lba);
+        checkpoint_int(file, &mode);
+        checkpoint_int(file, &track->sector_size);
+        track->mode = (TrackMode)mode;
+    }
+}
+
+static void checkpoint_state(CheckpointFile* file, CheckpointState* state) {
+    uint8_t magic[4] = { 'E', 'C', 'M', 'K' };
+    uint8_t version = CHECKPOINT_VERSION;
+    int i;
+
+    checkpoint_bytes(file, magic, sizeof(magic));
+    checkpoint_u8(file, &version);
+    if(memcmp(magic, "ECMK", 4) != 0 || version != CHECKPOINT_VERSION) {
+        file->failed = 1;
+        return;
+    }
+    checkpoint_i8(file, &state->decoding);
+    checkpoint_settings(file, &state->settings);
+    checkpoint_u64(file, &state->output_device);
+    checkpoint_u64(file, &state->output_inode);
+    checkpoint_i64(file, &state->output_size);
+    checkpoint_off(file, &state->input_position);
+    checkpoint_off(file, &state->output_length);
+    checkpoint_u32(file, &state->edc);
+
+    checkpoint_i8(file, &state->curtype);
+    checkpoint_u32(file, &state->curtype_count);
+    checkpoint_off(file, &state->curtype_in_start);
+    checkpoint_u32(file, &state->curtype_address);
+    checkpoint_u32(file, &state->curtype_next_address);
+    checkpoint_u8(file, &state->curtype_fill);
+    checkpoint_off(file, &state->curtype_reference);
+    checkpoint_u32(file, &state->literal_skip);
+    for(i = 0; i < 7; i++) {
+        checkpoint_off(file, &state->typetally[i]);
+    }
+
+    checkpoint_i8(file, &state->decoding_state);
+    checkpoint_i8(file, &state->type);
+    checkpoint_u32(file, &state->num);
+    checkpoint_u32(file, &state->output_address);
+    checkpoint_u8(file, &state->output_fill);
+    checkpoint_off(file, &state->output_reference);
+    checkpoint_off(file, &state->output_position);
+    checkpoint_off(file, &state->output_zeros);
+    checkpoint_int(file, &state->track_index);
+
+    checkpoint_hash_state(file, &state->image_hash);
+    checkpoint_hash_state(file, &state->track_hash);
+    checkpoint_int(file, &state->hash_track);
+    if(state->hash_track < 0 || state->hash_track > state->settings.track_count) {
+        file->failed = 1;
+        return;
+    }
+    for(i = 0; i < state->settings.track_count; i++) {
+        checkpoint_u32(file, &state->track_hashes[i].crc32);
+        checkpoint_bytes(file, state->track_hashes[i].md5, sizeof(state->track_hashes[i].md5));
+        checkpoint_bytes(file, state->track_hashes[i].sha1, sizeof(state->track_hashes[i].sha1));
+    }
+}
+
+#endif
+
+//
+// Make what was written so far durable, then replace the checkpoint with a
+// new one, written aside first so that there's always a whole one. The output
+// it holds for is the file as it is then
+//
+static int8_t write_checkpoint(Conversion* c, CheckpointState* state) {
+#if defined(CHECKPOINTS)
+    char temporary[FILENAME_MAX];
+    CheckpointFile file;
+    struct stat status;
+    int8_t ok;
+
+    if(fflush(c->out) != 0 || fsync(fileno(c->out)) != 0 || fstat(fileno(c->out), &status) != 0) {
+        return 0;
+    }
+    state->output_device = (uint64_t)status.st_dev;
+    state->output_inode = (uint64_t)status.st_ino;
+    state->output_size = (int64_t)status.st_size;
+    if((size_t)snprintf(temporary, sizeof(temporary), "%s.tmp", c->checkpoint_file) >= sizeof(temporary)) {
+        return 0;
+    }
+    file.f = fopen(temporary, "wb");
+    if(file.f == NULL) {
+        return 0;
+    }
+    file.writing = 1;
+    file.failed = 0;
+    checkpoint_state(&file, state);
+    ok = !file.failed;
+    ok = fflush(file.f) == 0 && fsync(fileno(file.f)) == 0 && ok;
+    ok = fclose(file.f) == 0 && ok;
+    if(!ok || rename(temporary, c->checkpoint_file) != 0) {
+        remove(temporary);
+        return 0;
+    }
+    c->checkpoint_next += c->checkpoint_interval;
+    return 1;
+#else
+    (void)c;
+    (void)state;
+    return 0;
+#endif
+}
+
+//
+// Read a checkpoint of the given direction. Any other (or none) means starting
+// over, as does one taken with other settings
+//
+static int8_t read_checkpoint(const char* file_name, int8_t direction, CheckpointState* state) {
+#if defined(CHECKPOINTS)
+    CheckpointFile file;
+    int8_t ok;
+
+    if(file_name == NULL) {
+        return 0;
+    }
+    file.f = fopen(file_name, "rb");
+    if(file.f == NULL) {
+        return 0;
+    }
+    file.writing = 0;
+    file.failed = 0;
+    memset(state, 0, sizeof(CheckpointState));
+    checkpoint_state(&file, state);
+    // Nothing may follow
+    ok = !file.failed && fgetc(file.f) == EOF && !ferror(file.f);
+    fclose(file.f);
+    return ok && state->decoding == direction;
+#else
+    (void)file_name;
+    (void)direction;
+    (void)state;
+    return 0;
+#endif
+}
+
+//
+// Done with the checkpoints of a conversion that completed
+//
+static void remove_checkpoint(Conversion* c) {
+    if(c->checkpoint_file != NULL) {
+        remove(c->checkpoint_file);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void init_decoding_options(DecodingOptions *options){
+    memset(options, 0, sizeof(DecodingOptions));
+}
+
+//
+// The state of the conversion, the stdio buffers of the input, the output
+// and the reader of the output, and the writer of the I/O backend
+//
+size_t get_decoding_workspace_size(const DecodingOptions *options){
+    return
+        workspace_round(sizeof(Conversion)) +
+        3 * workspace_round(stdio_buffer_size(&options->io)) +
+        workspace_round(block_io_memory_size(&options->io));
+}
+
+FailureReason prepare_decoding(char *input_file_name, char *output_file_name, int max_step_in_bytes_, Progress *progress){
+    DecodingOptions options;
+    init_decoding_options(&options);
+
+    return prepare_decoding_with_options(input_file_name, output_file_name, max_step_in_bytes_, &options, progress);
+}
+
+//
+// Open the files of a new decoding and read the header
+//
+static FailureReason open_decoding(Conversion* c, char *input_file_name, const ArchiveMember *member, char *output_file_name, int max_step_in_bytes_, const DecodingOptions *options, const CheckpointState *resume){
+    FailureReason ret;
+
+    c->max_step_in_bytes = max_step_in_bytes_;
+    c->decoding = 1;
+    c->decoding_state = 1;
+
+    c->output_edc = 0;
+    c->output_flushed = 0;
+    c->output_position = 0;
+    c->output_expected_size = options->original_size;
+    c->output_name = output_file_name;
+    c->output_reader = NULL;
+
+    c->output_stdio_buffer = workspace_take(c, stdio_buffer_size(&options->io));
+    c->output_reader_buffer = workspace_take(c, stdio_buffer_size(&options->io));
+    c->output_writer_memory = workspace_take(c, block_io_memory_size(&options->io));
+
+    c->dictionary = NULL;
+    if(options->dictionary_file != NULL) {
+        c->dictionary = dictionary_open(options->dictionary_file, 0);
+        if(!c->dictionary) {
+            return ERROR_OPENING_DICTIONARY;
+        }
+    }
+
+    //
+    // Open both files
+    //
+    if(!c->caller_input && strcmp(STDIN_MARKER, input_file_name) == 0){
+        c->in = stdin;
+        c->caller_input = 1;
+    }
+    if(c->caller_input){
         // Unknown, statistics won't be updated
-        input_file_length = -1;
+        c->input_file_length = -1;
+    }else if(member != NULL){
+        c->in = open_input(input_file_name, &options->io, workspace_take(c, stdio_buffer_size(&options->io)));
+        if(!c->in){
+            return ERROR_OPENING_INPUT_FILE;
+        }
+
+        c->input_file_length = member->size;
+        if(fseeko(c->in, member->offset, SEEK_SET) != 0) {
+            return ERROR_READING_INPUT_FILE;
+        }
     }else{
-        in = fopen(input_file_name, "rb");
-        if(!in){
+        c->in = open_input(input_file_name, &options->io, workspace_take(c, stdio_buffer_size(&options->io)));
+        if(!c->in){
             return ERROR_OPENING_INPUT_FILE;
         }
 
         //
         // Get the length of the input file
         //
-        if(fseeko(in, 0, SEEK_END) != 0) {
+        if(fseeko(c->in, 0, SEEK_END) != 0) {
             return ERROR_READING_INPUT_FILE;
         }
-        input_file_length = ftello(in);
-        if(input_file_length < 0) {
+        c->input_file_length = ftello(c->in);
+        if(c->input_file_length < 0) {
             return ERROR_READING_INPUT_FILE;
         }
 
-        if(fseeko(in, 0, SEEK_SET) != 0) {
+        if(fseeko(c->in, 0, SEEK_SET) != 0) {
             return ERROR_READING_INPUT_FILE;
         }
     }
+    c->input_start = (member != NULL) ? member->offset : 0;
 
-    resetcounter(input_file_length);
+    resetcounter(c, c->input_file_length);
 
     //
     // Magic header
     //
     if(
-        (fgetc(in) != 'E') ||
-        (fgetc(in) != 'C') ||
-        (fgetc(in) != 'M') ||
-        (fgetc(in) != 0x00)
+        (fgetc(c->in) != 'E') ||
+        (fgetc(c->in) != 'C') ||
+        (fgetc(c->in) != 'M')
     ) {
         return INVALID_ECM_FILE;
     }
 
     //
-    // Open output file
+    // Format version: 0x00 for the original format, 0x01 for the extended one
+    //
+    switch(fgetc(c->in)) {
+    case 0x00: c->extended_format = 0; break;
+    case 0x01: c->extended_format = 1; break;
+    default: return INVALID_ECM_FILE;
+    }
+
+    //
+    // The size of the image is needed to reserve its space, find it out if
+    // it wasn't given
+    //
+    c->output_preallocate = options->preallocate ? 1 : 0;
+    c->output_io = options->io;
+    c->output_writer = NULL;
+    c->drop_caches = options->io.drop_cache ? 1 : 0;
+    c->input_dropped = c->input_start;
+    c->stats = options->stats;
+    c->executor = options->executor;
+    set_progress_options(c, options->progress_callback, options->progress_user_data, options->progress_interval_bytes, options->progress_interval_ms);
+    c->output_dropped = 0;
+    c->output_zeros = 0;
+    if(c->output_preallocate && c->output_expected_size <= 0 && !c->caller_input) {
+        EcmInfo info;
+        if(fseeko(c->in, c->input_start, SEEK_SET) != 0) {
+            return ERROR_READING_INPUT_FILE;
+        }
+        ret = scan_from(c->in, &info);
+        if(ret != SUCCESS) {
+            return ret;
+        }
+        if(fseeko(c->in, c->input_start + 4, SEEK_SET) != 0) {
+            return ERROR_READING_INPUT_FILE;
+        }
+        c->output_expected_size = info.original_size;
+    }
+
+    //
+    // Go on from where the checkpoint was taken
     //
-    if(strcmp(STDOUT_MARKER, output_file_name) == 0){
-        out = stdout;
+    if(resume != NULL && fseeko(c->in, resume->input_position, SEEK_SET) != 0) {
+        return ERROR_READING_INPUT_FILE;
+    }
+
+    //
+    // Open output file, or the file of the first track. Anything before the
+    // first track goes to it
+    //
+    ret = set_track_layout(c, options->tracks, options->track_count);
+    if(ret != SUCCESS) {
+        return ret;
+    }
+    c->track_file_names = options->track_file_names;
+    start_hashes(c, options->hashes, options->track_hashes);
+    if(c->caller_output){
+        // Can't be split into the files of the tracks
+        if(c->track_count > 0) {
+            return STDOUT_NOT_SUPPORTED;
+        }
+    }else if(c->track_count > 0){
+        if(c->track_file_names == NULL) {
+            return INVALID_CUE_SHEET;
+        }
+        c->track_offset[0] = 0;
+        if(resume != NULL) {
+            c->track_index = resume->track_index;
+        }
+        c->out = open_image_output(c, c->track_file_names[c->track_index], track_output_size(c, c->track_index), (resume != NULL) ? resume->output_length : -1);
+        if(!c->out) {
+            return ERROR_OPENING_OUTPUT_FILE;
+        }
+    }else if(strcmp(STDOUT_MARKER, output_file_name) == 0){
+        c->out = stdout;
+        c->caller_output = 1;
     }else{
-        out = fopen(output_file_name, "wb");
-        if(!out) {
+        c->out = open_image_output(c, output_file_name, c->output_expected_size, (resume != NULL) ? resume->output_length : -1);
+        if(!c->out) {
             return ERROR_OPENING_OUTPUT_FILE;
         }
     }
+    c->sparse_output = (options->sparse && !c->caller_output) ? 1 : 0;
+
+    if(resume != NULL) {
+        restore_checkpoint(c, resume);
+        c->output_edc = resume->edc;
+        c->decoding_state = resume->decoding_state;
+        c->type = resume->type;
+        c->num = resume->num;
+        c->output_address = resume->output_address;
+        c->output_fill = resume->output_fill;
+        c->output_reference = resume->output_reference;
+        c->output_position = resume->output_position;
+        c->output_zeros = resume->output_zeros;
+    }
+    set_checkpoint_options(c, options->checkpoint_file, options->checkpoint_interval_bytes,
+        member == NULL && !c->caller_input && !c->caller_output && decoding_checkpoint_settings(input_file_name, options, &c->checkpoint_settings),
+        c->output_position);
 
     return SUCCESS;
 }
 
-FailureReason prepare_encoding(char *input_file_name, char *output_file_name, int max_step_in_bytes_, Progress *progress){
+//
+// Prepare decoding either a whole ECM file or one member of an archive
+//
+static FailureReason prepare_decoding_from(char *input_file_name, const ArchiveMember *member, char *output_file_name, int max_step_in_bytes_, const DecodingOptions *options, Progress *progress, const CheckpointState *resume){
+    FailureReason ret;
+
     reset_progress(progress);
+    ret = new_conversion(progress, options->workspace, options->workspace_size, get_decoding_workspace_size(options));
+    if(ret == SUCCESS) {
+        ret = open_decoding(progress->conversion, input_file_name, member, output_file_name, max_step_in_bytes_, options, resume);
+    }
+    if(ret != SUCCESS) {
+        fail_conversion(progress, ret);
+    }
+    return ret;
+}
+
+FailureReason prepare_decoding_with_options(char *input_file_name, char *output_file_name, int max_step_in_bytes_, const DecodingOptions *options, Progress *progress){
+    return prepare_decoding_from(input_file_name, NULL, output_file_name, max_step_in_bytes_, options, progress, NULL);
+}
 
-    max_step_in_bytes = max_step_in_bytes_;
-    writing_sectors = 0;
+FailureReason prepare_decoding_with_streams(FILE *input, FILE *output, int max_step_in_bytes_, const DecodingOptions *options, Progress *progress){
+    FailureReason ret;
 
-    eccedc_init();
+    reset_progress(progress);
+    ret = new_conversion(progress, options->workspace, options->workspace_size, get_decoding_workspace_size(options));
+    if(ret == SUCCESS) {
+        use_streams(progress->conversion, input, output);
+        ret = open_decoding(progress->conversion, NULL, NULL, NULL, max_step_in_bytes_, options, NULL);
+    }
+    if(ret != SUCCESS) {
+        fail_conversion(progress, ret);
+    }
+    return ret;
+}
+
+FailureReason resume_decoding(char *input_file_name, char *output_file_name, int max_step_in_bytes_, const DecodingOptions *options, Progress *progress){
+    CheckpointSettings settings;
+    CheckpointState state;
+    if(
+        strcmp(STDIN_MARKER, input_file_name) != 0 &&
+        strcmp(STDOUT_MARKER, output_file_name) != 0 &&
+        decoding_checkpoint_settings(input_file_name, options, &settings) &&
+        read_checkpoint(options->checkpoint_file, 1, &state) &&
+        same_checkpoint_settings(&state.settings, &settings) &&
+        state.decoding_state >= 1 && state.decoding_state <= 3 &&
+        state.track_index >= 0 && state.track_index < ((options->track_count > 0) ? options->track_count : 1) &&
+        checkpoint_output(&state, (options->track_count > 0) ?
+            ((options->track_file_names != NULL) ? options->track_file_names[state.track_index] : NULL) :
+            output_file_name)
+    ) {
+        return prepare_decoding_from(input_file_name, NULL, output_file_name, max_step_in_bytes_, options, progress, &state);
+    }
+    return prepare_decoding_from(input_file_name, NULL, output_file_name, max_step_in_bytes_, options, progress, NULL);
+}
+
+void init_encoding_options(EncodingOptions *options){
+    memset(options, 0, sizeof(EncodingOptions));
+}
+
+//
+// The state of the conversion, the queue, the deduplication table, the stdio
+// buffers of the input and the output, and the reader of the I/O backend
+//
+size_t get_encoding_workspace_size(const EncodingOptions *options){
+    return
+        workspace_round(sizeof(Conversion)) +
+        workspace_round(encoding_queue_size(options)) +
+        workspace_round(dedup_table_entries(options) * sizeof(DedupEntry)) +
+        2 * workspace_round(stdio_buffer_size(&options->io)) +
+        workspace_round(block_io_memory_size(&options->io));
+}
+
+FailureReason prepare_encoding(char *input_file_name, char *output_file_name, int max_step_in_bytes_, Progress *progress){
+    EncodingOptions options;
+    init_encoding_options(&options);
 
-    queue = NULL;
-    queue_start_ofs = 0;
-    queue_bytes_available = 0;
+    return prepare_encoding_with_options(input_file_name, output_file_name, max_step_in_bytes_, &options, progress);
+}
+
+//
+// Open the files of a new encoding, either to a new file or, when output is
+// given, to where that stream is. The caller's streams are already set
+//
+static FailureReason open_encoding(Conversion* c, char *input_file_name, char *output_file_name, FILE *output, int max_step_in_bytes_, const EncodingOptions *options, const CheckpointState *resume){
+    FailureReason ret;
 
-    input_edc = 0;
+    c->max_step_in_bytes = max_step_in_bytes_;
+    c->decoding = 0;
+    c->writing_sectors = 0;
+    c->extended_format = (
+        options->extended_format ||
+        options->dedup_table_size > 0 ||
+        options->dictionary_file != NULL
+    ) ? 1 : 0;
+
+    c->queue_start_ofs = 0;
+    c->queue_bytes_available = 0;
+
+    c->input_edc = 0;
 
     //
     // Current sector type (run)
     //
-    curtype = -1; // not a valid type
-    curtype_count = 0;
-    curtype_in_start = 0;
+    c->curtype = -1; // not a valid type
+    c->curtype_count = 0;
+    c->curtype_in_start = 0;
+    c->curtype_address = 0;
+    c->curtype_next_address = 0;
+    c->curtype_fill = 0;
+    c->curtype_reference = 0;
 
-    literal_skip = 0;
+    c->literal_skip = 0;
+    c->no_constant_before = 0;
 
-    input_bytes_checked = 0;
-    input_bytes_queued  = 0;
+    c->input_bytes_checked = 0;
+    c->input_bytes_queued  = 0;
+    c->input_bytes_summed  = 0;
 
-    memset(typetally, 0, sizeof(typetally));
+    memset(c->typetally, 0, sizeof(c->typetally));
 
-    queue_size = ((size_t)(-1)) - 4095;
-    if((unsigned long)queue_size > 0x40000lu) {
-        queue_size = (size_t)0x40000lu;
-    }
+    c->queue_size = encoding_queue_size(options);
 
     //
-    // Allocate space for queue
+    // Allocate space for queue. Aligned to pages, the kernel copies them
+    // faster
     //
-    queue = malloc(queue_size);
-    if(!queue) {
+    c->queue = workspace_take(c, c->queue_size);
+    c->queue_in_workspace = c->queue != NULL;
+    if(!c->queue && output != NULL && output == archive) {
+        c->queue = take_archive_queue(c->queue_size);
+    }
+#if defined(_POSIX_VERSION)
+    if(!c->queue && posix_memalign((void**)&c->queue, 4096, c->queue_size) != 0) {
+        c->queue = NULL;
+    }
+#else
+    if(!c->queue) {
+        c->queue = malloc(c->queue_size);
+    }
+#endif
+    if(!c->queue) {
         return OUT_OF_MEMORY;
     }
 
+    //
+    // Allocate the deduplication table
+    //
+    c->dedup_table = NULL;
+    c->dedup_mask = dedup_table_entries(options);
+    if(c->dedup_mask > 0) {
+        size_t i;
+        c->dedup_table = workspace_take(c, c->dedup_mask * sizeof(DedupEntry));
+        if(!c->dedup_table) {
+            c->dedup_table = malloc(c->dedup_mask * sizeof(DedupEntry));
+        }
+        if(!c->dedup_table) {
+            return OUT_OF_MEMORY;
+        }
+        for(i = 0; i < c->dedup_mask; i++) {
+            c->dedup_table[i].offset = -1;
+        }
+        c->dedup_mask--;
+    }
+
+    c->dictionary = NULL;
+    if(options->dictionary_file != NULL) {
+        c->dictionary = dictionary_open(options->dictionary_file, 1);
+        if(!c->dictionary) {
+            return ERROR_OPENING_DICTIONARY;
+        }
+    }
+
+    ret = set_track_layout(c, options->tracks, options->track_count);
+    if(ret != SUCCESS) {
+        return ret;
+    }
+    start_hashes(c, options->hashes, options->track_hashes);
+
     //
     // Open both files
     //
-    if(strcmp(STDIN_MARKER, input_file_name) == 0){
-        return STDIN_NOT_SUPPORTED;
+    if(!c->caller_input) {
+        if(strcmp(STDIN_MARKER, input_file_name) == 0){
+            return STDIN_NOT_SUPPORTED;
+        }
+        c->in = open_input(input_file_name, &options->io, workspace_take(c, stdio_buffer_size(&options->io)));
+        if(!c->in) {
+            return ERROR_OPENING_INPUT_FILE;
+        }
+    }
+    c->drop_caches = options->io.drop_cache ? 1 : 0;
+    c->input_dropped = 0;
+    c->stats = options->stats;
+    c->executor = options->executor;
+    set_progress_options(c, options->progress_callback, options->progress_user_data, options->progress_interval_bytes, options->progress_interval_ms);
+
+    c->output_start = 0;
+    if(output == NULL && !c->caller_output && strcmp(STDOUT_MARKER, output_file_name) == 0){
+        c->out = stdout;
+        c->caller_output = 1;
+    }
+    if(output != NULL){
+        c->out = output;
+        c->output_start = ftello(c->out);
+        if(c->output_start < 0) {
+            return ERROR_WRITING_OUTPUT_FILE;
+        }
+    }
+    else if(!c->caller_output){
+        uint8_t* buffer = workspace_take(c, stdio_buffer_size(&options->io));
+        if(resume != NULL) {
+            c->out = reopen_output(output_file_name, &options->io, buffer, resume->output_length);
+        } else {
+            c->out = open_output(output_file_name, &options->io, buffer);
+        }
+        if(!c->out) {
+            return ERROR_OPENING_OUTPUT_FILE;
+        }
+    }
+    c->output_dropped = c->output_start;
+
+    //
+    // Get the length of the input file
+    //
+    if(fseeko(c->in, 0, SEEK_END) != 0) {
+        return ERROR_READING_INPUT_FILE;
+    }
+    c->input_file_length = ftello(c->in);
+    if(c->input_file_length < 0) {
+        return ERROR_READING_INPUT_FILE;
+    }
+
+    resetcounter(c, c->input_file_length);
+
+    //
+    // Go on from the run of sectors the checkpoint was taken in, which is read
+    // again
+    //
+    if(resume != NULL) {
+        restore_checkpoint(c, resume);
+        c->curtype = resume->curtype;
+        c->curtype_count = resume->curtype_count;
+        c->curtype_in_start = resume->curtype_in_start;
+        c->curtype_address = resume->curtype_address;
+        c->curtype_next_address = resume->curtype_next_address;
+        c->curtype_fill = resume->curtype_fill;
+        c->curtype_reference = resume->curtype_reference;
+        c->literal_skip = resume->literal_skip;
+        memcpy(c->typetally, resume->typetally, sizeof(c->typetally));
+        c->input_edc = resume->edc;
+        c->input_bytes_checked = resume->input_position;
+        c->input_bytes_queued = resume->input_position;
+        c->input_bytes_summed = resume->input_position;
+    }
+    set_checkpoint_options(c, options->checkpoint_file, options->checkpoint_interval_bytes,
+        output == NULL && !c->caller_input && !c->caller_output && c->dictionary == NULL && encoding_checkpoint_settings(input_file_name, options, &c->checkpoint_settings),
+        c->input_bytes_checked);
+
+    //
+    // The backends need a file descriptor, which the caller's streams may not
+    // have
+    //
+    c->input_reader = c->caller_input ? NULL : block_reader_open(fileno(c->in), c->input_bytes_queued, c->input_file_length - c->input_bytes_queued, &options->io, c->executor, workspace_take(c, block_io_memory_size(&options->io)));
+    c->input_block_size = 0;
+    c->input_block_used = 0;
+
+    if(resume != NULL) {
+        return SUCCESS;
+    }
+
+    //
+    // Magic identifier
+    //
+    if(fputc('E' , c->out) == EOF) { return ERROR_WRITING_OUTPUT_FILE; }
+    if(fputc('C' , c->out) == EOF) { return ERROR_WRITING_OUTPUT_FILE; }
+    if(fputc('M' , c->out) == EOF) { return ERROR_WRITING_OUTPUT_FILE; }
+    if(fputc(c->extended_format, c->out) == EOF) { return ERROR_WRITING_OUTPUT_FILE; }
+
+    return SUCCESS;
+}
+
+//
+// Prepare encoding either to a new file or, when output is given, to where
+// that stream is
+//
+static FailureReason prepare_encoding_to(char *input_file_name, char *output_file_name, FILE *output, int max_step_in_bytes_, const EncodingOptions *options, Progress *progress, const CheckpointState *resume){
+    FailureReason ret;
+
+    reset_progress(progress);
+    ret = new_conversion(progress, options->workspace, options->workspace_size, get_encoding_workspace_size(options));
+    if(ret == SUCCESS) {
+        ret = open_encoding(progress->conversion, input_file_name, output_file_name, output, max_step_in_bytes_, options, resume);
+    }
+    if(ret != SUCCESS) {
+        fail_conversion(progress, ret);
+    }
+    return ret;
+}
+
+FailureReason prepare_encoding_with_options(char *input_file_name, char *output_file_name, int max_step_in_bytes_, const EncodingOptions *options, Progress *progress){
+    return prepare_encoding_to(input_file_name, output_file_name, NULL, max_step_in_bytes_, options, progress, NULL);
+}
+
+FailureReason prepare_encoding_with_streams(FILE *input, FILE *output, int max_step_in_bytes_, const EncodingOptions *options, Progress *progress){
+    FailureReason ret;
+
+    reset_progress(progress);
+    ret = new_conversion(progress, options->workspace, options->workspace_size, get_encoding_workspace_size(options));
+    if(ret == SUCCESS) {
+        use_streams(progress->conversion, input, output);
+        ret = open_encoding(progress->conversion, NULL, NULL, NULL, max_step_in_bytes_, options, NULL);
     }
-    in = fopen(input_file_name, "rb");
-    if(!in) {
-        return ERROR_OPENING_INPUT_FILE;
+    if(ret != SUCCESS) {
+        fail_conversion(progress, ret);
     }
+    return ret;
+}
 
-    if(strcmp(STDOUT_MARKER, output_file_name) == 0){
-        out = stdout;
+FailureReason resume_encoding(char *input_file_name, char *output_file_name, int max_step_in_bytes_, const EncodingOptions *options, Progress *progress){
+    CheckpointSettings settings;
+    CheckpointState state;
+    if(
+        strcmp(STDOUT_MARKER, output_file_name) != 0 &&
+        encoding_checkpoint_settings(input_file_name, options, &settings) &&
+        read_checkpoint(options->checkpoint_file, 0, &state) &&
+        same_checkpoint_settings(&state.settings, &settings) &&
+        checkpoint_output(&state, output_file_name)
+    ) {
+        return prepare_encoding_to(input_file_name, output_file_name, NULL, max_step_in_bytes_, options, progress, &state);
     }
-    else{
-        out = fopen(output_file_name, "wb");
-        if(!out) {
-            return ERROR_OPENING_OUTPUT_FILE;
+    return prepare_encoding_to(input_file_name, output_file_name, NULL, max_step_in_bytes_, options, progress, NULL);
+}
+
+//
+// Copy the next bytes of the input out of the blocks read in the background
+//
+static int8_t read_input(Conversion* c, uint8_t* data, size_t size) {
+    while(size > 0) {
+        size_t n = c->input_block_size - c->input_block_used;
+        if(n == 0) {
+            c->input_block = block_reader_next(c->input_reader, &c->input_block_size);
+            c->input_block_used = 0;
+            if(c->input_block == NULL || c->input_block_size == 0) {
+                return 0;
+            }
+            continue;
         }
+        if(n > size) { n = size; }
+        memcpy(data, c->input_block + c->input_block_used, n);
+        c->input_block_used += n;
+        data += n;
+        size -= n;
     }
+    return 1;
+}
 
-    //
-    // Get the length of the input file
-    //
-    if(fseeko(in, 0, SEEK_END) != 0) {
-        return ERROR_READING_INPUT_FILE;
-    }
-    input_file_length = ftello(in);
-    if(input_file_length < 0) {
-        return ERROR_READING_INPUT_FILE;
+//
+// Account for looking for a sector at the current position, whether one was
+// found or not
+//
+static void stats_detected(Conversion* c, uint64_t started) {
+    if(SECTOR_TYPE(c->detecttype) > 0) {
+        stats_stop(c, STAGE_DETECT, started, sectorsize[SECTOR_TYPE(c->detecttype)] * c->detectcount);
+    } else {
+        stats_stop(c, STAGE_SCAN, started, c->detectcount);
     }
+}
 
-    resetcounter(input_file_length);
+//
+// Feed what was checked of the input since last time to its EDC and
+// checksums, while it's still at the start of the queue. Doing it here rather
+// than as the input is read means they're known between any two sectors,
+// for checkpoints
+//
+static void sum_input(Conversion* c) {
+    const size_t size = (size_t)(c->input_bytes_checked - c->input_bytes_summed);
+    const uint8_t* data = c->queue + c->queue_start_ofs - size;
+    uint64_t started;
 
-    //
-    // Magic identifier
-    //
-    if(fputc('E' , out) == EOF) { return ERROR_WRITING_OUTPUT_FILE; }
-    if(fputc('C' , out) == EOF) { return ERROR_WRITING_OUTPUT_FILE; }
-    if(fputc('M' , out) == EOF) { return ERROR_WRITING_OUTPUT_FILE; }
-    if(fputc(0x00, out) == EOF) { return ERROR_WRITING_OUTPUT_FILE; }
+    if(size == 0) {
+        return;
+    }
+    started = stats_start(c);
+    c->input_edc = edc_compute(c->input_edc, data, size);
+    stats_stop(c, STAGE_EDC, started, size);
+    hash_image(c, c->input_bytes_summed, data, size);
+    c->input_bytes_summed = c->input_bytes_checked;
+}
 
-    return SUCCESS;
+//
+// Between two sectors, the run being checked isn't written yet and will be
+// checked again from its start
+//
+static int8_t save_encoding_checkpoint(Conversion* c) {
+    CheckpointState state;
+
+    sum_input(c);
+    start_checkpoint(c, &state);
+    state.input_position = c->input_bytes_checked;
+    state.output_length = ftello(c->out);
+    state.edc = c->input_edc;
+    state.curtype = c->curtype;
+    state.curtype_count = c->curtype_count;
+    state.curtype_in_start = c->curtype_in_start;
+    state.curtype_address = c->curtype_address;
+    state.curtype_next_address = c->curtype_next_address;
+    state.curtype_fill = c->curtype_fill;
+    state.curtype_reference = c->curtype_reference;
+    state.literal_skip = c->literal_skip;
+    memcpy(state.typetally, c->typetally, sizeof(c->typetally));
+    return state.output_length >= 0 && write_checkpoint(c, &state);
 }
 
-void encode(Progress *progress){
+static void encode_next(Conversion* c, Progress *progress){
+    if(!c->writing_sectors && checkpoint_due(c, c->input_bytes_checked)) {
+        if(!save_encoding_checkpoint(c)) {
+            progress->state = FAILURE;
+            progress->failure_reason = ERROR_WRITING_OUTPUT_FILE;
+            return;
+        }
+    }
+
     //
     // Refill queue if necessary
     //
-    if(!writing_sectors){
+    if(!c->writing_sectors){
         if(
-            (queue_bytes_available < 2352) &&
-            (((off_t)queue_bytes_available) < (input_file_length - input_bytes_queued))
+            (c->queue_bytes_available < 2352) &&
+            (((off_t)c->queue_bytes_available) < (c->input_file_length - c->input_bytes_queued))
         ) {
             //
             // We need to read more data
             //
-            off_t willread = input_file_length - input_bytes_queued;
-            off_t maxread = queue_size - queue_bytes_available;
+            off_t willread = c->input_file_length - c->input_bytes_queued;
+            off_t maxread = c->queue_size - c->queue_bytes_available;
             if(willread > maxread) {
                 willread = maxread;
             }
-            if(willread > max_step_in_bytes){
-                willread = max_step_in_bytes;
+            if(willread > c->max_step_in_bytes){
+                willread = c->max_step_in_bytes;
             }
 
-            if(queue_start_ofs > 0) {
-                memmove(queue, queue + queue_start_ofs, queue_bytes_available);
-                queue_start_ofs = 0;
+            if(c->queue_start_ofs > 0) {
+                sum_input(c);
+                memmove(c->queue, c->queue + c->queue_start_ofs, c->queue_bytes_available);
+                c->queue_start_ofs = 0;
             }
             if(willread) {
-                setcounter_analyze(input_bytes_queued);
-
-                if(fseeko(in, input_bytes_queued, SEEK_SET) != 0) {
-                    progress->state = FAILURE;
-                    progress->failure_reason = ERROR_READING_INPUT_FILE;
-                    return;
+                uint64_t started = stats_start(c);
+
+                if(c->input_reader != NULL) {
+                    if(!read_input(c, c->queue + c->queue_bytes_available, (size_t)willread)) {
+                        progress->state = FAILURE;
+                        progress->failure_reason = ERROR_READING_INPUT_FILE;
+                        return;
+                    }
                 }
-                if(fread(queue + queue_bytes_available, 1, willread, in) != (size_t)willread) {
-                    progress->state = FAILURE;
-                    progress->failure_reason = ERROR_READING_INPUT_FILE;
-                    return;
+                else {
+                    if(fseeko(c->in, c->input_bytes_queued, SEEK_SET) != 0) {
+                        progress->state = FAILURE;
+                        progress->failure_reason = ERROR_READING_INPUT_FILE;
+                        return;
+                    }
+                    if(fread(c->queue + c->queue_bytes_available, 1, willread, c->in) != (size_t)willread) {
+                        progress->state = FAILURE;
+                        progress->failure_reason = ERROR_READING_INPUT_FILE;
+                        return;
+                    }
                 }
+                stats_stop(c, STAGE_READ, started, willread);
 
-                input_edc = edc_compute(
-                    input_edc,
-                    queue + queue_bytes_available,
-                    willread
-                );
-
-                input_bytes_queued    += willread;
-                queue_bytes_available += willread;
+                c->input_bytes_queued    += willread;
+                c->queue_bytes_available += willread;
             }
         }
 
-        if(queue_bytes_available == 0) {
+        const uint64_t detect_started = stats_start(c);
+        c->detectcount = 1;
+
+        if(c->queue_bytes_available == 0) {
             //
             // No data left to read -> quit
             //
-            detecttype = -1;
+            c->detecttype = -1;
 
-        } else if(literal_skip > 0) {
+        } else if(c->literal_skip > 0) {
             //
             // Skipping through literal bytes
             //
-            literal_skip--;
-            detecttype = 0;
+            c->literal_skip--;
+            c->detecttype = 0;
+
+        } else if(c->track_count > 0 && c->input_bytes_checked >= c->track_offset[0]) {
+            //
+            // The track layout tells what to look for
+            //
+            detect_track(c, c->queue + c->queue_start_ofs, c->queue_bytes_available);
+            if(c->extended_format && SECTOR_TYPE(c->detecttype) > 0) {
+                const FailureReason ret = detect_payload(c, c->queue + c->queue_start_ofs, c->queue_bytes_available);
+                if(ret != SUCCESS) {
+                    progress->state = FAILURE;
+                    progress->failure_reason = ret;
+                    return;
+                }
+            }
+            stats_detected(c, detect_started);
 
+        } else if(c->extended_format) {
+            //
+            // Raw mode 2 sectors are detected as a whole, no need for the
+            // heuristic below
+            //
+            c->detecttype = detect_sector_extended(c->queue + c->queue_start_ofs, c->queue_bytes_available);
+            const FailureReason ret = payload_unknown(c) ? detect_payload(c, c->queue + c->queue_start_ofs, c->queue_bytes_available) : SUCCESS;
+            if(ret != SUCCESS) {
+                progress->state = FAILURE;
+                progress->failure_reason = ret;
+                return;
+            }
+            stats_detected(c, detect_started);
         } else {
             //
             // Heuristic to skip past CD sync after a mode 2 sector
             //
             if(
-                curtype >= 2 &&
-                queue_bytes_available >= 0x10 &&
-                queue[queue_start_ofs + 0x0] == 0x00 &&
-                queue[queue_start_ofs + 0x1] == 0xFF &&
-                queue[queue_start_ofs + 0x2] == 0xFF &&
-                queue[queue_start_ofs + 0x3] == 0xFF &&
-                queue[queue_start_ofs + 0x4] == 0xFF &&
-                queue[queue_start_ofs + 0x5] == 0xFF &&
-                queue[queue_start_ofs + 0x6] == 0xFF &&
-                queue[queue_start_ofs + 0x7] == 0xFF &&
-                queue[queue_start_ofs + 0x8] == 0xFF &&
-                queue[queue_start_ofs + 0x9] == 0xFF &&
-                queue[queue_start_ofs + 0xA] == 0xFF &&
-                queue[queue_start_ofs + 0xB] == 0x00 &&
-                queue[queue_start_ofs + 0xF] == 0x02
+                c->curtype >= 2 &&
+                c->queue_bytes_available >= 0x10 &&
+                c->queue[c->queue_start_ofs + 0x0] == 0x00 &&
+                c->queue[c->queue_start_ofs + 0x1] == 0xFF &&
+                c->queue[c->queue_start_ofs + 0x2] == 0xFF &&
+                c->queue[c->queue_start_ofs + 0x3] == 0xFF &&
+                c->queue[c->queue_start_ofs + 0x4] == 0xFF &&
+                c->queue[c->queue_start_ofs + 0x5] == 0xFF &&
+                c->queue[c->queue_start_ofs + 0x6] == 0xFF &&
+                c->queue[c->queue_start_ofs + 0x7] == 0xFF &&
+                c->queue[c->queue_start_ofs + 0x8] == 0xFF &&
+                c->queue[c->queue_start_ofs + 0x9] == 0xFF &&
+                c->queue[c->queue_start_ofs + 0xA] == 0xFF &&
+                c->queue[c->queue_start_ofs + 0xB] == 0x00 &&
+                c->queue[c->queue_start_ofs + 0xF] == 0x02
             ) {
                 // Treat this byte as a literal...
-                detecttype = 0;
+                c->detecttype = 0;
                 // ...and skip the next 15
-                literal_skip = 15;
+                c->literal_skip = 15;
             } else {
                 //
                 // Detect the sector type at the current offset
                 //
-                detecttype = detect_sector(queue + queue_start_ofs, queue_bytes_available);
+                c->detecttype = detect_sector(c->queue + c->queue_start_ofs, c->queue_bytes_available);
             }
+            stats_detected(c, detect_started);
         }
     }
 
-    if( (!writing_sectors) &&
-        (detecttype == curtype) &&
-        (curtype_count <= 0x7FFFFFFF) // avoid overflow
+    if( (!c->writing_sectors) &&
+        (c->detecttype == c->curtype) &&
+        (!type_has_address(c->curtype) || c->detectaddress == c->curtype_next_address) &&
+        ((c->curtype & PAYLOAD_MASK) != PAYLOAD_CONSTANT || c->detectfill == c->curtype_fill) &&
+        ((c->curtype & PAYLOAD_MASK) < PAYLOAD_REFERENCE ||
+            c->detectreference == c->curtype_reference + ((off_t)c->curtype_count) * reference_stride(c->curtype)) &&
+        (c->curtype_count <= 0x80000000LU - c->detectcount) // avoid overflow
     ) {
         //
         // Same type as last sector
         //
-        curtype_count++;
+        c->curtype_count += c->detectcount;
 
     } else {
         //
         // Changing types: Flush the input
         //
-        if(curtype_count > 0 || writing_sectors) {
-            if(!writing_sectors){
-                if(fseeko(in, curtype_in_start, SEEK_SET) != 0) {
+        if(c->curtype_count > 0 || c->writing_sectors) {
+            if(!c->writing_sectors){
+                if(fseeko(c->in, c->curtype_in_start, SEEK_SET) != 0) {
                     progress->state = FAILURE;
                     progress->failure_reason = ERROR_READING_INPUT_FILE;
                     return;
                 }
-                typetally[curtype] += curtype_count;
+                c->typetally[SECTOR_TYPE(c->curtype)] += c->curtype_count;
+                stats_record(c, c->curtype, c->curtype_count);
 
-                write_sectors_step = 1;
-                writing_sectors = 1;
+                c->write_sectors_step = 1;
+                c->write_sectors_count = c->curtype_count;
+                c->writing_sectors = 1;
             }
 
-            if(writing_sectors){
-                FailureReason writeSectorsRet = write_sectors(
-                                curtype,
-                                curtype_count,
-                                in,
-                                out,
-                                max_step_in_bytes);
+            if(c->writing_sectors){
+                const off_t written = (c->stats != NULL) ? ftello(c->out) : 0;
+                const uint64_t started = stats_start(c);
+                FailureReason writeSectorsRet = write_sectors(c, 
+                                c->extended_format,
+                                c->curtype,
+                                c->curtype_count,
+                                c->curtype_address,
+                                c->curtype_fill,
+                                c->curtype_reference,
+                                c->in,
+                                c->out,
+                                c->max_step_in_bytes);
+                stats_stop(c, STAGE_WRITE, started, (c->stats != NULL) ? ftello(c->out) - written : 0);
 
                 if(writeSectorsRet == SUCCESS_PARTIAL){
-                    refresh_progress_encode(progress);
+                    update_progress_encode(c, progress);
                     return;
                 }
-                else if(writeSectorsRet == FAILURE) {
+                else if(writeSectorsRet != SUCCESS) {
                     progress->state = FAILURE;
                     progress->failure_reason = writeSectorsRet;
                     return;
                 }
 
-                writing_sectors = 0;
+                c->writing_sectors = 0;
+
+                //
+                // What was encoded already won't be read again, but in case
+                // of references
+                //
+                if(c->drop_caches) {
+                    drop_cache(c, c->in, &c->input_dropped, ftello(c->in), 0, 0);
+                    drop_cache(c, c->out, &c->output_dropped, ftello(c->out), 1, 0);
+                }
             }
         }
-        curtype = detecttype;
-        curtype_in_start = input_bytes_checked;
-        curtype_count = 1;
+        c->curtype = c->detecttype;
+        c->curtype_in_start = c->input_bytes_checked;
+        c->curtype_count = c->detectcount;
+        c->curtype_address = c->detectaddress;
+        c->curtype_fill = c->detectfill;
+        c->curtype_reference = c->detectreference;
     }
 
-    if(curtype >= 0) {
-        input_bytes_checked   += sectorsize[curtype];
-        queue_start_ofs       += sectorsize[curtype];
-        queue_bytes_available -= sectorsize[curtype];
-        refresh_progress_encode(progress);
+    if(c->curtype >= 0) {
+        if(type_has_address(c->curtype)) {
+            c->curtype_next_address = next_address(c->detectaddress);
+        }
+        c->input_bytes_checked   += sectorsize[SECTOR_TYPE(c->curtype)] * c->detectcount;
+        c->queue_start_ofs       += sectorsize[SECTOR_TYPE(c->curtype)] * c->detectcount;
+        c->queue_bytes_available -= sectorsize[SECTOR_TYPE(c->curtype)] * c->detectcount;
+        update_progress_encode(c, progress);
 
         //
         // Advance to the next sector
@@ -931,7 +2998,7 @@ void encode(Progress *progress){
     //
     // Store the end-of-records indicator
     //
-    const FailureReason writeTypeCountRet = write_type_count(out, 0, 0);
+    const FailureReason writeTypeCountRet = write_type_count(c->out, c->extended_format, 0, 0);
     if(writeTypeCountRet != SUCCESS) {
         progress->state = FAILURE;
         progress->failure_reason = writeTypeCountRet;
@@ -941,8 +3008,15 @@ void encode(Progress *progress){
     //
     // Store the EDC of the input file
     //
-    put32lsb(sector_buffer, input_edc);
-    if(fwrite(sector_buffer, 1, 4, out) != 4) {
+    sum_input(c);
+    put32lsb(c->sector_buffer, c->input_edc);
+    if(fwrite(c->sector_buffer, 1, 4, c->out) != 4) {
+        progress->state = FAILURE;
+        progress->failure_reason = ERROR_WRITING_OUTPUT_FILE;
+        return;
+    }
+
+    if(!add_archive_member(c)) {
         progress->state = FAILURE;
         progress->failure_reason = ERROR_WRITING_OUTPUT_FILE;
         return;
@@ -951,175 +3025,660 @@ void encode(Progress *progress){
     //
     // Success
     //
+    remove_checkpoint(c);
     progress->state = COMPLETED;
     progress->analyze_percentage = 100;
     progress->encoding_or_decoding_percentage = 100;
-    fill_report_encoding(progress);
+    finish_hashes(c);
+    fill_report_encoding(c, progress);
+    report_progress(c, progress);
+
+    drop_cache(c, c->in, &c->input_dropped, c->input_file_length, 0, 1);
+    if(c->drop_caches && fflush(c->out) == 0) {
+        drop_cache(c, c->out, &c->output_dropped, ftello(c->out), 1, 1);
+    }
 
-    if(queue != NULL) { free(queue); }
-    if(in    != NULL) { fclose(in ); }
-    if(out != NULL && out != stdout ) { fclose(out); }
+    release_conversion(c);
 }
 
-void decode(Progress *progress){
-    int bytesRead = 0;
+//
+// The output file as written so far, either through stdio or in the
+// background
+//
+static int8_t write_file(Conversion* c, const uint8_t* data, size_t size) {
+    if(c->output_writer != NULL) {
+        return block_writer_write(c->output_writer, data, size);
+    }
+    return fwrite(data, 1, size, c->out) == size;
+}
+
+static int8_t skip_file(Conversion* c, off_t size) {
+    if(c->output_writer != NULL) {
+        return block_writer_skip(c->output_writer, size);
+    }
+    return fseeko(c->out, size, SEEK_CUR) == 0;
+}
+
+static int8_t flush_file(Conversion* c) {
+    if(c->output_writer != NULL) {
+        return block_writer_flush(c->output_writer);
+    }
+    return fflush(c->out) == 0;
+}
+
+static off_t tell_file(Conversion* c) {
+    if(c->output_writer != NULL) {
+        return block_writer_position(c->output_writer);
+    }
+    return ftello(c->out);
+}
+
+//
+// Between two sectors (or blocks of literal bytes), with the zeros held back
+// not written yet
+//
+static int8_t save_decoding_checkpoint(Conversion* c) {
+    CheckpointState state;
+
+    if(!flush_file(c)) {
+        return 0;
+    }
+    start_checkpoint(c, &state);
+    state.input_position = ftello(c->in);
+    state.output_length = tell_file(c);
+    state.edc = c->output_edc;
+    state.decoding_state = c->decoding_state;
+    state.type = c->type;
+    state.num = c->num;
+    state.output_address = c->output_address;
+    state.output_fill = c->output_fill;
+    state.output_reference = c->output_reference;
+    state.output_position = c->output_position;
+    state.output_zeros = c->output_zeros;
+    state.track_index = c->track_index;
+    return state.input_position >= 0 && state.output_length >= 0 && write_checkpoint(c, &state);
+}
+
+static int8_t close_output_writer(Conversion* c) {
+    int8_t ok = 1;
+    if(c->output_writer != NULL) {
+        ok = block_writer_close(c->output_writer);
+        c->output_writer = NULL;
+    }
+    return ok;
+}
+
+//
+// Write the zeros held back, skipping over them if there are enough to make a
+// hole. At the end of a file the last one is written, so that it gets its full
+// size
+//
+static int8_t write_zeros(Conversion* c, int8_t at_end) {
+    static const uint8_t zeros[SPARSE_BLOCK];
+    off_t skip;
+
+    if(c->output_zeros < SPARSE_BLOCK) {
+        const size_t size = (size_t)c->output_zeros;
+        c->output_zeros = 0;
+        return write_file(c, zeros, size);
+    }
+
+    skip = at_end ? c->output_zeros - 1 : c->output_zeros;
+    c->output_zeros = 0;
+#ifdef OUTPUT_FALLOCATE
+    if(c->output_preallocate) {
+        //
+        // The space is reserved already, give it back
+        //
+        const off_t from = tell_file(c);
+        if(from < 0 || fallocate(fileno(c->out), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, skip) != 0) {
+            // Stays allocated, still reads as zeros
+        }
+    }
+#endif
+    if(!skip_file(c, skip)) {
+        return 0;
+    }
+    return at_end ? write_file(c, zeros, 1) : 1;
+}
+
+//
+// Write part of the image to the current output file. With sparse output,
+// zeros are held back until it's known how many there are
+//
+static int8_t write_chunk(Conversion* c, const uint8_t* data, size_t size) {
+    if(c->sparse_output) {
+        while(size > 0) {
+            const size_t piece = (size < SPARSE_BLOCK) ? size : SPARSE_BLOCK;
+            if(data[0] == 0 && is_constant(data, piece)) {
+                c->output_zeros += piece;
+            } else {
+                if(c->output_zeros > 0 && !write_zeros(c, 0)) {
+                    return 0;
+                }
+                if(!write_file(c, data, piece)) {
+                    return 0;
+                }
+            }
+            data += piece;
+            size -= piece;
+        }
+        return 1;
+    }
+    return write_file(c, data, size);
+}
+
+//
+// Move on to the file of the track where the image is now, if it changed
+//
+static int8_t next_track_output(Conversion* c) {
+    while(c->track_index + 1 < c->track_count && c->output_position >= c->track_offset[c->track_index + 1]) {
+        if(!write_zeros(c, 1) || !close_output_writer(c)) {
+            return 0;
+        }
+        drop_cache(c, c->out, &c->output_dropped, c->output_position - (c->track_count > 0 ? c->track_offset[c->track_index] : 0), 1, 1);
+        if(fclose(c->out) != 0) {
+            c->out = NULL;
+            return 0;
+        }
+        c->track_index++;
+        c->out = open_image_output(c, c->track_file_names[c->track_index], track_output_size(c, c->track_index), -1);
+        if(!c->out) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//
+// Write the next bytes of the image, to the output file or split among the
+// files of the tracks
+//
+static int8_t write_output(Conversion* c, const uint8_t* data, size_t size) {
+    const size_t total = size;
+    uint64_t started = stats_start(c);
+    c->output_edc = edc_compute(c->output_edc, data, size);
+    stats_stop(c, STAGE_EDC, started, size);
+    hash_image(c, c->output_position, data, size);
+
+    started = stats_start(c);
+    while(size > 0) {
+        size_t chunk = size;
+        if(c->track_count > 0) {
+            if(!next_track_output(c)) {
+                return 0;
+            }
+            if(c->track_index + 1 < c->track_count && (off_t)chunk > c->track_offset[c->track_index + 1] - c->output_position) {
+                chunk = (size_t)(c->track_offset[c->track_index + 1] - c->output_position);
+            }
+        }
+        if(!write_chunk(c, data, chunk)) {
+            return 0;
+        }
+        c->output_position += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    stats_stop(c, STAGE_WRITE, started, total);
+    return 1;
+}
+
+//
+// Read back bytes of the image that were already written
+//
+static int8_t read_output(Conversion* c, off_t from, uint8_t* data, size_t size) {
+    //
+    // Make sure what we are about to read has reached the file
+    //
+    if(from + (off_t)size > c->output_flushed) {
+        if(!write_zeros(c, 1) || !flush_file(c)) {
+            return 0;
+        }
+        c->output_flushed = c->output_position;
+        if(from + (off_t)size > c->output_flushed) {
+            return 0;
+        }
+    }
+    while(size > 0) {
+        size_t chunk = size;
+        int track = 0;
+        if(c->track_count > 0) {
+            while(track + 1 < c->track_count && from >= c->track_offset[track + 1]) {
+                track++;
+            }
+            if(track + 1 < c->track_count && (off_t)chunk > c->track_offset[track + 1] - from) {
+                chunk = (size_t)(c->track_offset[track + 1] - from);
+            }
+        }
+        if(c->output_reader == NULL || c->output_reader_track != track) {
+            if(c->output_reader != NULL) {
+                fclose(c->output_reader);
+            }
+            c->output_reader = fopen((c->track_count > 0) ? c->track_file_names[track] : c->output_name, "rb");
+            if(c->output_reader == NULL) {
+                return 0;
+            }
+            if(c->output_reader_buffer != NULL) {
+                setvbuf(c->output_reader, (char*)c->output_reader_buffer, _IOFBF, stdio_buffer_size(&c->output_io));
+            }
+            c->output_reader_track = track;
+        }
+        if(fseeko(c->output_reader, from - c->track_offset[track], SEEK_SET) != 0) {
+            return 0;
+        }
+        if(fread(data, 1, chunk, c->output_reader) != chunk) {
+            return 0;
+        }
+        from += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    return 1;
+}
+
+//
+// Write literal bytes of the input straight from a read-only mapping of it,
+// instead of copying them through sector_buffer. Returns 1 when done, 0 if the
+// input can't be mapped (nothing was consumed then) and -1 on error
+//
+static int8_t write_mapped_literals(Conversion* c, size_t size) {
+#ifdef INPUT_MMAP
+    const off_t position = ftello(c->in);
+    const off_t page = (off_t)sysconf(_SC_PAGESIZE);
+    off_t start;
+    size_t length;
+    void* map;
+    int8_t ok;
+
+    if(
+        c->caller_input ||
+        position < 0 ||
+        page <= 0 ||
+        c->input_file_length < 0 ||
+        position + (off_t)size > c->input_start + c->input_file_length
+    ) {
+        return 0;
+    }
+    start = position - position % page;
+    length = (size_t)(position - start) + size;
+    map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileno(c->in), start);
+    if(map == MAP_FAILED) {
+        return 0;
+    }
+    ok = write_output(c, ((const uint8_t*)map) + (position - start), size);
+    munmap(map, length);
+    if(!ok || fseeko(c->in, position + (off_t)size, SEEK_SET) != 0) {
+        return -1;
+    }
+    return 1;
+#else
+    (void)size;
+    return 0;
+#endif
+}
+
+//
+// Get the payload of the next sector (or literal bytes) of the current record,
+// either from the input or from the fill byte
+//
+static int8_t read_payload(Conversion* c, uint8_t* payload, size_t size) {
+    uint64_t started;
+    int8_t ok;
+
+    if((c->type & PAYLOAD_MASK) == PAYLOAD_CONSTANT) {
+        memset(payload, c->output_fill, size);
+        return 1;
+    }
+    started = stats_start(c);
+    if((c->type & PAYLOAD_MASK) == PAYLOAD_REFERENCE) {
+        const off_t from = c->output_reference + payload_offset[SECTOR_TYPE(c->type)];
+        c->output_reference += sectorsize[SECTOR_TYPE(c->type)];
+        ok = read_output(c, from, payload, size);
+    } else if((c->type & PAYLOAD_MASK) == PAYLOAD_DICTIONARY) {
+        const off_t from = c->output_reference;
+        c->output_reference += size;
+        ok = dictionary_read(c->dictionary, from, payload, size);
+    } else {
+        ok = fread(payload, 1, size, c->in) == size;
+    }
+    stats_stop(c, STAGE_READ, started, size);
+    return ok;
+}
+
+//
+// Rebuild the sync, header, EDC and ECC of the sector in sector_buffer
+//
+static void rebuild_sector(Conversion* c, int8_t sector_type) {
+    const uint64_t started = stats_start(c);
+    reconstruct_sector(c->sector_buffer, sector_type);
+    stats_stop(c, STAGE_RECONSTRUCT, started, 2352);
+}
 
-    if(decoding_state == 1){
-        int c = fgetc(in);
-        int bits = 5;
+//
+// Read the type and count of the next record, the count is 0xFFFFFFFF at the
+// end of records
+//
+static FailureReason read_type_count(FILE* f, int8_t extended, int8_t* record_type, uint32_t* count) {
+    int c = fgetc(f);
+    int bits = 5;
+    if(c == EOF) {
+        return ERROR_READING_INPUT_FILE;
+    }
+    if(extended) {
+        if(
+            SECTOR_TYPE(c) >= (int)(sizeof(sectorsize) / sizeof(sectorsize[0])) ||
+            (c & ~(PAYLOAD_MASK | 0x0F)) ||
+            ((c & PAYLOAD_MASK) > PAYLOAD_DICTIONARY) ||
+            ((c & PAYLOAD_MASK) == PAYLOAD_CONSTANT && SECTOR_TYPE(c) == 1) ||
+            ((c & PAYLOAD_MASK) >= PAYLOAD_REFERENCE && SECTOR_TYPE(c) < 2)
+        ) {
+            return INVALID_ECM_FILE;
+        }
+        *record_type = c;
+        c = fgetc(f);
+        if(c == EOF) {
+            return ERROR_READING_INPUT_FILE;
+        }
+        *count = c & 0x7F;
+        bits = 7;
+    } else {
+        *record_type = c & 3;
+        *count = (c >> 2) & 0x1F;
+    }
+    while(c & 0x80) {
+        c = fgetc(f);
         if(c == EOF) {
+            return ERROR_READING_INPUT_FILE;
+        }
+        if(
+            (bits > 31) ||
+            ((uint32_t)(c & 0x7F)) >= (((uint32_t)0x80000000LU) >> (bits-1))
+        ) {
+            return INVALID_ECM_FILE;
+        }
+        *count |= ((uint32_t)(c & 0x7F)) << bits;
+        bits += 7;
+    }
+    return SUCCESS;
+}
+
+static void decode_next(Conversion* c, Progress *progress){
+    int bytesRead = 0;
+
+    if(c->drop_caches && !c->caller_output) {
+        drop_cache(c, c->in, &c->input_dropped, ftello(c->in), 0, 0);
+        drop_cache(c, c->out, &c->output_dropped, c->output_position - (c->track_count > 0 ? c->track_offset[c->track_index] : 0), 1, 0);
+    }
+
+    if(c->decoding_state != 4 && checkpoint_due(c, c->output_position)) {
+        if(!save_decoding_checkpoint(c)) {
             progress->state = FAILURE;
-            progress->failure_reason = ERROR_READING_INPUT_FILE;
+            progress->failure_reason = ERROR_WRITING_OUTPUT_FILE;
             return;
         }
-        type = c & 3;
-        num = (c >> 2) & 0x1F;
-        while(c & 0x80) {
-            c = fgetc(in);
-            if(c == EOF) {
-                progress->state = FAILURE;
-                progress->failure_reason = ERROR_READING_INPUT_FILE;
-                return;
-            }
-            if(
-                (bits > 31) ||
-                ((uint32_t)(c & 0x7F)) >= (((uint32_t)0x80000000LU) >> (bits-1))
-            ) {
-                progress->state = FAILURE;
-                progress->failure_reason = INVALID_ECM_FILE;
-                return;
-            }
-            num |= ((uint32_t)(c & 0x7F)) << bits;
-            bits += 7;
+    }
+
+    if(c->decoding_state == 1){
+        const uint64_t started = stats_start(c);
+        const FailureReason ret = read_type_count(c->in, c->extended_format, &c->type, &c->num);
+        if(ret != SUCCESS) {
+            progress->state = FAILURE;
+            progress->failure_reason = ret;
+            return;
         }
-        if(num == 0xFFFFFFFF) {
+        if(c->num == 0xFFFFFFFF) {
             // End indicator
-            decoding_state = 4;
+            c->decoding_state = 4;
         }
         else{
-            num++;
-            decoding_state = 2;
-        }
-    }
+            c->num++;
+            c->decoding_state = 2;
 
-    if(decoding_state == 2){
-        if(type == 0) {
-            while(num) {
-                uint32_t b = num;
-                if(b > sizeof(sector_buffer)) { b = sizeof(sector_buffer); }
-                if(fread(sector_buffer, 1, b, in) != b) {
+            if(type_has_address(c->type)) {
+                if(fread(c->sector_buffer + 0x00C, 1, 0x003, c->in) != 0x003) {
                     progress->state = FAILURE;
                     progress->failure_reason = ERROR_READING_INPUT_FILE;
                     return;
                 }
+                c->output_address = get_address(c->sector_buffer);
+            }
 
-                bytesRead += b;
+            if((c->type & PAYLOAD_MASK) == PAYLOAD_CONSTANT) {
+                const int fill = fgetc(c->in);
+                if(fill == EOF) {
+                    progress->state = FAILURE;
+                    progress->failure_reason = ERROR_READING_INPUT_FILE;
+                    return;
+                }
+                c->output_fill = (uint8_t)fill;
+            }
 
-                output_edc = edc_compute(output_edc, sector_buffer, b);
-                if(fwrite(sector_buffer, 1, b, out) != b) {
+            if((c->type & PAYLOAD_MASK) >= PAYLOAD_REFERENCE) {
+                if(fread(c->sector_buffer, 1, 8, c->in) != 8) {
                     progress->state = FAILURE;
-                    progress->failure_reason = ERROR_WRITING_OUTPUT_FILE;
+                    progress->failure_reason = ERROR_READING_INPUT_FILE;
                     return;
                 }
-                num -= b;
-                setcounter_decode(ftello(in));
+                c->output_reference = (off_t)get64lsb(c->sector_buffer);
+            }
+
+            if((c->type & PAYLOAD_MASK) == PAYLOAD_DICTIONARY && c->dictionary == NULL) {
+                progress->state = FAILURE;
+                progress->failure_reason = ERROR_OPENING_DICTIONARY;
+                return;
+            }
+
+            if((c->type & PAYLOAD_MASK) == PAYLOAD_REFERENCE && c->caller_output) {
+                //
+                // Payloads are read back from the output file
+                //
+                progress->state = FAILURE;
+                progress->failure_reason = STDOUT_NOT_SUPPORTED;
+                return;
+            }
+            stats_record(c, c->type, c->num);
+        }
+        stats_stop(c, STAGE_READ, started, 0);
+    }
+
+    if(c->decoding_state == 2){
+        if(SECTOR_TYPE(c->type) == 0) {
+            while(c->num) {
+                uint32_t b = c->num;
+                int8_t mapped = 0;
+                if(b >= BULK_COPY_MIN && (c->type & PAYLOAD_MASK) == PAYLOAD_STORED) {
+                    if(b > (uint32_t)c->max_step_in_bytes) { b = c->max_step_in_bytes; }
+                    mapped = write_mapped_literals(c, b);
+                    if(mapped < 0) {
+                        progress->state = FAILURE;
+                        progress->failure_reason = ERROR_WRITING_OUTPUT_FILE;
+                        return;
+                    }
+                }
+                if(!mapped) {
+                    if(b > sizeof(c->sector_buffer)) { b = sizeof(c->sector_buffer); }
+                    if(!read_payload(c, c->sector_buffer, b)) {
+                        progress->state = FAILURE;
+                        progress->failure_reason = ERROR_READING_INPUT_FILE;
+                        return;
+                    }
+                    if(!write_output(c, c->sector_buffer, b)) {
+                        progress->state = FAILURE;
+                        progress->failure_reason = ERROR_WRITING_OUTPUT_FILE;
+                        return;
+                    }
+                }
+
+                bytesRead += b;
+                c->num -= b;
 
-                if(bytesRead >= max_step_in_bytes){
-                    refresh_progress_decode(progress);
+                if(deadline_passed(c, 1 + b / 2352) || bytesRead >= c->max_step_in_bytes){
+                    update_progress_decode(c, progress);
                     return;
                 }
             }
-            decoding_state = 1;
+            c->decoding_state = 1;
         }
         else{
-            decoding_state = 3;
+            c->decoding_state = 3;
         }
     }
 
-    if(decoding_state == 3){
-        for(; num; num--) {
-            switch(type) {
-            case 1:
-                if(fread(sector_buffer + 0x00C, 1, 0x003, in) != 0x003) {
+    if(c->decoding_state == 3){
+        for(; c->num; c->num--) {
+            switch(SECTOR_TYPE(c->type)) {
+            case 1: {
+                const uint64_t started = stats_start(c);
+                if(fread(c->sector_buffer + 0x00C, 1, 0x003, c->in) != 0x003) {
                     progress->state = FAILURE;
                     progress->failure_reason = ERROR_READING_INPUT_FILE;
                     return;
                 }
-                if(fread(sector_buffer + 0x010, 1, 0x800, in) != 0x800) {
+                if(fread(c->sector_buffer + 0x010, 1, 0x800, c->in) != 0x800) {
                     progress->state = FAILURE;
                     progress->failure_reason = ERROR_READING_INPUT_FILE;
                     return;
                 }
+                stats_stop(c, STAGE_READ, started, 0x003 + 0x800);
                 bytesRead += 0x003 + 0x800;
 
-                reconstruct_sector(sector_buffer, 1);
-                output_edc = edc_compute(output_edc, sector_buffer, 2352);
-                if(fwrite(sector_buffer, 1, 2352, out) != 2352) {
+                rebuild_sector(c, 1);
+                if(!write_output(c, c->sector_buffer, 2352)) {
                     progress->state = FAILURE;
                     progress->failure_reason = ERROR_WRITING_OUTPUT_FILE;
                     return;
                 }
                 break;
+            }
             case 2:
-                if(fread(sector_buffer + 0x014, 1, 0x804, in) != 0x804) {
+                if(!read_payload(c, c->sector_buffer + 0x014, 0x804)) {
                     progress->state = FAILURE;
                     progress->failure_reason = ERROR_READING_INPUT_FILE;
                     return;
                 }
                 bytesRead += 0x804;
 
-                reconstruct_sector(sector_buffer, 2);
-                output_edc = edc_compute(output_edc, sector_buffer + 0x10, 2336);
-                if(fwrite(sector_buffer + 0x10, 1, 2336, out) != 2336) {
+                rebuild_sector(c, 2);
+                if(!write_output(c, c->sector_buffer + 0x10, 2336)) {
                     progress->state = FAILURE;
                     progress->failure_reason = ERROR_WRITING_OUTPUT_FILE;
                     return;
                 }
                 break;
             case 3:
-                if(fread(sector_buffer + 0x014, 1, 0x918, in) != 0x918) {
+                if(!read_payload(c, c->sector_buffer + 0x014, 0x918)) {
                     progress->state = FAILURE;
                     progress->failure_reason = ERROR_READING_INPUT_FILE;
                     return;
                 }
                 bytesRead += 0x918;
 
-                reconstruct_sector(sector_buffer, 3);
-                output_edc = edc_compute(output_edc, sector_buffer + 0x10, 2336);
-                if(fwrite(sector_buffer + 0x10, 1, 2336, out) != 2336) {
+                rebuild_sector(c, 3);
+                if(!write_output(c, c->sector_buffer + 0x10, 2336)) {
+                    progress->state = FAILURE;
+                    progress->failure_reason = ERROR_WRITING_OUTPUT_FILE;
+                    return;
+                }
+                break;
+            case 4:
+            case 5: {
+                const size_t payload = (SECTOR_TYPE(c->type) == 4) ? 0x804 : 0x918;
+                if(!read_payload(c, c->sector_buffer + 0x014, payload)) {
+                    progress->state = FAILURE;
+                    progress->failure_reason = ERROR_READING_INPUT_FILE;
+                    return;
+                }
+                bytesRead += payload;
+
+                put_address(c->sector_buffer, c->output_address);
+                c->output_address = next_address(c->output_address);
+
+                rebuild_sector(c, SECTOR_TYPE(c->type) - 2);
+                if(!write_output(c, c->sector_buffer, 2352)) {
+                    progress->state = FAILURE;
+                    progress->failure_reason = ERROR_WRITING_OUTPUT_FILE;
+                    return;
+                }
+                break;
+            }
+            case 6:
+                if(!read_payload(c, c->sector_buffer + 0x010, 0x800)) {
+                    progress->state = FAILURE;
+                    progress->failure_reason = ERROR_READING_INPUT_FILE;
+                    return;
+                }
+                bytesRead += 0x800;
+
+                put_address(c->sector_buffer, c->output_address);
+                c->output_address = next_address(c->output_address);
+
+                rebuild_sector(c, 1);
+                if(!write_output(c, c->sector_buffer, 2352)) {
                     progress->state = FAILURE;
                     progress->failure_reason = ERROR_WRITING_OUTPUT_FILE;
                     return;
                 }
                 break;
             }
-            if(bytesRead >= max_step_in_bytes){
-                num--;
-                refresh_progress_decode(progress);
+            if(deadline_passed(c, 1) || bytesRead >= c->max_step_in_bytes){
+                c->num--;
+                update_progress_decode(c, progress);
                 return;
             }
-            setcounter_decode(ftello(in));
         }
-        decoding_state = 1;
+        c->decoding_state = 1;
     }
 
-    if(decoding_state != 4){
-        refresh_progress_decode(progress);
+    if(c->decoding_state != 4){
+        update_progress_decode(c, progress);
         return;
     }
 
     //
     // Verify the EDC of the entire output file
     //
-    if(fread(sector_buffer, 1, 4, in) != 4) {
+    if(fread(c->sector_buffer, 1, 4, c->in) != 4) {
         progress->state = FAILURE;
         progress->failure_reason = ERROR_READING_INPUT_FILE;
         return;
     }
 
-    fill_report_decoding(progress);
+    if(!write_zeros(c, 1)) {
+        progress->state = FAILURE;
+        progress->failure_reason = ERROR_WRITING_OUTPUT_FILE;
+        return;
+    }
+
+    //
+    // Tracks that start at the very end are empty, any other is missing
+    //
+    if(c->track_count > 0) {
+        if(!next_track_output(c)) {
+            progress->state = FAILURE;
+            progress->failure_reason = ERROR_WRITING_OUTPUT_FILE;
+            return;
+        }
+        if(c->track_index + 1 < c->track_count) {
+            progress->state = FAILURE;
+            progress->failure_reason = INVALID_CUE_SHEET;
+            return;
+        }
+    }
+
+    if(!close_output_writer(c)) {
+        progress->state = FAILURE;
+        progress->failure_reason = ERROR_WRITING_OUTPUT_FILE;
+        return;
+    }
+    if(c->drop_caches && !c->caller_output && fflush(c->out) == 0) {
+        drop_cache(c, c->in, &c->input_dropped, ftello(c->in), 0, 1);
+        drop_cache(c, c->out, &c->output_dropped, c->output_position - (c->track_count > 0 ? c->track_offset[c->track_index] : 0), 1, 1);
+    }
+
+    finish_hashes(c);
+    fill_report_decoding(c, progress);
 
-    if(get32lsb(sector_buffer) != output_edc) {
+    if(get32lsb(c->sector_buffer) != c->output_edc) {
         progress->state = FAILURE;
         progress->failure_reason = ERROR_IN_CHECKSUM;
         return;
@@ -1128,16 +3687,589 @@ void decode(Progress *progress){
     //
     // Success
     //
-
-    if(in != NULL && in != stdin ) { fclose(in ); }
-    if(out != NULL && out != stdout ) { fclose(out); }
+    remove_checkpoint(c);
+    release_conversion(c);
 
     progress->state = COMPLETED;
     progress->failure_reason = SUCCESS;
+    progress->encoding_or_decoding_percentage = 100;
+    report_progress(c, progress);
     return;
 }
 
+//
+// Close what the conversion still has open, as its end would. The archive
+// stays open for its next members
+//
+static void release_conversion(Conversion* c){
+    if(c->decoding) {
+        close_output_writer(c);
+        if(c->in != NULL && !c->caller_input) { fclose(c->in); }
+        if(c->out != NULL && !c->caller_output) { fclose(c->out); }
+        if(c->output_reader != NULL) { fclose(c->output_reader); }
+    } else {
+        if(archive != NULL && c->out == archive) { archive_member_open = 0; }
+        release_queue(c);
+        release_memory(c, c->dedup_table);
+        if(c->input_reader != NULL) { block_reader_close(c->input_reader); }
+        if(c->in != NULL && !c->caller_input) { fclose(c->in); }
+        if(c->out != NULL && !c->caller_output && c->out != archive) { fclose(c->out); }
+    }
+    if(c->dictionary != NULL) { dictionary_close(c->dictionary); }
+    c->in = NULL;
+    c->out = NULL;
+    c->output_reader = NULL;
+    c->input_reader = NULL;
+    c->dedup_table = NULL;
+    c->dictionary = NULL;
+}
+
+//
+// Done with the conversion, whichever way it ended: close what it has open
+// and free its state, unless it's in the caller's workspace
+//
+static void end_conversion(Progress *progress){
+    Conversion* c = progress->conversion;
+    if(c == NULL) {
+        return;
+    }
+    release_conversion(c);
+    if(c->workspace == NULL) {
+        free(c);
+    }
+    progress->conversion = NULL;
+}
+
+static void end_conversion_if_over(Progress *progress){
+    if(progress->state != IN_PROGRESS) {
+        end_conversion(progress);
+    }
+}
+
+static void fail_conversion(Progress *progress, FailureReason reason){
+    end_conversion(progress);
+    progress->state = FAILURE;
+    progress->failure_reason = reason;
+}
+
+void abort_conversion(Progress *progress){
+    if(progress->state == IN_PROGRESS) {
+        fail_conversion(progress, CANCELLED);
+    }
+}
+
+//
+// Go on with the conversion until it's done or the deadline passes
+//
+static void convert_for(Conversion* c, Progress *progress, uint64_t deadline_){
+    set_deadline(c, 1, deadline_);
+    do{
+        if(c->decoding) {
+            decode_next(c, progress);
+        } else {
+            encode_next(c, progress);
+        }
+    }while(progress->state == IN_PROGRESS && !deadline_passed(c, 1));
+    set_deadline(c, 0, 0);
+}
+
+//
+// Whether the conversion of the progress can go on
+//
+static int8_t conversion_running(const Progress *progress){
+    return progress->conversion != NULL && progress->state == IN_PROGRESS;
+}
+
+void encode(Progress *progress){
+    if(conversion_running(progress)) {
+        encode_next(progress->conversion, progress);
+        end_conversion_if_over(progress);
+    }
+}
+
+void decode(Progress *progress){
+    if(conversion_running(progress)) {
+        decode_next(progress->conversion, progress);
+        end_conversion_if_over(progress);
+    }
+}
+
+//
+// Either way, as the conversion knows which it is
+//
+static void step_for(Progress *progress, uint64_t deadline_){
+    if(conversion_running(progress)) {
+        convert_for(progress->conversion, progress, deadline_);
+        end_conversion_if_over(progress);
+    }
+}
+
+void encode_for(Progress *progress, uint64_t deadline_){
+    step_for(progress, deadline_);
+}
+
+void decode_for(Progress *progress, uint64_t deadline_){
+    step_for(progress, deadline_);
+}
+
+uint64_t get_monotonic_time(void){
+    return now_nanoseconds();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Background conversions
+//
+
+#ifdef ASYNC
+
+#define ASYNC_SLICE_NS 20000000
+
+static void async_main(void* arg){
+    Progress *progress = (Progress*)arg;
+    Conversion* c = progress->conversion;
+    int8_t cancelled = 0;
+
+    while(progress->state == IN_PROGRESS) {
+        pthread_mutex_lock(&c->async_lock);
+        cancelled = c->async_cancelled;
+        pthread_mutex_unlock(&c->async_lock);
+        if(cancelled) {
+            progress->state = FAILURE;
+            progress->failure_reason = CANCELLED;
+            break;
+        }
+        convert_for(c, progress, now_nanoseconds() + ASYNC_SLICE_NS);
+    }
+    if(progress->state == FAILURE) {
+        report_progress(c, progress);
+    }
+    // The state itself is freed by wait_async()
+    release_conversion(c);
+}
+
+static void close_async_fd(Conversion* c) {
+    if(c->async_fd[1] != c->async_fd[0]) {
+        close(c->async_fd[1]);
+    }
+    close(c->async_fd[0]);
+}
+
+#endif
+
+FailureReason start_async(Progress *progress){
+#ifdef ASYNC
+    Conversion* c;
+    if(!conversion_running(progress) || progress->conversion->async_started) {
+        return ASYNC_NOT_SUPPORTED;
+    }
+    c = progress->conversion;
+#ifdef ASYNC_EVENTFD
+    c->async_fd[0] = c->async_fd[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(c->async_fd[0] < 0) {
+        return ASYNC_NOT_SUPPORTED;
+    }
+#else
+    if(pipe(c->async_fd) != 0) {
+        return ASYNC_NOT_SUPPORTED;
+    }
+    fcntl(c->async_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(c->async_fd[1], F_SETFL, O_NONBLOCK);
+#endif
+    if(pthread_mutex_init(&c->async_lock, NULL) != 0) {
+        close_async_fd(c);
+        return ASYNC_NOT_SUPPORTED;
+    }
+    c->async_cancelled = 0;
+    c->async_progress = *progress;
+    c->async_progress.conversion = NULL;
+    c->async_started = 1;
+    if(!task_start(&c->async_task, c->executor, async_main, progress)) {
+        c->async_started = 0;
+        pthread_mutex_destroy(&c->async_lock);
+        close_async_fd(c);
+        return ASYNC_NOT_SUPPORTED;
+    }
+    return SUCCESS;
+#else
+    (void)progress;
+    return ASYNC_NOT_SUPPORTED;
+#endif
+}
+
+//
+// The conversion started with start_async() and not waited for yet, if any
+//
+static Conversion* async_conversion(const Progress *progress) {
+#ifdef ASYNC
+    Conversion* c = progress->conversion;
+    return (c != NULL && c->async_started) ? c : NULL;
+#else
+    (void)progress;
+    return NULL;
+#endif
+}
+
+int get_async_fd(const Progress *progress){
+#ifdef ASYNC
+    Conversion* c = async_conversion(progress);
+    return (c != NULL) ? c->async_fd[0] : -1;
+#else
+    (void)progress;
+    return -1;
+#endif
+}
+
+void clear_async_fd(const Progress *progress){
+#ifdef ASYNC
+    Conversion* c = async_conversion(progress);
+    uint8_t drained[64];
+    if(c != NULL) {
+        while(read(c->async_fd[0], drained, sizeof(drained)) > 0) {}
+    }
+#else
+    (void)progress;
+#endif
+}
+
+void get_async_progress(const Progress *progress, Progress *snapshot){
+#ifdef ASYNC
+    Conversion* c = async_conversion(progress);
+    if(c != NULL) {
+        pthread_mutex_lock(&c->async_lock);
+        *snapshot = c->async_progress;
+        pthread_mutex_unlock(&c->async_lock);
+        return;
+    }
+#endif
+    // Over and waited for, or never started
+    *snapshot = *progress;
+    snapshot->conversion = NULL;
+}
+
+void cancel_async(const Progress *progress){
+#ifdef ASYNC
+    Conversion* c = async_conversion(progress);
+    if(c != NULL) {
+        pthread_mutex_lock(&c->async_lock);
+        c->async_cancelled = 1;
+        pthread_mutex_unlock(&c->async_lock);
+    }
+#else
+    (void)progress;
+#endif
+}
+
+void wait_async(Progress *progress){
+#ifdef ASYNC
+    Conversion* c = async_conversion(progress);
+    if(c != NULL) {
+        task_wait(&c->async_task);
+        c->async_started = 0;
+        pthread_mutex_destroy(&c->async_lock);
+        close_async_fd(c);
+        end_conversion(progress);
+    }
+#else
+    (void)progress;
+#endif
+}
+
 const char *get_failure_reason_string(FailureReason failureReason){
     return failure_reason_names[failureReason];
 }
 
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Archives
+//
+// "ECMA", then the ECM data of each member one after the other, then the
+// directory. Each entry of the directory has the offset of the member, the
+// size of its ECM data, the size of its image (8 bytes each), the length of
+// its name (2 bytes) and the name. The file ends with the number of members
+// (4 bytes), the offset of the directory (8 bytes) and "ECMA" again
+//
+
+#define ARCHIVE_TRAILER_SIZE 16
+
+FailureReason create_archive(char *archive_file_name){
+    if(archive != NULL) {
+        return ERROR_IN_ARCHIVE;
+    }
+
+    archive = fopen(archive_file_name, "wb");
+    if(!archive) {
+        return ERROR_OPENING_OUTPUT_FILE;
+    }
+    memset(&archive_directory, 0, sizeof(ArchiveDirectory));
+
+    if(fwrite("ECMA", 1, 4, archive) != 4) {
+        fclose(archive);
+        archive = NULL;
+        return ERROR_WRITING_OUTPUT_FILE;
+    }
+
+    return SUCCESS;
+}
+
+FailureReason prepare_archive_encoding(char *input_file_name, char *member_name, int max_step_in_bytes_, const EncodingOptions *options, Progress *progress){
+    ArchiveMember* member;
+    FailureReason ret;
+
+    if(
+        archive == NULL ||
+        archive_member_open ||
+        archive_directory.member_count >= MAX_ARCHIVE_MEMBERS ||
+        strlen(member_name) >= MAX_ARCHIVE_MEMBER_NAME
+    ) {
+        return ERROR_IN_ARCHIVE;
+    }
+
+    member = &archive_directory.members[archive_directory.member_count];
+    member->offset = ftello(archive);
+    if(member->offset < 0) {
+        return ERROR_WRITING_OUTPUT_FILE;
+    }
+
+    ret = prepare_encoding_to(input_file_name, NULL, archive, max_step_in_bytes_, options, progress, NULL);
+    if(ret != SUCCESS) {
+        return ret;
+    }
+
+    strcpy(member->name, member_name);
+    member->original_size = progress->conversion->input_file_length;
+    archive_member_open = 1;
+
+    return SUCCESS;
+}
+
+FailureReason close_archive(void){
+    uint8_t buffer[0x1A];
+    off_t directory_offset;
+    int i;
+    FailureReason ret = SUCCESS;
+
+    if(archive == NULL || archive_member_open) {
+        return ERROR_IN_ARCHIVE;
+    }
+
+    directory_offset = ftello(archive);
+    if(directory_offset < 0) {
+        ret = ERROR_WRITING_OUTPUT_FILE;
+    }
+
+    for(i = 0; ret == SUCCESS && i < archive_directory.member_count; i++) {
+        ArchiveMember* member = &archive_directory.members[i];
+        const size_t name_length = strlen(member->name);
+
+        put64lsb(buffer + 0x00, member->offset);
+        put64lsb(buffer + 0x08, member->size);
+        put64lsb(buffer + 0x10, member->original_size);
+        buffer[0x18] = (uint8_t)(name_length >> 0);
+        buffer[0x19] = (uint8_t)(name_length >> 8);
+        if(
+            fwrite(buffer, 1, 0x1A, archive) != 0x1A ||
+            fwrite(member->name, 1, name_length, archive) != name_length
+        ) {
+            ret = ERROR_WRITING_OUTPUT_FILE;
+        }
+    }
+
+    if(ret == SUCCESS) {
+        put32lsb(buffer + 0x0, archive_directory.member_count);
+        put64lsb(buffer + 0x4, directory_offset);
+        memcpy(buffer + 0xC, "ECMA", 4);
+        if(fwrite(buffer, 1, ARCHIVE_TRAILER_SIZE, archive) != ARCHIVE_TRAILER_SIZE) {
+            ret = ERROR_WRITING_OUTPUT_FILE;
+        }
+    }
+
+    if(fclose(archive) != 0 && ret == SUCCESS) {
+        ret = ERROR_WRITING_OUTPUT_FILE;
+    }
+    archive = NULL;
+    free(take_archive_queue(archive_queue_size));
+
+    return ret;
+}
+
+FailureReason read_archive_directory(char *archive_file_name, ArchiveDirectory *directory){
+    uint8_t buffer[0x1A];
+    off_t archive_length;
+    off_t directory_offset;
+    int i;
+    FailureReason ret = SUCCESS;
+
+    FILE* f = fopen(archive_file_name, "rb");
+    if(!f) {
+        return ERROR_OPENING_INPUT_FILE;
+    }
+
+    memset(directory, 0, sizeof(ArchiveDirectory));
+
+    if(
+        fread(buffer, 1, 4, f) != 4 ||
+        memcmp(buffer, "ECMA", 4) != 0 ||
+        fseeko(f, -ARCHIVE_TRAILER_SIZE, SEEK_END) != 0 ||
+        (archive_length = ftello(f) + ARCHIVE_TRAILER_SIZE) < ARCHIVE_TRAILER_SIZE ||
+        fread(buffer, 1, ARCHIVE_TRAILER_SIZE, f) != ARCHIVE_TRAILER_SIZE ||
+        memcmp(buffer + 0xC, "ECMA", 4) != 0
+    ) {
+        fclose(f);
+        return INVALID_ARCHIVE;
+    }
+
+    directory->member_count = (int)get32lsb(buffer);
+    directory_offset = (off_t)get64lsb(buffer + 0x4);
+    if(
+        directory->member_count < 0 ||
+        directory->member_count > MAX_ARCHIVE_MEMBERS ||
+        directory_offset < 4 ||
+        directory_offset > archive_length - ARCHIVE_TRAILER_SIZE ||
+        fseeko(f, directory_offset, SEEK_SET) != 0
+    ) {
+        fclose(f);
+        return INVALID_ARCHIVE;
+    }
+
+    for(i = 0; ret == SUCCESS && i < directory->member_count; i++) {
+        ArchiveMember* member = &directory->members[i];
+        size_t name_length;
+
+        if(fread(buffer, 1, 0x1A, f) != 0x1A) {
+            ret = INVALID_ARCHIVE;
+            break;
+        }
+        member->offset = (off_t)get64lsb(buffer + 0x00);
+        member->size = (off_t)get64lsb(buffer + 0x08);
+        member->original_size = (off_t)get64lsb(buffer + 0x10);
+        name_length = ((size_t)buffer[0x18]) | (((size_t)buffer[0x19]) << 8);
+        if(
+            member->offset < 4 ||
+            member->size <= 0 ||
+            member->offset > directory_offset - member->size ||
+            name_length >= MAX_ARCHIVE_MEMBER_NAME ||
+            fread(member->name, 1, name_length, f) != name_length
+        ) {
+            ret = INVALID_ARCHIVE;
+            break;
+        }
+        member->name[name_length] = 0;
+    }
+
+    fclose(f);
+    return ret;
+}
+
+FailureReason prepare_archive_decoding(char *archive_file_name, const ArchiveMember *member, char *output_file_name, int max_step_in_bytes_, const DecodingOptions *options, Progress *progress){
+    return prepare_decoding_from(archive_file_name, member, output_file_name, max_step_in_bytes_, options, progress, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Scanning: go through the records of ECM data without decoding them, the size
+// of each payload is known from the type of its record
+//
+
+static FailureReason scan_from(FILE* f, EcmInfo* info) {
+    const off_t start = ftello(f);
+    int8_t record_type;
+    uint32_t count;
+    off_t counts[sizeof(sectorsize) / sizeof(sectorsize[0])];
+    uint8_t header[4];
+
+    memset(info, 0, sizeof(EcmInfo));
+    memset(counts, 0, sizeof(counts));
+
+    if(start < 0 || fread(header, 1, 4, f) != 4) {
+        return ERROR_READING_INPUT_FILE;
+    }
+    if(header[0] != 'E' || header[1] != 'C' || header[2] != 'M' || header[3] > 0x01) {
+        return INVALID_ECM_FILE;
+    }
+    info->extended_format = header[3];
+
+    for(;;) {
+        off_t skip = 0;
+        const FailureReason ret = read_type_count(f, info->extended_format, &record_type, &count);
+        if(ret != SUCCESS) {
+            return ret;
+        }
+        if(count == 0xFFFFFFFF) {
+            break;
+        }
+        count++;
+        info->record_count++;
+        counts[SECTOR_TYPE(record_type)] += count;
+        info->original_size += ((off_t)count) * sectorsize[SECTOR_TYPE(record_type)];
+
+        if(type_has_address(record_type)) {
+            skip += 3;
+        }
+        switch(record_type & PAYLOAD_MASK) {
+        case PAYLOAD_STORED:
+            skip += ((off_t)count) * ((SECTOR_TYPE(record_type) == 1) ? (0x003 + 0x800) : payload_size[SECTOR_TYPE(record_type)]);
+            break;
+        case PAYLOAD_CONSTANT:
+            skip += 1;
+            break;
+        case PAYLOAD_REFERENCE:
+            info->uses_references = 1;
+            skip += 8;
+            break;
+        case PAYLOAD_DICTIONARY:
+            info->uses_dictionary = 1;
+            skip += 8;
+            break;
+        }
+        if(fseeko(f, skip, SEEK_CUR) != 0) {
+            return ERROR_READING_INPUT_FILE;
+        }
+    }
+
+    //
+    // The EDC of the image comes last, which also tells if all the payloads
+    // were really there
+    //
+    if(fread(header, 1, 4, f) != 4) {
+        return ERROR_READING_INPUT_FILE;
+    }
+    info->ecm_size = ftello(f) - start;
+
+    info->literal_bytes = counts[0];
+    info->mode_1_sectors = counts[1] + counts[6];
+    info->mode_2_form_1_sectors = counts[2] + counts[4];
+    info->mode_2_form_2_sectors = counts[3] + counts[5];
+
+    return SUCCESS;
+}
+
+FailureReason scan_ecm_file(char *input_file_name, EcmInfo *info){
+    FailureReason ret;
+    FILE* f = fopen(input_file_name, "rb");
+    if(!f) {
+        return ERROR_OPENING_INPUT_FILE;
+    }
+    ret = scan_from(f, info);
+    fclose(f);
+    return ret;
+}
+
+FailureReason scan_archive_member(char *archive_file_name, const ArchiveMember *member, EcmInfo *info){
+    FailureReason ret;
+    FILE* f = fopen(archive_file_name, "rb");
+    if(!f) {
+        return ERROR_OPENING_INPUT_FILE;
+    }
+    if(fseeko(f, member->offset, SEEK_SET) != 0) {
+        fclose(f);
+        return ERROR_READING_INPUT_FILE;
+    }
+    ret = scan_from(f, info);
+    fclose(f);
+    if(ret == SUCCESS && info->ecm_size > member->size) {
+        ret = INVALID_ARCHIVE;
+    }
+    return ret;
+}
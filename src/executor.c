@@ -0,0 +1,100 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2022      Antonio Fermiano
+//
+// This file is part of libecm.
+//
+// libecm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libecm is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "executor.h"
+
+#if defined(HAVE_PTHREADS)
+
+//
+// What the executor runs, which marks the task done after running it. The
+// task isn't touched once the lock is released, since the waiter may reuse it
+//
+static void task_main(void* argument) {
+    Task* task = argument;
+    task->run(task->argument);
+    pthread_mutex_lock(&task->lock);
+    task->done = 1;
+    pthread_cond_broadcast(&task->finished);
+    pthread_mutex_unlock(&task->lock);
+}
+
+//
+// Without an executor, a detached thread for each task
+//
+static void* thread_main(void* argument) {
+    task_main(argument);
+    return NULL;
+}
+
+static int8_t thread_start(Task* task) {
+    pthread_attr_t attributes;
+    pthread_t thread;
+    int8_t started;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    started = pthread_create(&thread, &attributes, thread_main, task) == 0;
+    pthread_attr_destroy(&attributes);
+    return started;
+}
+
+int8_t task_start(Task* task, const Executor* executor, ExecutorTask run, void* argument) {
+    int8_t started;
+    task->run = run;
+    task->argument = argument;
+    task->done = 0;
+    pthread_mutex_init(&task->lock, NULL);
+    pthread_cond_init(&task->finished, NULL);
+    if(executor != NULL) {
+        started = executor->submit(executor->context, task_main, task) != 0;
+    } else {
+        started = thread_start(task);
+    }
+    if(!started) {
+        pthread_cond_destroy(&task->finished);
+        pthread_mutex_destroy(&task->lock);
+    }
+    return started;
+}
+
+void task_wait(Task* task) {
+    pthread_mutex_lock(&task->lock);
+    while(!task->done) {
+        pthread_cond_wait(&task->finished, &task->lock);
+    }
+    pthread_mutex_unlock(&task->lock);
+    pthread_cond_destroy(&task->finished);
+    pthread_mutex_destroy(&task->lock);
+}
+
+#else
+
+int8_t task_start(Task* task, const Executor* executor, ExecutorTask run, void* argument) {
+    (void)task;
+    (void)executor;
+    (void)run;
+    (void)argument;
+    return 0;
+}
+
+void task_wait(Task* task) {
+    (void)task;
+}
+
+#endif
@@ -0,0 +1,287 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2022      Antonio Fermiano
+//
+// This file is part of libecm.
+//
+// libecm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libecm is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+
+#include "hash.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// CRC32 (the one of zip and PNG)
+//
+
+static uint32_t crc32_lut[256];
+
+void crc32_init(void) {
+    uint32_t i, j;
+    for(i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for(j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+        }
+        crc32_lut[i] = crc;
+    }
+}
+
+uint32_t crc32_compute(uint32_t crc, const uint8_t* data, size_t size) {
+    crc = ~crc;
+    while(size--) {
+        crc = (crc >> 8) ^ crc32_lut[(crc ^ (*data++)) & 0xFF];
+    }
+    return ~crc;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// MD5 (RFC 1321)
+//
+
+#define ROTATE_LEFT(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static const uint32_t md5_k[64] = {
+    0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE, 0xF57C0FAF, 0x4787C62A, 0xA8304613, 0xFD469501,
+    0x698098D8, 0x8B44F7AF, 0xFFFF5BB1, 0x895CD7BE, 0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821,
+    0xF61E2562, 0xC040B340, 0x265E5A51, 0xE9B6C7AA, 0xD62F105D, 0x02441453, 0xD8A1E681, 0xE7D3FBC8,
+    0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED, 0xA9E3E905, 0xFCEFA3F8, 0x676F02D9, 0x8D2A4C8A,
+    0xFFFA3942, 0x8771F681, 0x6D9D6122, 0xFDE5380C, 0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70,
+    0x289B7EC6, 0xEAA127FA, 0xD4EF3085, 0x04881D05, 0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665,
+    0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039, 0x655B59C3, 0x8F0CCC92, 0xFFEFF47D, 0x85845DD1,
+    0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1, 0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391
+};
+
+static const uint8_t md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void md5_block(Md5* md5, const uint8_t* block) {
+    uint32_t w[16];
+    uint32_t a = md5->state[0];
+    uint32_t b = md5->state[1];
+    uint32_t c = md5->state[2];
+    uint32_t d = md5->state[3];
+    int i;
+
+    for(i = 0; i < 16; i++) {
+        w[i] = get32lsb(block + 4 * i);
+    }
+    for(i = 0; i < 64; i++) {
+        uint32_t f, t;
+        int g;
+        if(i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if(i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) & 15;
+        } else if(i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+        t = d;
+        d = c;
+        c = b;
+        b = b + ROTATE_LEFT(a + f + md5_k[i] + w[g], md5_r[i]);
+        a = t;
+    }
+    md5->state[0] += a;
+    md5->state[1] += b;
+    md5->state[2] += c;
+    md5->state[3] += d;
+}
+
+void md5_start(Md5* md5) {
+    md5->state[0] = 0x67452301;
+    md5->state[1] = 0xEFCDAB89;
+    md5->state[2] = 0x98BADCFE;
+    md5->state[3] = 0x10325476;
+    md5->length = 0;
+}
+
+void md5_update(Md5* md5, const uint8_t* data, size_t size) {
+    size_t used = (size_t)(md5->length & 63);
+    md5->length += size;
+    if(used > 0) {
+        size_t fill = 64 - used;
+        if(size < fill) {
+            memcpy(md5->buffer + used, data, size);
+            return;
+        }
+        memcpy(md5->buffer + used, data, fill);
+        md5_block(md5, md5->buffer);
+        data += fill;
+        size -= fill;
+    }
+    for(; size >= 64; data += 64, size -= 64) {
+        md5_block(md5, data);
+    }
+    memcpy(md5->buffer, data, size);
+}
+
+void md5_finish(Md5* md5, uint8_t digest[16]) {
+    static const uint8_t padding[64] = { 0x80 };
+    uint8_t length[8];
+    const uint64_t bits = md5->length << 3;
+    const size_t used = (size_t)(md5->length & 63);
+    int i;
+
+    put32lsb(length + 0, (uint32_t)bits);
+    put32lsb(length + 4, (uint32_t)(bits >> 32));
+    md5_update(md5, padding, (used < 56) ? (56 - used) : (120 - used));
+    md5_update(md5, length, 8);
+    for(i = 0; i < 4; i++) {
+        put32lsb(digest + 4 * i, md5->state[i]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// SHA-1 (RFC 3174)
+//
+
+static uint32_t get32msb(const uint8_t* src) {
+    return
+        (((uint32_t)(src[0])) << 24) |
+        (((uint32_t)(src[1])) << 16) |
+        (((uint32_t)(src[2])) <<  8) |
+        (((uint32_t)(src[3])) <<  0);
+}
+
+static void put32msb(uint8_t* dest, uint32_t value) {
+    dest[0] = (uint8_t)(value >> 24);
+    dest[1] = (uint8_t)(value >> 16);
+    dest[2] = (uint8_t)(value >>  8);
+    dest[3] = (uint8_t)(value >>  0);
+}
+
+static void sha1_block(Sha1* sha1, const uint8_t* block) {
+    uint32_t w[80];
+    uint32_t a = sha1->state[0];
+    uint32_t b = sha1->state[1];
+    uint32_t c = sha1->state[2];
+    uint32_t d = sha1->state[3];
+    uint32_t e = sha1->state[4];
+    int i;
+
+    for(i = 0; i < 16; i++) {
+        w[i] = get32msb(block + 4 * i);
+    }
+    for(; i < 80; i++) {
+        w[i] = ROTATE_LEFT(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    for(i = 0; i < 80; i++) {
+        uint32_t f, k, t;
+        if(i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if(i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if(i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        t = ROTATE_LEFT(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = ROTATE_LEFT(b, 30);
+        b = a;
+        a = t;
+    }
+    sha1->state[0] += a;
+    sha1->state[1] += b;
+    sha1->state[2] += c;
+    sha1->state[3] += d;
+    sha1->state[4] += e;
+}
+
+void sha1_start(Sha1* sha1) {
+    sha1->state[0] = 0x67452301;
+    sha1->state[1] = 0xEFCDAB89;
+    sha1->state[2] = 0x98BADCFE;
+    sha1->state[3] = 0x10325476;
+    sha1->state[4] = 0xC3D2E1F0;
+    sha1->length = 0;
+}
+
+void sha1_update(Sha1* sha1, const uint8_t* data, size_t size) {
+    size_t used = (size_t)(sha1->length & 63);
+    sha1->length += size;
+    if(used > 0) {
+        size_t fill = 64 - used;
+        if(size < fill) {
+            memcpy(sha1->buffer + used, data, size);
+            return;
+        }
+        memcpy(sha1->buffer + used, data, fill);
+        sha1_block(sha1, sha1->buffer);
+        data += fill;
+        size -= fill;
+    }
+    for(; size >= 64; data += 64, size -= 64) {
+        sha1_block(sha1, data);
+    }
+    memcpy(sha1->buffer, data, size);
+}
+
+void sha1_finish(Sha1* sha1, uint8_t digest[20]) {
+    static const uint8_t padding[64] = { 0x80 };
+    uint8_t length[8];
+    const uint64_t bits = sha1->length << 3;
+    const size_t used = (size_t)(sha1->length & 63);
+    int i;
+
+    put32msb(length + 0, (uint32_t)(bits >> 32));
+    put32msb(length + 4, (uint32_t)bits);
+    sha1_update(sha1, padding, (used < 56) ? (56 - used) : (120 - used));
+    sha1_update(sha1, length, 8);
+    for(i = 0; i < 5; i++) {
+        put32msb(digest + 4 * i, sha1->state[i]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void hash_start(HashState* state, int flags) {
+    state->flags = flags;
+    state->crc32 = 0;
+    if(flags & HASH_MD5) { md5_start(&state->md5); }
+    if(flags & HASH_SHA1) { sha1_start(&state->sha1); }
+}
+
+void hash_update(HashState* state, const uint8_t* data, size_t size) {
+    if(state->flags & HASH_CRC32) { state->crc32 = crc32_compute(state->crc32, data, size); }
+    if(state->flags & HASH_MD5) { md5_update(&state->md5, data, size); }
+    if(state->flags & HASH_SHA1) { sha1_update(&state->sha1, data, size); }
+}
+
+void hash_finish(HashState* state, Hashes* hashes) {
+    memset(hashes, 0, sizeof(Hashes));
+    hashes->crc32 = state->crc32;
+    if(state->flags & HASH_MD5) { md5_finish(&state->md5, hashes->md5); }
+    if(state->flags & HASH_SHA1) { sha1_finish(&state->sha1, hashes->sha1); }
+}
@@ -0,0 +1,901 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2022      Antonio Fermiano
+//
+// This file is part of libecm.
+//
+// libecm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libecm is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#if defined(__linux__)
+// For O_DIRECT
+#define _GNU_SOURCE
+#endif
+
+#include "io.h"
+#include "executor.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+// Through the system calls, without needing liburing
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#define IO_URING 1
+#endif
+#endif
+#endif
+
+#if defined(HAVE_PTHREADS)
+#include <pthread.h>
+#define IO_THREADS 1
+#endif
+
+#define DEFAULT_BLOCK_SIZE  0x100000
+#define DEFAULT_QUEUE_DEPTH 4
+#define MAX_QUEUE_DEPTH     64
+
+// What O_DIRECT needs offsets, sizes and buffers aligned to
+#define DIRECT_ALIGNMENT    4096
+
+#define ALIGN_DIRECT(size)  (((size) + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT)
+
+#if defined(IO_URING) || defined(IO_THREADS)
+
+#if defined(IO_URING)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Submission and completion rings shared with the kernel
+//
+
+typedef struct _Uring {
+    int fd;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    int8_t synchronous; // the kernel turned a read or write down, do them here
+} Uring;
+
+static int uring_enter(int fd, unsigned submit, unsigned wait) {
+    int r;
+    do {
+        r = (int)syscall(__NR_io_uring_enter, fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while(r < 0 && errno == EINTR);
+    return r;
+}
+
+static void uring_close(Uring* ring) {
+    if(ring->sqes != NULL) { munmap(ring->sqes, ring->sqes_size); }
+    if(ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) { munmap(ring->cq_ring, ring->cq_ring_size); }
+    if(ring->sq_ring != NULL) { munmap(ring->sq_ring, ring->sq_ring_size); }
+    close(ring->fd);
+}
+
+//
+// IORING_OP_READ and IORING_OP_WRITE are only there since Linux 5.6, which
+// also added the probe: where the probe fails, neither of them can be used
+//
+static int8_t uring_supported(int fd) {
+    const unsigned count = 256;
+    struct io_uring_probe* probe = calloc(1, sizeof(*probe) + count * sizeof(struct io_uring_probe_op));
+    int8_t supported = 0;
+    if(probe == NULL) {
+        return 0;
+    }
+    if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, count) >= 0 &&
+       probe->last_op >= IORING_OP_READ && probe->last_op >= IORING_OP_WRITE) {
+        supported = (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+                    (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+static int8_t uring_open(Uring* ring, unsigned entries) {
+    struct io_uring_params params;
+    uint8_t* sq;
+    uint8_t* cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0) {
+        // Not built into the kernel, or disabled
+        return 0;
+    }
+    if(!uring_supported(ring->fd)) {
+        close(ring->fd);
+        return 0;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_ring_size > ring->sq_ring_size) { ring->sq_ring_size = ring->cq_ring_size; }
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_close(ring);
+        return 0;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            uring_close(ring);
+            return 0;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_close(ring);
+        return 0;
+    }
+
+    sq = (uint8_t*)ring->sq_ring;
+    cq = (uint8_t*)ring->cq_ring;
+    ring->sq_tail  = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask  = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head  = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail  = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask  = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 1;
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Blocks of the reader and the writer. Each buffer has at most one read or
+// write in flight, identified by the index of the buffer
+//
+
+typedef struct _Block {
+    off_t offset;
+    size_t size;
+    ssize_t result;
+    int8_t in_flight;
+    int8_t done;
+} Block;
+
+typedef struct _BlockQueue {
+    IoBackend backend;
+    int fd;
+    int direct_fd;     // the same file opened with O_DIRECT, -1 if it isn't
+    size_t block_size;
+    int depth;
+    uint8_t* buffers;
+    int8_t caller_memory; // the buffers (and what holds the queue) are the caller's
+    Block blocks[MAX_QUEUE_DEPTH];
+#if defined(IO_URING)
+    Uring ring;
+#endif
+#if defined(IO_THREADS)
+    //
+    // With a thread, the buffers are a ring with a single producer and a
+    // single consumer: blocks from head to tail are filled, and each index is
+    // only moved by one side. The lock is only taken to sleep when there is
+    // nothing to do, and by the other side to wake up one that sleeps
+    //
+    Task task;
+    unsigned head;
+    unsigned tail;
+    int8_t stop;
+    int8_t failed;
+    int waiting; // sides sleeping, or about to, in ring_wait()
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+#endif
+} BlockQueue;
+
+//
+// Open the file again with O_DIRECT, which can't be turned on for the file
+// descriptor given since stdio uses it too
+//
+static int open_direct(int fd, int8_t reading, const IoOptions* options) {
+#if defined(__linux__) && defined(O_DIRECT)
+    char path[32];
+    if(!options->direct || options->block_size % DIRECT_ALIGNMENT != 0) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return open(path, (reading ? O_RDONLY : O_WRONLY) | O_DIRECT);
+#else
+    (void)fd;
+    (void)reading;
+    (void)options;
+    return -1;
+#endif
+}
+
+static void queue_free(BlockQueue* queue) {
+    if(!queue->caller_memory) {
+        free(queue->buffers);
+    }
+}
+
+static size_t queue_block_size(const IoOptions* options) {
+    return options->block_size > 0 ? (size_t)options->block_size : DEFAULT_BLOCK_SIZE;
+}
+
+static int queue_depth(const IoOptions* options) {
+    const int depth = options->queue_depth > 0 ? options->queue_depth : DEFAULT_QUEUE_DEPTH;
+    return depth > MAX_QUEUE_DEPTH ? MAX_QUEUE_DEPTH : depth;
+}
+
+static int8_t queue_available(const IoOptions* options) {
+    switch(options->backend) {
+#if defined(IO_URING)
+    case IO_BACKEND_URING:
+        return 1;
+#endif
+#if defined(IO_THREADS)
+    case IO_BACKEND_THREADS:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+//
+// With buffers given (aligned to DIRECT_ALIGNMENT), they're used instead of
+// allocating them
+//
+static int8_t queue_open(BlockQueue* queue, int fd, int8_t reading, const IoOptions* options, uint8_t* buffers) {
+    if(!queue_available(options)) {
+        return 0;
+    }
+    queue->backend = options->backend;
+    queue->fd = fd;
+    queue->block_size = queue_block_size(options);
+    queue->depth = queue_depth(options);
+    memset(queue->blocks, 0, sizeof(queue->blocks));
+
+    // Aligned to pages, the kernel copies them faster (and O_DIRECT needs it)
+    queue->caller_memory = buffers != NULL;
+    queue->buffers = buffers;
+    if(!queue->caller_memory && posix_memalign((void**)&queue->buffers, DIRECT_ALIGNMENT, queue->block_size * queue->depth) != 0) {
+        return 0;
+    }
+#if defined(IO_URING)
+    if(queue->backend == IO_BACKEND_URING && !uring_open(&queue->ring, (unsigned)queue->depth)) {
+        queue_free(queue);
+        return 0;
+    }
+#endif
+    queue->direct_fd = open_direct(fd, reading, options);
+#if defined(IO_THREADS)
+    if(queue->backend == IO_BACKEND_THREADS) {
+        queue->head = 0;
+        queue->tail = 0;
+        queue->stop = 0;
+        queue->waiting = 0;
+        queue->failed = 0;
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->changed, NULL);
+    }
+#endif
+    return 1;
+}
+
+static uint8_t* queue_buffer(BlockQueue* queue, int index) {
+    return queue->buffers + queue->block_size * index;
+}
+
+//
+// File descriptor to read or write a whole block with. O_DIRECT is only used
+// when everything is aligned, the rest goes through the page cache
+//
+static int queue_fd(BlockQueue* queue, off_t offset, size_t size) {
+    if(queue->direct_fd >= 0 && offset % DIRECT_ALIGNMENT == 0 && size % DIRECT_ALIGNMENT == 0) {
+        return queue->direct_fd;
+    }
+    return queue->fd;
+}
+
+//
+// Read or write the whole block synchronously, from where it was left
+//
+static int8_t queue_finish(BlockQueue* queue, int8_t reading, int index, size_t done) {
+    Block* block = &queue->blocks[index];
+    while(done < block->size) {
+        uint8_t* buffer = queue_buffer(queue, index) + done;
+        const int fd = (done == 0) ? queue_fd(queue, block->offset, block->size) : queue->fd;
+        ssize_t r = reading ?
+            pread(fd, buffer, block->size - done, block->offset + done) :
+            pwrite(fd, buffer, block->size - done, block->offset + done);
+        if(r < 0 && errno == EINTR) { continue; }
+        if(r <= 0) {
+            block->result = -1;
+            return 0;
+        }
+        done += (size_t)r;
+    }
+    block->result = (ssize_t)done;
+    return 1;
+}
+
+#if defined(IO_URING)
+
+static int8_t queue_submit(BlockQueue* queue, int8_t reading, int index, off_t offset, size_t size) {
+    Uring* ring = &queue->ring;
+    unsigned tail = *ring->sq_tail;
+    unsigned i = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[i];
+    Block* block = &queue->blocks[index];
+
+    block->offset = offset;
+    block->size = size;
+    if(ring->synchronous) {
+        block->in_flight = 0;
+        block->done = 1;
+        return queue_finish(queue, reading, index, 0);
+    }
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = reading ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = queue_fd(queue, offset, size);
+    sqe->addr = (uint64_t)(uintptr_t)queue_buffer(queue, index);
+    sqe->len = (uint32_t)size;
+    sqe->off = (uint64_t)offset;
+    sqe->user_data = (uint64_t)index;
+    ring->sq_array[i] = i;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    block->in_flight = 1;
+    block->done = 0;
+    return uring_enter(ring->fd, 1, 0) == 1;
+}
+
+//
+// Wait for the block of this buffer, and finish it synchronously if the
+// kernel did only part of it. If it turned the operation down altogether
+// (a kernel whose probe passed but still rejects it), the blocks are read or
+// written synchronously from then on
+//
+static int8_t queue_wait(BlockQueue* queue, int8_t reading, int index) {
+    Uring* ring = &queue->ring;
+    Block* block = &queue->blocks[index];
+
+    while(block->in_flight) {
+        unsigned head = *ring->cq_head;
+        struct io_uring_cqe* cqe;
+        if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            if(uring_enter(ring->fd, 0, 1) < 0) { return 0; }
+            continue;
+        }
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        queue->blocks[cqe->user_data].result = cqe->res;
+        queue->blocks[cqe->user_data].in_flight = 0;
+        queue->blocks[cqe->user_data].done = 1;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    if(block->result == -EINVAL || block->result == -EOPNOTSUPP) {
+        ring->synchronous = 1;
+        block->result = 0;
+    }
+    if(block->result < 0) {
+        return 0;
+    }
+    return queue_finish(queue, reading, index, (size_t)block->result);
+}
+
+#endif
+
+#if defined(IO_THREADS)
+
+typedef enum _RingState { RING_FILLED,
+                          RING_ROOM,
+                          RING_EMPTY } RingState;
+
+//
+// The indices and the number of sides waiting are sequentially consistent, so
+// that a side going to sleep sees the index just moved, or the side moving it
+// sees that it has to wake it up
+//
+static int8_t ring_is(BlockQueue* queue, RingState state) {
+    const unsigned used = __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) - __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST);
+    switch(state) {
+    case RING_FILLED: return used > 0;
+    case RING_ROOM:   return used < (unsigned)queue->depth;
+    default:          return used == 0;
+    }
+}
+
+//
+// Sleep until the ring is in that state, or the thread is told to stop
+//
+static void ring_wait(BlockQueue* queue, RingState state) {
+    if(ring_is(queue, state)) {
+        return;
+    }
+    pthread_mutex_lock(&queue->lock);
+    __atomic_add_fetch(&queue->waiting, 1, __ATOMIC_SEQ_CST);
+    while(!ring_is(queue, state) && !queue->stop) {
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+    __atomic_sub_fetch(&queue->waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+//
+// Hand over the block at this end of the ring to the other side, which is
+// only woken up when it sleeps
+//
+static void ring_advance(BlockQueue* queue, unsigned* end) {
+    __atomic_store_n(end, *end + 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&queue->waiting, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_broadcast(&queue->changed);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+static void ring_stop(BlockQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    __atomic_store_n(&queue->stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    task_wait(&queue->task);
+}
+
+#endif
+
+static int8_t queue_close(BlockQueue* queue) {
+    int8_t ok = 1;
+    int i;
+#if defined(IO_URING)
+    if(queue->backend == IO_BACKEND_URING) {
+        // The kernel may still be using the buffers
+        for(i = 0; i < queue->depth; i++) {
+            if(queue->blocks[i].in_flight && !queue_wait(queue, 1, i)) {
+                ok = 0;
+            }
+        }
+        uring_close(&queue->ring);
+    }
+#endif
+#if defined(IO_THREADS)
+    if(queue->backend == IO_BACKEND_THREADS) {
+        ring_stop(queue);
+        pthread_cond_destroy(&queue->changed);
+        pthread_mutex_destroy(&queue->lock);
+    }
+#endif
+    (void)i;
+    if(queue->direct_fd >= 0) {
+        close(queue->direct_fd);
+    }
+    queue_free(queue);
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// The reader keeps every buffer but the one handed out being read, in order
+//
+
+struct _BlockReader {
+    BlockQueue queue;
+    off_t next_offset; // of the next block to read
+    off_t end;
+    int current;       // buffer handed out last, -1 before the first one
+};
+
+//
+// Size of the next block to read, 0 at the end
+//
+static size_t reader_next_size(BlockReader* reader) {
+    size_t size = reader->queue.block_size;
+    if(reader->next_offset >= reader->end) {
+        return 0;
+    }
+    if((off_t)size > reader->end - reader->next_offset) {
+        size = (size_t)(reader->end - reader->next_offset);
+    }
+    return size;
+}
+
+#if defined(IO_URING)
+
+static int8_t reader_submit(BlockReader* reader, int index) {
+    const size_t size = reader_next_size(reader);
+    if(size == 0) {
+        return 1;
+    }
+    if(!queue_submit(&reader->queue, 1, index, reader->next_offset, size)) {
+        return 0;
+    }
+    reader->next_offset += size;
+    return 1;
+}
+
+#endif
+
+#if defined(IO_THREADS)
+
+//
+// Reading thread, which fills the ring up to the end of the file (where it
+// leaves an empty block) or the first error
+//
+static void reader_main(void* argument) {
+    BlockReader* reader = argument;
+    BlockQueue* queue = &reader->queue;
+    for(;;) {
+        const int index = (int)(queue->tail % (unsigned)queue->depth);
+        Block* block = &queue->blocks[index];
+        ring_wait(queue, RING_ROOM);
+        if(__atomic_load_n(&queue->stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        block->offset = reader->next_offset;
+        block->size = reader_next_size(reader);
+        if(!queue_finish(queue, 1, index, 0)) {
+            ring_advance(queue, &queue->tail);
+            break;
+        }
+        reader->next_offset += block->size;
+        ring_advance(queue, &queue->tail);
+        if(block->size == 0) {
+            break;
+        }
+    }
+}
+
+#endif
+
+BlockReader* block_reader_open(int fd, off_t offset, off_t length, const IoOptions* options, const Executor* executor, void* memory) {
+    BlockReader* reader;
+    if(length < 0 || !queue_available(options)) {
+        return NULL;
+    }
+    reader = (memory != NULL) ? memory : malloc(sizeof(BlockReader));
+    if(reader == NULL) {
+        return NULL;
+    }
+    if(!queue_open(&reader->queue, fd, 1, options, (memory != NULL) ? (uint8_t*)memory + ALIGN_DIRECT(sizeof(BlockReader)) : NULL)) {
+        if(memory == NULL) { free(reader); }
+        return NULL;
+    }
+    reader->next_offset = offset;
+    reader->end = offset + length;
+    reader->current = -1;
+#if defined(IO_URING)
+    if(reader->queue.backend == IO_BACKEND_URING) {
+        int i;
+        for(i = 0; i < reader->queue.depth; i++) {
+            if(!reader_submit(reader, i)) {
+                block_reader_close(reader);
+                return NULL;
+            }
+        }
+    }
+#endif
+#if defined(IO_THREADS)
+    if(reader->queue.backend == IO_BACKEND_THREADS && !task_start(&reader->queue.task, executor, reader_main, reader)) {
+        pthread_cond_destroy(&reader->queue.changed);
+        pthread_mutex_destroy(&reader->queue.lock);
+        if(reader->queue.direct_fd >= 0) { close(reader->queue.direct_fd); }
+        queue_free(&reader->queue);
+        if(memory == NULL) { free(reader); }
+        return NULL;
+    }
+#endif
+    return reader;
+}
+
+const uint8_t* block_reader_next(BlockReader* reader, size_t* size) {
+    BlockQueue* queue = &reader->queue;
+    int next = (reader->current + 1) % queue->depth;
+
+#if defined(IO_THREADS)
+    if(queue->backend == IO_BACKEND_THREADS) {
+        // The caller is done with the current buffer, it can be read into again
+        if(reader->current >= 0) {
+            ring_advance(queue, &queue->head);
+        }
+        ring_wait(queue, RING_FILLED);
+        next = (int)(queue->head % (unsigned)queue->depth);
+        if(queue->blocks[next].result < 0) {
+            return NULL;
+        }
+        // The empty block at the end stays in the ring
+        reader->current = queue->blocks[next].size > 0 ? next : -1;
+        *size = queue->blocks[next].size;
+        return queue_buffer(queue, next);
+    }
+#endif
+#if defined(IO_URING)
+    // The caller is done with the current buffer, it can be read into again
+    if(reader->current >= 0) {
+        queue->blocks[reader->current].done = 0;
+        if(!reader_submit(reader, reader->current)) {
+            return NULL;
+        }
+    }
+    if(!queue->blocks[next].in_flight && !queue->blocks[next].done) {
+        *size = 0;
+        return queue_buffer(queue, next);
+    }
+    if(!queue_wait(queue, 1, next)) {
+        return NULL;
+    }
+    reader->current = next;
+    *size = queue->blocks[next].size;
+    return queue_buffer(queue, next);
+#else
+    return NULL;
+#endif
+}
+
+void block_reader_close(BlockReader* reader) {
+    const int8_t caller_memory = reader->queue.caller_memory;
+    queue_close(&reader->queue);
+    if(!caller_memory) {
+        free(reader);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// The writer fills one buffer while the others are being written
+//
+
+struct _BlockWriter {
+    BlockQueue queue;
+    off_t position;
+    int current;
+    size_t used;           // bytes in the current buffer
+    off_t current_offset;  // where they go
+    int8_t failed;
+};
+
+#if defined(IO_THREADS)
+
+//
+// Writing thread, which empties the ring until it's told to stop
+//
+static void writer_main(void* argument) {
+    BlockWriter* writer = argument;
+    BlockQueue* queue = &writer->queue;
+    for(;;) {
+        const int index = (int)(queue->head % (unsigned)queue->depth);
+        ring_wait(queue, RING_FILLED);
+        if(!ring_is(queue, RING_FILLED)) {
+            break;
+        }
+        if(!queue_finish(queue, 0, index, 0)) {
+            __atomic_store_n(&queue->failed, 1, __ATOMIC_RELEASE);
+        }
+        ring_advance(queue, &queue->head);
+    }
+}
+
+#endif
+
+//
+// Send the current buffer to be written, and wait until the next one is free
+//
+static int8_t writer_submit(BlockWriter* writer) {
+    BlockQueue* queue = &writer->queue;
+    if(writer->used == 0) {
+        return !writer->failed;
+    }
+#if defined(IO_THREADS)
+    if(queue->backend == IO_BACKEND_THREADS) {
+        queue->blocks[writer->current].offset = writer->current_offset;
+        queue->blocks[writer->current].size = writer->used;
+        ring_advance(queue, &queue->tail);
+        writer->used = 0;
+        writer->current = (int)(queue->tail % (unsigned)queue->depth);
+        ring_wait(queue, RING_ROOM);
+        if(__atomic_load_n(&queue->failed, __ATOMIC_ACQUIRE)) {
+            writer->failed = 1;
+        }
+        return !writer->failed;
+    }
+#endif
+#if defined(IO_URING)
+    if(!queue_submit(queue, 0, writer->current, writer->current_offset, writer->used)) {
+        writer->failed = 1;
+    }
+    writer->used = 0;
+    writer->current = (writer->current + 1) % queue->depth;
+    if(queue->blocks[writer->current].in_flight && !queue_wait(queue, 0, writer->current)) {
+        writer->failed = 1;
+    }
+#endif
+    return !writer->failed;
+}
+
+BlockWriter* block_writer_open(int fd, off_t offset, const IoOptions* options, const Executor* executor, void* memory) {
+    BlockWriter* writer;
+    if(!queue_available(options)) {
+        return NULL;
+    }
+    writer = (memory != NULL) ? memory : malloc(sizeof(BlockWriter));
+    if(writer == NULL) {
+        return NULL;
+    }
+    if(!queue_open(&writer->queue, fd, 0, options, (memory != NULL) ? (uint8_t*)memory + ALIGN_DIRECT(sizeof(BlockWriter)) : NULL)) {
+        if(memory == NULL) { free(writer); }
+        return NULL;
+    }
+    writer->position = offset;
+    writer->current = 0;
+    writer->used = 0;
+    writer->current_offset = offset;
+    writer->failed = 0;
+#if defined(IO_THREADS)
+    if(writer->queue.backend == IO_BACKEND_THREADS && !task_start(&writer->queue.task, executor, writer_main, writer)) {
+        pthread_cond_destroy(&writer->queue.changed);
+        pthread_mutex_destroy(&writer->queue.lock);
+        if(writer->queue.direct_fd >= 0) { close(writer->queue.direct_fd); }
+        queue_free(&writer->queue);
+        if(memory == NULL) { free(writer); }
+        return NULL;
+    }
+#endif
+    return writer;
+}
+
+int8_t block_writer_write(BlockWriter* writer, const uint8_t* data, size_t size) {
+    BlockQueue* queue = &writer->queue;
+    while(size > 0) {
+        size_t n = queue->block_size - writer->used;
+        if(n > size) { n = size; }
+        if(writer->used == 0) {
+            writer->current_offset = writer->position;
+        }
+        memcpy(queue_buffer(queue, writer->current) + writer->used, data, n);
+        writer->used += n;
+        writer->position += n;
+        data += n;
+        size -= n;
+        if(writer->used == queue->block_size && !writer_submit(writer)) {
+            return 0;
+        }
+    }
+    return !writer->failed;
+}
+
+int8_t block_writer_skip(BlockWriter* writer, off_t size) {
+    if(!writer_submit(writer)) {
+        return 0;
+    }
+    writer->position += size;
+    return 1;
+}
+
+int8_t block_writer_flush(BlockWriter* writer) {
+    BlockQueue* queue = &writer->queue;
+    int i;
+    if(!writer_submit(writer)) {
+        return 0;
+    }
+#if defined(IO_THREADS)
+    if(queue->backend == IO_BACKEND_THREADS) {
+        ring_wait(queue, RING_EMPTY);
+        if(__atomic_load_n(&queue->failed, __ATOMIC_ACQUIRE)) {
+            writer->failed = 1;
+        }
+    }
+#endif
+#if defined(IO_URING)
+    if(queue->backend == IO_BACKEND_URING) {
+        for(i = 0; i < queue->depth; i++) {
+            if(queue->blocks[i].in_flight && !queue_wait(queue, 0, i)) {
+                writer->failed = 1;
+            }
+        }
+    }
+#endif
+    (void)i;
+    return !writer->failed;
+}
+
+off_t block_writer_position(const BlockWriter* writer) {
+    return writer->position;
+}
+
+int8_t block_writer_close(BlockWriter* writer) {
+    const int8_t caller_memory = writer->queue.caller_memory;
+    int8_t ok = block_writer_flush(writer);
+    ok = queue_close(&writer->queue) && ok;
+    if(!caller_memory) {
+        free(writer);
+    }
+    return ok;
+}
+
+size_t block_io_memory_size(const IoOptions* options) {
+    const size_t holder = sizeof(BlockReader) > sizeof(BlockWriter) ? sizeof(BlockReader) : sizeof(BlockWriter);
+    if(!queue_available(options)) {
+        return 0;
+    }
+    return ALIGN_DIRECT(holder) + queue_block_size(options) * (size_t)queue_depth(options);
+}
+
+#else
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// No background I/O here, the callers use stdio
+//
+
+BlockReader* block_reader_open(int fd, off_t offset, off_t length, const IoOptions* options, const Executor* executor, void* memory) {
+    return NULL;
+}
+
+const uint8_t* block_reader_next(BlockReader* reader, size_t* size) {
+    return NULL;
+}
+
+void block_reader_close(BlockReader* reader) {
+}
+
+BlockWriter* block_writer_open(int fd, off_t offset, const IoOptions* options, const Executor* executor, void* memory) {
+    return NULL;
+}
+
+int8_t block_writer_write(BlockWriter* writer, const uint8_t* data, size_t size) {
+    return 0;
+}
+
+int8_t block_writer_skip(BlockWriter* writer, off_t size) {
+    return 0;
+}
+
+int8_t block_writer_flush(BlockWriter* writer) {
+    return 0;
+}
+
+off_t block_writer_position(const BlockWriter* writer) {
+    return 0;
+}
+
+int8_t block_writer_close(BlockWriter* writer) {
+    return 0;
+}
+
+size_t block_io_memory_size(const IoOptions* options) {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,463 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2022      Antonio Fermiano
+//
+// This file is part of libecm.
+//
+// libecm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libecm is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "common.h"
+#include "ecm.h"
+#include "executor.h"
+
+#if defined(HAVE_PTHREADS)
+#include <pthread.h>
+#endif
+
+//
+// How long a conversion runs before the scheduler looks again at what should
+// run next
+//
+#define SCHEDULER_SLICE_NS 20000000
+
+//
+// A conversion submitted to the scheduler, from its submission until it's
+// over. It's in the queue of a worker, or being run by one
+//
+typedef struct _Job {
+    struct _Job* next;      // in its queue
+    struct _Job* next_open; // in the scheduler's list of the started ones
+
+    int8_t decoding;
+    char* input_file_name;
+    char* output_file_name;
+    int max_step_in_bytes;
+    EncodingOptions encoding_options;
+    DecodingOptions decoding_options;
+    Progress* progress;
+
+    off_t input_size;   // what the priority goes by, with what's left of it
+    int threads;        // of the budget, while it runs
+    size_t memory;      // of the budget, from its start until it's over
+    void* workspace;    // allocated by the scheduler, NULL if the caller's
+    int8_t started;
+} Job;
+
+typedef struct _Worker {
+    Scheduler* scheduler;
+    Task task;
+    Job* queue;
+} Worker;
+
+struct _Scheduler {
+    int threads;
+    size_t memory_budget;
+    const Executor* executor; // NULL for threads of its own
+
+    Worker* workers;
+    int worker_count;   // with a thread running, there's always one queue
+    int queue_count;
+    int next_queue;     // where the next job submitted goes
+
+    int threads_used;
+    size_t memory_used;
+    int pending;        // submitted and not over
+    Job* open;          // started and not over
+    int8_t stopping;
+
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // jobs were queued, or budget freed
+    pthread_cond_t idle;    // nothing pending anymore
+#endif
+};
+
+static void lock_scheduler(Scheduler* scheduler) {
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_lock(&scheduler->lock);
+#else
+    (void)scheduler;
+#endif
+}
+
+static void unlock_scheduler(Scheduler* scheduler) {
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_unlock(&scheduler->lock);
+#else
+    (void)scheduler;
+#endif
+}
+
+static int processor_count(void) {
+#if defined(_SC_NPROCESSORS_ONLN)
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if(count > 0) {
+        return (int)count;
+    }
+#endif
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Picking what runs next, with the lock held
+//
+
+static off_t job_left(const Job* job) {
+    return job->input_size - job->progress->bytes_before_processing;
+}
+
+//
+// Only one encoder at a time may write to a dictionary
+//
+static int8_t dictionary_busy(const Scheduler* scheduler, const Job* job) {
+    const Job* other;
+    if(job->decoding || job->encoding_options.dictionary_file == NULL) {
+        return 0;
+    }
+    for(other = scheduler->open; other != NULL; other = other->next_open) {
+        if(
+            !other->decoding &&
+            other->encoding_options.dictionary_file != NULL &&
+            strcmp(other->encoding_options.dictionary_file, job->encoding_options.dictionary_file) == 0
+        ) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//
+// Whether the job fits in what's left of the budgets. With nothing running,
+// anything does, so that a job bigger than the budgets still runs alone
+//
+static int8_t job_fits(const Scheduler* scheduler, const Job* job) {
+    if(scheduler->threads_used > 0 && scheduler->threads_used + job->threads > scheduler->threads) {
+        return 0;
+    }
+    if(job->started) {
+        return 1;
+    }
+    if(dictionary_busy(scheduler, job)) {
+        return 0;
+    }
+    return
+        scheduler->memory_budget == 0 ||
+        scheduler->open == NULL ||
+        scheduler->memory_used + job->memory <= scheduler->memory_budget;
+}
+
+//
+// Link to the job of the queue with the least input left among those that
+// fit, NULL if none does
+//
+static Job** best_job(const Scheduler* scheduler, Job** queue) {
+    Job** best = NULL;
+    for(; *queue != NULL; queue = &(*queue)->next) {
+        if((best == NULL || job_left(*queue) < job_left(*best)) && job_fits(scheduler, *queue)) {
+            best = queue;
+        }
+    }
+    return best;
+}
+
+//
+// The worker's own jobs first, then the best one of the other queues
+//
+static Job* take_job(Scheduler* scheduler, Worker* worker) {
+    Job** best = best_job(scheduler, &worker->queue);
+    Job* job;
+    int i;
+    if(best == NULL) {
+        for(i = 0; i < scheduler->queue_count; i++) {
+            Job** stolen = best_job(scheduler, &scheduler->workers[i].queue);
+            if(stolen != NULL && (best == NULL || job_left(*stolen) < job_left(*best))) {
+                best = stolen;
+            }
+        }
+        if(best == NULL) {
+            return NULL;
+        }
+    }
+    job = *best;
+    *best = job->next;
+    job->next = NULL;
+
+    scheduler->threads_used += job->threads;
+    if(!job->started) {
+        job->started = 1;
+        scheduler->memory_used += job->memory;
+        job->next_open = scheduler->open;
+        scheduler->open = job;
+    }
+    return job;
+}
+
+static void free_job(Job* job) {
+    free(job->workspace);
+    free(job->input_file_name);
+    free(job->output_file_name);
+    free(job);
+}
+
+//
+// Back in the worker's queue if it isn't over, or gone with its budget
+//
+static void job_ran(Scheduler* scheduler, Worker* worker, Job* job) {
+    Job** open;
+    scheduler->threads_used -= job->threads;
+    if(job->progress->state == IN_PROGRESS) {
+        job->next = worker->queue;
+        worker->queue = job;
+    } else {
+        for(open = &scheduler->open; *open != job; open = &(*open)->next_open) {}
+        *open = job->next_open;
+        scheduler->memory_used -= job->memory;
+        scheduler->pending--;
+        free_job(job);
+#if defined(HAVE_PTHREADS)
+        if(scheduler->pending == 0) {
+            pthread_cond_broadcast(&scheduler->idle);
+        }
+#endif
+    }
+#if defined(HAVE_PTHREADS)
+    pthread_cond_broadcast(&scheduler->changed);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Running the jobs, without the lock
+//
+
+//
+// Prepare the conversion with the workspace of the job. A failure is left in
+// its Progress, as when running it
+//
+static void open_job(Job* job) {
+    void* workspace = NULL;
+    const void* given = job->decoding ? job->decoding_options.workspace : job->encoding_options.workspace;
+
+    if(given == NULL) {
+        if(posix_memalign(&workspace, WORKSPACE_ALIGNMENT, job->memory) != 0) {
+            job->progress->state = FAILURE;
+            job->progress->failure_reason = OUT_OF_MEMORY;
+            return;
+        }
+        job->workspace = workspace;
+        job->encoding_options.workspace = job->decoding_options.workspace = workspace;
+        job->encoding_options.workspace_size = job->decoding_options.workspace_size = job->memory;
+    }
+    if(job->decoding) {
+        prepare_decoding_with_options(job->input_file_name, job->output_file_name, job->max_step_in_bytes, &job->decoding_options, job->progress);
+    } else {
+        prepare_encoding_with_options(job->input_file_name, job->output_file_name, job->max_step_in_bytes, &job->encoding_options, job->progress);
+    }
+}
+
+static void run_job(Job* job) {
+    if(job->progress->conversion == NULL) {
+        open_job(job);
+    }
+    if(job->progress->state != IN_PROGRESS) {
+        return;
+    }
+    if(job->decoding) {
+        decode_for(job->progress, get_monotonic_time() + SCHEDULER_SLICE_NS);
+    } else {
+        encode_for(job->progress, get_monotonic_time() + SCHEDULER_SLICE_NS);
+    }
+}
+
+//
+// Run jobs until the scheduler stops or, when until_idle, until none is
+// pending
+//
+static void run_jobs(Worker* worker, int8_t until_idle) {
+    Scheduler* scheduler = worker->scheduler;
+    Job* job;
+
+    lock_scheduler(scheduler);
+    for(;;) {
+        job = take_job(scheduler, worker);
+        if(job == NULL) {
+            if(scheduler->stopping || (until_idle && scheduler->pending == 0)) {
+                break;
+            }
+#if defined(HAVE_PTHREADS)
+            pthread_cond_wait(&scheduler->changed, &scheduler->lock);
+#endif
+            continue;
+        }
+        unlock_scheduler(scheduler);
+        run_job(job);
+        lock_scheduler(scheduler);
+        job_ran(scheduler, worker, job);
+    }
+    unlock_scheduler(scheduler);
+}
+
+static void worker_main(void* argument) {
+    run_jobs((Worker*)argument, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void init_scheduler_options(SchedulerOptions *options){
+    memset(options, 0, sizeof(*options));
+}
+
+Scheduler *create_scheduler(const SchedulerOptions *options){
+    Scheduler* scheduler = calloc(1, sizeof(Scheduler));
+    int threads = options->threads > 0 ? options->threads : processor_count();
+    int i;
+
+    if(!scheduler) {
+        return NULL;
+    }
+    scheduler->workers = calloc(threads, sizeof(Worker));
+    if(!scheduler->workers) {
+        free(scheduler);
+        return NULL;
+    }
+    scheduler->threads = threads;
+    scheduler->memory_budget = options->memory_budget;
+    scheduler->executor = options->executor;
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->changed, NULL);
+    pthread_cond_init(&scheduler->idle, NULL);
+#endif
+
+    //
+    // As many workers as threads could be started, and a queue for each.
+    // Without any, wait_scheduler() runs the jobs from the only queue
+    //
+    for(i = 0; i < threads; i++) {
+        scheduler->workers[i].scheduler = scheduler;
+    }
+    lock_scheduler(scheduler);
+    while(scheduler->worker_count < threads) {
+        if(!task_start(&scheduler->workers[scheduler->worker_count].task, scheduler->executor, worker_main, &scheduler->workers[scheduler->worker_count])) {
+            break;
+        }
+        scheduler->worker_count++;
+    }
+    scheduler->queue_count = scheduler->worker_count > 0 ? scheduler->worker_count : 1;
+    unlock_scheduler(scheduler);
+    return scheduler;
+}
+
+//
+// Queue the job on the next worker, so that each starts with its share
+//
+static FailureReason submit_job(Scheduler* scheduler, Job* job, char* input_file_name, char* output_file_name, int max_step_in_bytes, Progress* progress) {
+    struct stat st;
+    Worker* worker;
+
+    job->input_file_name = malloc(strlen(input_file_name) + 1);
+    job->output_file_name = malloc(strlen(output_file_name) + 1);
+    if(!job->input_file_name || !job->output_file_name) {
+        free_job(job);
+        return OUT_OF_MEMORY;
+    }
+    strcpy(job->input_file_name, input_file_name);
+    strcpy(job->output_file_name, output_file_name);
+    job->max_step_in_bytes = max_step_in_bytes;
+    job->progress = progress;
+    job->input_size = (stat(input_file_name, &st) == 0) ? st.st_size : 0;
+
+    memset(progress, 0, sizeof(*progress));
+    progress->state = IN_PROGRESS;
+
+    lock_scheduler(scheduler);
+    worker = &scheduler->workers[scheduler->next_queue];
+    scheduler->next_queue = (scheduler->next_queue + 1) % scheduler->queue_count;
+    job->next = worker->queue;
+    worker->queue = job;
+    scheduler->pending++;
+#if defined(HAVE_PTHREADS)
+    pthread_cond_broadcast(&scheduler->changed);
+#endif
+    unlock_scheduler(scheduler);
+    return SUCCESS;
+}
+
+FailureReason schedule_encoding(Scheduler *scheduler, char *input_file_name, char *output_file_name, int max_step_in_bytes, const EncodingOptions *options, Progress *progress){
+    Job* job = calloc(1, sizeof(Job));
+    if(!job) {
+        return OUT_OF_MEMORY;
+    }
+    job->encoding_options = *options;
+    if(job->encoding_options.executor == NULL) {
+        job->encoding_options.executor = scheduler->executor;
+    }
+    job->threads = (options->io.backend == IO_BACKEND_THREADS) ? 2 : 1;
+    job->memory = options->workspace ? options->workspace_size : get_encoding_workspace_size(options);
+    return submit_job(scheduler, job, input_file_name, output_file_name, max_step_in_bytes, progress);
+}
+
+FailureReason schedule_decoding(Scheduler *scheduler, char *input_file_name, char *output_file_name, int max_step_in_bytes, const DecodingOptions *options, Progress *progress){
+    Job* job = calloc(1, sizeof(Job));
+    if(!job) {
+        return OUT_OF_MEMORY;
+    }
+    job->decoding = 1;
+    job->decoding_options = *options;
+    if(job->decoding_options.executor == NULL) {
+        job->decoding_options.executor = scheduler->executor;
+    }
+    job->threads = (options->io.backend == IO_BACKEND_THREADS) ? 2 : 1;
+    job->memory = options->workspace ? options->workspace_size : get_decoding_workspace_size(options);
+    return submit_job(scheduler, job, input_file_name, output_file_name, max_step_in_bytes, progress);
+}
+
+void wait_scheduler(Scheduler *scheduler){
+    if(scheduler->worker_count == 0) {
+        run_jobs(&scheduler->workers[0], 1);
+        return;
+    }
+#if defined(HAVE_PTHREADS)
+    pthread_mutex_lock(&scheduler->lock);
+    while(scheduler->pending > 0) {
+        pthread_cond_wait(&scheduler->idle, &scheduler->lock);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+#endif
+}
+
+void destroy_scheduler(Scheduler *scheduler){
+    int i;
+    wait_scheduler(scheduler);
+
+    lock_scheduler(scheduler);
+    scheduler->stopping = 1;
+#if defined(HAVE_PTHREADS)
+    pthread_cond_broadcast(&scheduler->changed);
+#endif
+    unlock_scheduler(scheduler);
+    for(i = 0; i < scheduler->worker_count; i++) {
+        task_wait(&scheduler->workers[i].task);
+    }
+
+#if defined(HAVE_PTHREADS)
+    pthread_cond_destroy(&scheduler->idle);
+    pthread_cond_destroy(&scheduler->changed);
+    pthread_mutex_destroy(&scheduler->lock);
+#endif
+    free(scheduler->workers);
+    free(scheduler);
+}
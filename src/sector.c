@@ -0,0 +1,435 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2022      Antonio Fermiano
+// Copyright (C) 2015-2017 Maxime Gauduin
+// Copyright (C) 2002-2011 Neill Corlett
+//
+// This file is part of libecm.
+//
+// libecm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libecm is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "sector.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Sector types
+//
+// Mode 1
+// -----------------------------------------------------
+//        0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+// 0000h 00 FF FF FF FF FF FF FF FF FF FF 00 [-ADDR-] 01
+// 0010h [---DATA...
+// ...
+// 0800h                                     ...DATA---]
+// 0810h [---EDC---] 00 00 00 00 00 00 00 00 [---ECC...
+// ...
+// 0920h                                      ...ECC---]
+// -----------------------------------------------------
+//
+// Mode 2 (XA), form 1
+// -----------------------------------------------------
+//        0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+// 0000h 00 FF FF FF FF FF FF FF FF FF FF 00 [-ADDR-] 02
+// 0010h [--FLAGS--] [--FLAGS--] [---DATA...
+// ...
+// 0810h             ...DATA---] [---EDC---] [---ECC...
+// ...
+// 0920h                                      ...ECC---]
+// -----------------------------------------------------
+//
+// Mode 2 (XA), form 2
+// -----------------------------------------------------
+//        0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+// 0000h 00 FF FF FF FF FF FF FF FF FF FF 00 [-ADDR-] 02
+// 0010h [--FLAGS--] [--FLAGS--] [---DATA...
+// ...
+// 0920h                         ...DATA---] [---EDC---]
+// -----------------------------------------------------
+//
+// ADDR:  Sector address, encoded as minutes:seconds:frames in BCD
+// FLAGS: Used in Mode 2 (XA) sectors describing the type of sector; repeated
+//        twice for redundancy
+// DATA:  Area of the sector which contains the actual data itself
+// EDC:   Error Detection Code
+// ECC:   Error Correction Code
+//
+
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// LUTs used for computing ECC/EDC
+//
+static uint8_t  ecc_f_lut[256];
+static uint8_t  ecc_b_lut[256];
+static uint32_t edc_lut  [256];
+
+void eccedc_init(void) {
+    size_t i;
+    for(i = 0; i < 256; i++) {
+        uint32_t edc = i;
+        size_t j = (i << 1) ^ (i & 0x80 ? 0x11D : 0);
+        ecc_f_lut[i] = j;
+        ecc_b_lut[i ^ j] = i;
+        for(j = 0; j < 8; j++) {
+            edc = (edc >> 1) ^ (edc & 1 ? 0xD8018001 : 0);
+        }
+        edc_lut[i] = edc;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Compute EDC for a block
+//
+uint32_t edc_compute(
+    uint32_t edc,
+    const uint8_t* src,
+    size_t size
+) {
+    for(; size; size--) {
+        edc = (edc >> 8) ^ edc_lut[(edc ^ (*src++)) & 0xFF];
+    }
+    return edc;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Check ECC block (either P or Q)
+// Returns true if the ECC data is an exact match
+//
+static int8_t ecc_checkpq(
+    const uint8_t* address,
+    const uint8_t* data,
+    size_t major_count,
+    size_t minor_count,
+    size_t major_mult,
+    size_t minor_inc,
+    const uint8_t* ecc
+) {
+    size_t size = major_count * minor_count;
+    size_t major;
+    for(major = 0; major < major_count; major++) {
+        size_t index = (major >> 1) * major_mult + (major & 1);
+        uint8_t ecc_a = 0;
+        uint8_t ecc_b = 0;
+        size_t minor;
+        for(minor = 0; minor < minor_count; minor++) {
+            uint8_t temp;
+            if(index < 4) {
+                temp = address[index];
+            } else {
+                temp = data[index - 4];
+            }
+            index += minor_inc;
+            if(index >= size) { index -= size; }
+            ecc_a ^= temp;
+            ecc_b ^= temp;
+            ecc_a = ecc_f_lut[ecc_a];
+        }
+        ecc_a = ecc_b_lut[ecc_f_lut[ecc_a] ^ ecc_b];
+        if(
+            ecc[major              ] != (ecc_a        ) ||
+            ecc[major + major_count] != (ecc_a ^ ecc_b)
+        ) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//
+// Write ECC block (either P or Q)
+//
+static void ecc_writepq(
+    const uint8_t* address,
+    const uint8_t* data,
+    size_t major_count,
+    size_t minor_count,
+    size_t major_mult,
+    size_t minor_inc,
+    uint8_t* ecc
+) {
+    size_t size = major_count * minor_count;
+    size_t major;
+    for(major = 0; major < major_count; major++) {
+        size_t index = (major >> 1) * major_mult + (major & 1);
+        uint8_t ecc_a = 0;
+        uint8_t ecc_b = 0;
+        size_t minor;
+        for(minor = 0; minor < minor_count; minor++) {
+            uint8_t temp;
+            if(index < 4) {
+                temp = address[index];
+            } else {
+                temp = data[index - 4];
+            }
+            index += minor_inc;
+            if(index >= size) { index -= size; }
+            ecc_a ^= temp;
+            ecc_b ^= temp;
+            ecc_a = ecc_f_lut[ecc_a];
+        }
+        ecc_a = ecc_b_lut[ecc_f_lut[ecc_a] ^ ecc_b];
+        ecc[major              ] = (ecc_a        );
+        ecc[major + major_count] = (ecc_a ^ ecc_b);
+    }
+}
+
+//
+// Check ECC P and Q codes for a sector
+// Returns true if the ECC data is an exact match
+//
+int8_t ecc_checksector(
+    const uint8_t *address,
+    const uint8_t *data,
+    const uint8_t *ecc
+) {
+    return
+        ecc_checkpq(address, data, 86, 24,  2, 86, ecc) &&      // P
+        ecc_checkpq(address, data, 52, 43, 86, 88, ecc + 0xAC); // Q
+}
+
+//
+// Write ECC P and Q codes for a sector
+//
+void ecc_writesector(
+    const uint8_t *address,
+    const uint8_t *data,
+    uint8_t *ecc
+) {
+    ecc_writepq(address, data, 86, 24,  2, 86, ecc);        // P
+    ecc_writepq(address, data, 52, 43, 86, 88, ecc + 0xAC); // Q
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+const uint8_t zeroaddress[4] = {0, 0, 0, 0};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Check if this is a sector we can compress
+//
+// Sector types:
+//   0: Literal bytes (not a sector)
+//   1: 2352 mode 1         predict sync, mode, reserved, edc, ecc
+//   2: 2336 mode 2 form 1  predict redundant flags, edc, ecc
+//   3: 2336 mode 2 form 2  predict redundant flags, edc
+//
+// Extended format only (see detect_sector_extended):
+//   4: 2352 mode 2 form 1  predict sync, address, mode, redundant flags, edc, ecc
+//   5: 2352 mode 2 form 2  predict sync, address, mode, redundant flags, edc
+//   6: 2352 mode 1         predict sync, address, mode, reserved, edc, ecc
+//
+// Kept static so that it's inlined into detect_sector_extended(), which the
+// encoder calls at every position that isn't a sector
+//
+static int8_t detect_classic(const uint8_t* sector, size_t size_available) {
+    if(
+        size_available >= 2352 &&
+        sector[0x000] == 0x00 && // sync (12 bytes)
+        sector[0x001] == 0xFF &&
+        sector[0x002] == 0xFF &&
+        sector[0x003] == 0xFF &&
+        sector[0x004] == 0xFF &&
+        sector[0x005] == 0xFF &&
+        sector[0x006] == 0xFF &&
+        sector[0x007] == 0xFF &&
+        sector[0x008] == 0xFF &&
+        sector[0x009] == 0xFF &&
+        sector[0x00A] == 0xFF &&
+        sector[0x00B] == 0x00 &&
+        sector[0x00F] == 0x01 && // mode (1 byte)
+        sector[0x814] == 0x00 && // reserved (8 bytes)
+        sector[0x815] == 0x00 &&
+        sector[0x816] == 0x00 &&
+        sector[0x817] == 0x00 &&
+        sector[0x818] == 0x00 &&
+        sector[0x819] == 0x00 &&
+        sector[0x81A] == 0x00 &&
+        sector[0x81B] == 0x00
+    ) {
+        //
+        // Might be Mode 1
+        //
+        if(
+            ecc_checksector(
+                sector + 0xC,
+                sector + 0x10,
+                sector + 0x81C
+            ) &&
+            edc_compute(0, sector, 0x810) == get32lsb(sector + 0x810)
+        ) {
+            return 1; // Mode 1
+        }
+
+    } else if(
+        size_available >= 2336 &&
+        sector[0] == sector[4] && // flags (4 bytes)
+        sector[1] == sector[5] && //   versus redundant copy
+        sector[2] == sector[6] &&
+        sector[3] == sector[7]
+    ) {
+        //
+        // Might be Mode 2, Form 1 or 2
+        //
+        if(
+            ecc_checksector(
+                zeroaddress,
+                sector,
+                sector + 0x80C
+            ) &&
+            edc_compute(0, sector, 0x808) == get32lsb(sector + 0x808)
+        ) {
+            return 2; // Mode 2, Form 1
+        }
+        //
+        // Might be Mode 2, Form 2
+        //
+        if(
+            edc_compute(0, sector, 0x91C) == get32lsb(sector + 0x91C)
+        ) {
+            return 3; // Mode 2, Form 2
+        }
+    }
+
+    //
+    // Nothing
+    //
+    return 0;
+}
+
+int8_t detect_sector(const uint8_t* sector, size_t size_available) {
+    return detect_classic(sector, size_available);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Check if this is a sector we can compress, also considering the sector types
+// which only exist in the extended format
+//
+// Raw (2352) mode 2 sectors are detected as a whole, so a run of them becomes a
+// single record instead of a literal header plus a type 2/3 record per sector
+//
+// Mode 1 sectors become type 6, so runs of consecutive addresses don't need to
+// store the address of every sector
+//
+int8_t detect_sector_extended(const uint8_t* sector, size_t size_available) {
+    if(
+        size_available >= 2352 &&
+        sector[0x000] == 0x00 && // sync (12 bytes)
+        sector[0x001] == 0xFF &&
+        sector[0x002] == 0xFF &&
+        sector[0x003] == 0xFF &&
+        sector[0x004] == 0xFF &&
+        sector[0x005] == 0xFF &&
+        sector[0x006] == 0xFF &&
+        sector[0x007] == 0xFF &&
+        sector[0x008] == 0xFF &&
+        sector[0x009] == 0xFF &&
+        sector[0x00A] == 0xFF &&
+        sector[0x00B] == 0x00 &&
+        sector[0x00F] == 0x02    // mode (1 byte)
+    ) {
+        switch(detect_classic(sector + 0x10, 2336)) {
+        case 2: return 4; // Mode 2, Form 1
+        case 3: return 5; // Mode 2, Form 2
+        }
+    }
+
+    const int8_t type = detect_classic(sector, size_available);
+    return (type == 1) ? 6 : type;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Reconstruct a sector based on type
+//
+void reconstruct_sector(
+    uint8_t* sector, // must point to a full 2352-byte sector
+    int8_t type
+) {
+    //
+    // Sync
+    //
+    sector[0x000] = 0x00;
+    sector[0x001] = 0xFF;
+    sector[0x002] = 0xFF;
+    sector[0x003] = 0xFF;
+    sector[0x004] = 0xFF;
+    sector[0x005] = 0xFF;
+    sector[0x006] = 0xFF;
+    sector[0x007] = 0xFF;
+    sector[0x008] = 0xFF;
+    sector[0x009] = 0xFF;
+    sector[0x00A] = 0xFF;
+    sector[0x00B] = 0x00;
+
+    switch(type) {
+    case 1:
+        //
+        // Mode
+        //
+        sector[0x00F] = 0x01;
+        //
+        // Reserved
+        //
+        sector[0x814] = 0x00;
+        sector[0x815] = 0x00;
+        sector[0x816] = 0x00;
+        sector[0x817] = 0x00;
+        sector[0x818] = 0x00;
+        sector[0x819] = 0x00;
+        sector[0x81A] = 0x00;
+        sector[0x81B] = 0x00;
+        break;
+    case 2:
+    case 3:
+        //
+        // Mode
+        //
+        sector[0x00F] = 0x02;
+        //
+        // Flags
+        //
+        sector[0x010] = sector[0x014];
+        sector[0x011] = sector[0x015];
+        sector[0x012] = sector[0x016];
+        sector[0x013] = sector[0x017];
+        break;
+    }
+
+    //
+    // Compute EDC
+    //
+    switch(type) {
+    case 1: put32lsb(sector+0x810, edc_compute(0, sector     , 0x810)); break;
+    case 2: put32lsb(sector+0x818, edc_compute(0, sector+0x10, 0x808)); break;
+    case 3: put32lsb(sector+0x92C, edc_compute(0, sector+0x10, 0x91C)); break;
+    }
+
+    //
+    // Compute ECC
+    //
+    switch(type) {
+    case 1: ecc_writesector(sector+0xC , sector+0x10, sector+0x81C); break;
+    case 2: ecc_writesector(zeroaddress, sector+0x10, sector+0x81C); break;
+    }
+
+    //
+    // Done
+    //
+}
+
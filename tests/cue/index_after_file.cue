@@ -0,0 +1,7 @@
+FILE "Game (Track 1).bin" BINARY
+  TRACK 01 MODE2/2352
+    INDEX 01 00:00:00
+  TRACK 02 AUDIO
+FILE "Game (Track 2).bin" BINARY
+    INDEX 00 00:00:00
+    INDEX 01 00:02:00
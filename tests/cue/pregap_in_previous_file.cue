@@ -0,0 +1,10 @@
+FILE "Game (Track 1).bin" BINARY
+  TRACK 01 MODE1/2352
+    INDEX 01 00:00:00
+  TRACK 02 AUDIO
+    INDEX 00 10:00:00
+FILE "Game (Track 2).bin" BINARY
+    INDEX 01 00:00:00
+  TRACK 03 AUDIO
+    INDEX 00 02:30:00
+    INDEX 01 02:32:00
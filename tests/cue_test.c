@@ -0,0 +1,100 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2022      Antonio Fermiano
+//
+// This file is part of libecm.
+//
+// libecm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libecm is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// Parses the cue sheets of tests/cue and checks the track layout found for
+// each of their files
+//
+
+#include "ecm.h"
+
+typedef struct _Expected {
+    const char* name;
+    int file_count;
+    int track_count;
+    Track tracks[4];
+} Expected;
+
+static const Expected expected[] = {
+    //
+    // The pregap of track 2 ends the first file, the rest of it starts the
+    // second one
+    //
+    { "pregap_in_previous_file.cue", 2, 4, {
+        { 0, 0,     TRACK_MODE1, 2352 },
+        { 0, 45000, TRACK_AUDIO, 2352 },
+        { 1, 0,     TRACK_AUDIO, 2352 },
+        { 1, 11250, TRACK_AUDIO, 2352 } } },
+    //
+    // Track 2 is declared before the FILE line its INDEX entries refer to
+    //
+    { "index_after_file.cue", 2, 2, {
+        { 0, 0, TRACK_MODE2, 2352 },
+        { 1, 0, TRACK_AUDIO, 2352 } } },
+};
+
+int main(int argc, char** argv) {
+    char path[1024];
+    CueSheet cue_sheet;
+    int failed = 0;
+    size_t i;
+    int t;
+
+    if(argc != 2) {
+        fprintf(stderr, "Usage: cue_test <directory of the cue sheets>\n");
+        return 2;
+    }
+
+    for(i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+        const Expected* e = &expected[i];
+        FailureReason ret;
+
+        snprintf(path, sizeof(path), "%s/%s", argv[1], e->name);
+        ret = parse_cue_sheet(path, &cue_sheet);
+        if(ret != SUCCESS) {
+            fprintf(stderr, "%s: %s\n", e->name, failure_reason_names[ret]);
+            failed++;
+            continue;
+        }
+        if(cue_sheet.file_count != e->file_count || cue_sheet.track_count != e->track_count) {
+            fprintf(stderr, "%s: %d files and %d tracks, expected %d and %d\n",
+                e->name, cue_sheet.file_count, cue_sheet.track_count, e->file_count, e->track_count);
+            failed++;
+            continue;
+        }
+        for(t = 0; t < e->track_count; t++) {
+            const Track* found = &cue_sheet.tracks[t];
+            const Track* track = &e->tracks[t];
+            if(
+                found->file != track->file ||
+                found->lba != track->lba ||
+                found->mode != track->mode ||
+                found->sector_size != track->sector_size
+            ) {
+                fprintf(stderr, "%s: track %d is in file %d at %d (mode %d, %d bytes), expected file %d at %d (mode %d, %d bytes)\n",
+                    e->name, t, found->file, found->lba, found->mode, found->sector_size,
+                    track->file, track->lba, track->mode, track->sector_size);
+                failed++;
+            }
+        }
+    }
+
+    return failed ? 1 : 0;
+}
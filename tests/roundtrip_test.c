@@ -0,0 +1,538 @@
+////////////////////////////////////////////////////////////////////////////////
+// Copyright (C) 2022      Antonio Fermiano
+//
+// This file is part of libecm.
+//
+// libecm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libecm is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// Encodes a synthetic image in each of the ways below, in a scratch
+// directory, decodes it back and checks that it's the same byte for byte
+//
+
+#include "ecm.h"
+#include "sector.h"
+
+#if defined(_POSIX_VERSION)
+#include <sys/wait.h>
+// Needs fork() to stop a conversion the way a crash would
+#define CRASH_TEST 1
+#endif
+
+#define MAX_STEP_IN_BYTES 0x10000
+#define CHECKPOINT_INTERVAL_BYTES 0x40000
+#define PATH_SIZE 1024
+
+//
+// The image: a data track, whose sectors partly repeat earlier ones, an XA
+// track and an audio track
+//
+#define MODE1_SECTORS 300
+#define XA_SECTORS 150
+#define AUDIO_SECTORS 150
+#define IMAGE_SECTORS (MODE1_SECTORS + XA_SECTORS + AUDIO_SECTORS)
+#define IMAGE_SIZE ((size_t)IMAGE_SECTORS * 2352)
+
+// Every REPEAT_EVERY sectors, the data track repeats the payload of the
+// sector REPEAT_DISTANCE before
+#define REPEAT_EVERY 3
+#define REPEAT_DISTANCE 50
+
+static const Track tracks[] = {
+    { 0, 0,                          TRACK_MODE1, 2352 },
+    { 0, MODE1_SECTORS,              TRACK_MODE2, 2352 },
+    { 0, MODE1_SECTORS + XA_SECTORS, TRACK_AUDIO, 2352 },
+};
+
+#define TRACK_COUNT ((int)(sizeof(tracks) / sizeof(tracks[0])))
+
+static uint8_t* image;
+static const char* directory;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// The image and its files
+//
+
+static uint32_t random_state = 0x12345678u;
+
+static uint32_t next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static void fill_random(uint8_t* data, size_t size) {
+    size_t i;
+    for(i = 0; i < size; i++) {
+        data[i] = (uint8_t)(next_random() >> 24);
+    }
+}
+
+static uint8_t to_bcd(uint32_t value) {
+    return (uint8_t)(((value / 10) << 4) | (value % 10));
+}
+
+static void make_image(void) {
+    uint32_t i;
+    for(i = 0; i < IMAGE_SECTORS; i++) {
+        uint8_t* sector = image + (size_t)i * 2352;
+        const uint32_t address = i + 150;
+        if(i >= MODE1_SECTORS + XA_SECTORS) {
+            fill_random(sector, 2352);
+            continue;
+        }
+        fill_random(sector + 0x010, 2352 - 0x010);
+        sector[0x00C] = to_bcd(address / (60 * 75));
+        sector[0x00D] = to_bcd((address / 75) % 60);
+        sector[0x00E] = to_bcd(address % 75);
+        if(i < MODE1_SECTORS) {
+            if(i >= REPEAT_DISTANCE && i % REPEAT_EVERY == 0) {
+                memcpy(sector + 0x010, sector - REPEAT_DISTANCE * 2352 + 0x010, 0x800);
+            }
+            reconstruct_sector(sector, 1);
+        } else {
+            // Form 1 with some form 2 in between
+            sector[0x014] = 0x00;
+            sector[0x015] = 0x00;
+            sector[0x016] = (i % 8 < 6) ? 0x08 : 0x20;
+            sector[0x017] = 0x00;
+            reconstruct_sector(sector, (i % 8 < 6) ? 2 : 3);
+        }
+    }
+}
+
+static char* path(char* buffer, const char* name) {
+    snprintf(buffer, PATH_SIZE, "%s/%s", directory, name);
+    remove(buffer);
+    return buffer;
+}
+
+static int8_t write_file(const char* name, const uint8_t* data, size_t size) {
+    FILE* f = fopen(name, "wb");
+    int8_t ok;
+    if(f == NULL) {
+        return 0;
+    }
+    ok = fwrite(data, 1, size, f) == size;
+    return (fclose(f) == 0) && ok;
+}
+
+//
+// Whether the file holds exactly these bytes
+//
+static int8_t same_file(const char* name, const uint8_t* data, size_t size) {
+    uint8_t buffer[0x1000];
+    size_t done = 0;
+    size_t read;
+    int8_t same = 1;
+    FILE* f = fopen(name, "rb");
+    if(f == NULL) {
+        return 0;
+    }
+    while(same && (read = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        same = done + read <= size && memcmp(buffer, data + done, read) == 0;
+        done += read;
+    }
+    fclose(f);
+    return same && done == size;
+}
+
+static off_t file_size(const char* name) {
+    struct stat status;
+    return (stat(name, &status) == 0) ? status.st_size : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Conversions
+//
+
+// Steps the conversions took so far
+static int steps;
+
+static FailureReason finish_encoding(Progress* progress) {
+    while(progress->state == IN_PROGRESS) {
+        encode(progress);
+        steps++;
+    }
+    return (progress->state == COMPLETED) ? SUCCESS : progress->failure_reason;
+}
+
+static FailureReason finish_decoding(Progress* progress) {
+    while(progress->state == IN_PROGRESS) {
+        decode(progress);
+        steps++;
+    }
+    return (progress->state == COMPLETED) ? SUCCESS : progress->failure_reason;
+}
+
+static FailureReason encode_file(char* input, char* output, const EncodingOptions* options) {
+    Progress progress;
+    FailureReason ret = prepare_encoding_with_options(input, output, MAX_STEP_IN_BYTES, options, &progress);
+    return (ret != SUCCESS) ? ret : finish_encoding(&progress);
+}
+
+static FailureReason decode_file(char* input, char* output, const DecodingOptions* options) {
+    Progress progress;
+    FailureReason ret = prepare_decoding_with_options(input, output, MAX_STEP_IN_BYTES, options, &progress);
+    return (ret != SUCCESS) ? ret : finish_decoding(&progress);
+}
+
+//
+// Encode the image with these options, decode it back with those and compare
+//
+static int round_trip(const char* name, const EncodingOptions* encoding, const DecodingOptions* decoding) {
+    char input[PATH_SIZE];
+    char ecm[PATH_SIZE];
+    char output[PATH_SIZE];
+    FailureReason ret;
+
+    snprintf(input, PATH_SIZE, "%s/image.bin", directory);
+    ret = encode_file(input, path(ecm, "image.ecm"), encoding);
+    if(ret == SUCCESS) {
+        ret = decode_file(ecm, path(output, "image.out"), decoding);
+    }
+    if(ret != SUCCESS) {
+        fprintf(stderr, "%s: %s\n", name, failure_reason_names[ret]);
+        return 1;
+    }
+    if(!same_file(output, image, IMAGE_SIZE)) {
+        fprintf(stderr, "%s: the decoded image differs\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Cases
+//
+
+static int test_plain(void) {
+    EncodingOptions encoding;
+    DecodingOptions decoding;
+    init_encoding_options(&encoding);
+    init_decoding_options(&decoding);
+    return round_trip("plain", &encoding, &decoding);
+}
+
+static int test_dedup(void) {
+    EncodingOptions encoding;
+    DecodingOptions decoding;
+    init_encoding_options(&encoding);
+    init_decoding_options(&decoding);
+    encoding.dedup_table_size = 4096;
+    return round_trip("dedup", &encoding, &decoding);
+}
+
+static int test_dictionary(void) {
+    char dictionary[PATH_SIZE];
+    EncodingOptions encoding;
+    DecodingOptions decoding;
+    init_encoding_options(&encoding);
+    init_decoding_options(&decoding);
+    encoding.dictionary_file = decoding.dictionary_file = path(dictionary, "image.dictionary");
+    return round_trip("dictionary", &encoding, &decoding);
+}
+
+//
+// Decoded into a file per track
+//
+static int test_split(void) {
+    char input[PATH_SIZE];
+    char ecm[PATH_SIZE];
+    char names[TRACK_COUNT][PATH_SIZE];
+    char* track_file_names[TRACK_COUNT];
+    EncodingOptions encoding;
+    DecodingOptions decoding;
+    FailureReason ret;
+    int failed = 0;
+    int t;
+
+    init_encoding_options(&encoding);
+    init_decoding_options(&decoding);
+    for(t = 0; t < TRACK_COUNT; t++) {
+        char name[32];
+        snprintf(name, sizeof(name), "track%02d.bin", t + 1);
+        track_file_names[t] = path(names[t], name);
+    }
+    decoding.tracks = tracks;
+    decoding.track_count = TRACK_COUNT;
+    decoding.track_file_names = track_file_names;
+
+    snprintf(input, PATH_SIZE, "%s/image.bin", directory);
+    ret = encode_file(input, path(ecm, "image.ecm"), &encoding);
+    if(ret == SUCCESS) {
+        ret = decode_file(ecm, NULL, &decoding);
+    }
+    if(ret != SUCCESS) {
+        fprintf(stderr, "split: %s\n", failure_reason_names[ret]);
+        return 1;
+    }
+    for(t = 0; t < TRACK_COUNT; t++) {
+        const size_t start = (size_t)tracks[t].lba * 2352;
+        const size_t end = (t + 1 < TRACK_COUNT) ? (size_t)tracks[t + 1].lba * 2352 : IMAGE_SIZE;
+        if(!same_file(track_file_names[t], image + start, end - start)) {
+            fprintf(stderr, "split: track %d differs\n", t + 1);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+//
+// Two members, the image and its data track alone
+//
+static int test_archive(void) {
+    char input[PATH_SIZE];
+    char data[PATH_SIZE];
+    char archive[PATH_SIZE];
+    char output[PATH_SIZE];
+    static const char * const names[] = { "image.bin", "data.bin" };
+    const size_t sizes[] = { IMAGE_SIZE, (size_t)MODE1_SECTORS * 2352 };
+    char* inputs[2];
+    ArchiveDirectory archive_directory;
+    EncodingOptions encoding;
+    DecodingOptions decoding;
+    Progress progress;
+    FailureReason ret;
+    int failed = 0;
+    int i;
+
+    init_encoding_options(&encoding);
+    init_decoding_options(&decoding);
+    snprintf(input, PATH_SIZE, "%s/image.bin", directory);
+    if(!write_file(path(data, "data.bin"), image, sizes[1])) {
+        fprintf(stderr, "archive: can't write %s\n", data);
+        return 1;
+    }
+    inputs[0] = input;
+    inputs[1] = data;
+
+    ret = create_archive(path(archive, "image.ecma"));
+    for(i = 0; ret == SUCCESS && i < 2; i++) {
+        ret = prepare_archive_encoding(inputs[i], (char*)names[i], MAX_STEP_IN_BYTES, &encoding, &progress);
+        if(ret == SUCCESS) {
+            ret = finish_encoding(&progress);
+        }
+    }
+    if(ret == SUCCESS) {
+        ret = close_archive();
+    } else {
+        close_archive();
+    }
+    if(ret == SUCCESS) {
+        ret = read_archive_directory(archive, &archive_directory);
+    }
+    if(ret != SUCCESS) {
+        fprintf(stderr, "archive: %s\n", failure_reason_names[ret]);
+        return 1;
+    }
+    if(archive_directory.member_count != 2) {
+        fprintf(stderr, "archive: %d members, expected 2\n", archive_directory.member_count);
+        return 1;
+    }
+
+    for(i = 0; i < 2; i++) {
+        const ArchiveMember* member = &archive_directory.members[i];
+        if(strcmp(member->name, names[i]) != 0 || member->original_size != (off_t)sizes[i]) {
+            fprintf(stderr, "archive: member %d is %s of %lld bytes\n", i, member->name, (long long)member->original_size);
+            failed++;
+            continue;
+        }
+        ret = prepare_archive_decoding(archive, member, path(output, "member.out"), MAX_STEP_IN_BYTES, &decoding, &progress);
+        if(ret == SUCCESS) {
+            ret = finish_decoding(&progress);
+        }
+        if(ret != SUCCESS) {
+            fprintf(stderr, "archive: %s: %s\n", names[i], failure_reason_names[ret]);
+            failed++;
+        } else if(!same_file(output, image, sizes[i])) {
+            fprintf(stderr, "archive: %s differs\n", names[i]);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+#if defined(CRASH_TEST)
+
+//
+// Start the conversion in a child process, which dies without closing
+// anything a few steps after its first checkpoint. Returns whether it did
+//
+static int8_t crash(int8_t decoding, char* input, char* output, const EncodingOptions* encoding_options, const DecodingOptions* decoding_options) {
+    int status;
+    const pid_t pid = fork();
+    if(pid == 0) {
+        Progress progress;
+        const char* checkpoint = decoding ? decoding_options->checkpoint_file : encoding_options->checkpoint_file;
+        int steps_left = -1;
+        FailureReason ret = decoding ?
+            prepare_decoding_with_options(input, output, MAX_STEP_IN_BYTES, decoding_options, &progress) :
+            prepare_encoding_with_options(input, output, MAX_STEP_IN_BYTES, encoding_options, &progress);
+        while(ret == SUCCESS && progress.state == IN_PROGRESS && steps_left != 0) {
+            if(decoding) {
+                decode(&progress);
+            } else {
+                encode(&progress);
+            }
+            if(steps_left > 0) {
+                steps_left--;
+            } else if(file_size(checkpoint) >= 0) {
+                steps_left = 3;
+            }
+        }
+        _exit(steps_left == 0 ? 0 : 1);
+    }
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+//
+// Both ways, the conversion dies once it saved a checkpoint, and resuming it
+// must go on from there, in fewer steps than a whole conversion, and give the
+// same file
+//
+static int test_resume(void) {
+    char input[PATH_SIZE];
+    char ecm[PATH_SIZE];
+    char output[PATH_SIZE];
+    char checkpoint[PATH_SIZE];
+    EncodingOptions encoding;
+    DecodingOptions decoding;
+    Progress progress;
+    FailureReason ret;
+    int encoding_steps;
+    int decoding_steps;
+
+    init_encoding_options(&encoding);
+    init_decoding_options(&decoding);
+    encoding.checkpoint_file = decoding.checkpoint_file = path(checkpoint, "image.checkpoint");
+    encoding.checkpoint_interval_bytes = decoding.checkpoint_interval_bytes = CHECKPOINT_INTERVAL_BYTES;
+    snprintf(input, PATH_SIZE, "%s/image.bin", directory);
+    path(ecm, "image.ecm");
+    path(output, "image.out");
+
+    steps = 0;
+    ret = encode_file(input, ecm, &encoding);
+    encoding_steps = steps;
+    steps = 0;
+    if(ret == SUCCESS) {
+        ret = decode_file(ecm, output, &decoding);
+    }
+    decoding_steps = steps;
+    if(ret != SUCCESS) {
+        fprintf(stderr, "resume: %s\n", failure_reason_names[ret]);
+        return 1;
+    }
+    path(ecm, "image.ecm");
+    path(output, "image.out");
+
+    if(!crash(0, input, ecm, &encoding, &decoding)) {
+        fprintf(stderr, "resume: the encoding didn't stop after a checkpoint\n");
+        return 1;
+    }
+    steps = 0;
+    ret = resume_encoding(input, ecm, MAX_STEP_IN_BYTES, &encoding, &progress);
+    if(ret == SUCCESS) {
+        ret = finish_encoding(&progress);
+    }
+    if(ret != SUCCESS) {
+        fprintf(stderr, "resume: encoding: %s\n", failure_reason_names[ret]);
+        return 1;
+    }
+    if(steps >= encoding_steps || file_size(checkpoint) >= 0) {
+        fprintf(stderr, "resume: the encoding started over, or left its checkpoint\n");
+        return 1;
+    }
+
+    if(!crash(1, ecm, output, &encoding, &decoding)) {
+        fprintf(stderr, "resume: the decoding didn't stop after a checkpoint\n");
+        return 1;
+    }
+    steps = 0;
+    ret = resume_decoding(ecm, output, MAX_STEP_IN_BYTES, &decoding, &progress);
+    if(ret == SUCCESS) {
+        ret = finish_decoding(&progress);
+    }
+    if(ret != SUCCESS) {
+        fprintf(stderr, "resume: decoding: %s\n", failure_reason_names[ret]);
+        return 1;
+    }
+    if(steps >= decoding_steps || file_size(checkpoint) >= 0) {
+        fprintf(stderr, "resume: the decoding started over, or left its checkpoint\n");
+        return 1;
+    }
+
+    if(!same_file(output, image, IMAGE_SIZE)) {
+        fprintf(stderr, "resume: the decoded image differs\n");
+        return 1;
+    }
+    return 0;
+}
+
+#endif
+
+typedef struct _Case {
+    const char* name;
+    int (*run)(void);
+} Case;
+
+static const Case cases[] = {
+    { "plain",      test_plain },
+    { "dedup",      test_dedup },
+    { "dictionary", test_dictionary },
+    { "split",      test_split },
+    { "archive",    test_archive },
+#if defined(CRASH_TEST)
+    { "resume",     test_resume },
+#endif
+};
+
+int main(int argc, char** argv) {
+    char input[PATH_SIZE];
+    int failed = 0;
+    size_t i;
+
+    if(argc < 2) {
+        fprintf(stderr, "Usage: roundtrip_test <scratch directory> [case]\n");
+        return 2;
+    }
+    directory = argv[1];
+
+    eccedc_init();
+    image = malloc(IMAGE_SIZE);
+    if(image == NULL) {
+        return 2;
+    }
+    make_image();
+    if(!write_file(path(input, "image.bin"), image, IMAGE_SIZE)) {
+        fprintf(stderr, "Can't write %s\n", input);
+        return 2;
+    }
+
+    for(i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if(argc > 2 && strcmp(argv[2], cases[i].name) != 0) {
+            continue;
+        }
+        failed += cases[i].run();
+    }
+
+    free(image);
+    return failed ? 1 : 0;
+}